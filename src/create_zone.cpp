@@ -80,7 +80,10 @@ int ProcessInput(Irrigation::Sprinkler& sprinkler, const char* zoneFileName, str
             break;
 
         case 'p':
-            sprinkler.AddZonePoint();
+            if (sprinkler.AddZonePoint() != HwResult::Success)
+            {
+                message = "Zone point not added, sensors are not measured";
+            }
             break;
 
         case 's':
@@ -144,8 +147,9 @@ int main(int argc, char *argv[])
         {
             clear();
 
-            mvprintw(0, 0, "Nozzle position: %d", nozzle.GetPositionFetchIfStale());
-            int curPressure = nozzle.GetPressureFetchIfStale();
+            HwState state = nozzle.GetState();
+            mvprintw(0, 0, "Nozzle position: %d", state.rawAngle);
+            int curPressure = state.pressure;
             pressureAnalyzer.Push(curPressure);
             mvprintw(1, 0, "Nozzle pressure: %d", curPressure);
             mvprintw(2, 0, "Nozzle avg pressure: %d", pressureAnalyzer.AvgValue());
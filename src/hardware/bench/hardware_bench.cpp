@@ -0,0 +1,643 @@
+#include "I2cAccessor.h"
+#include "MagnetSensor.h"
+#include "NozzleControl.h"
+#include "PressureSensor.h"
+#include "SimulatedI2cBus.h"
+
+#include <IndexHeap.h>
+#include <IndexMpscQueue.h>
+#include <LatencyHistogram.h>
+#include <MathUtils.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Count heap allocations made by benchmarked code.
+static atomic<long> s_allocationsCount = 0;
+
+void* operator new(size_t size)
+{
+    s_allocationsCount.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(size);
+    if (p == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Prevents compiler from optimizing out benchmarked results.
+static volatile int s_sink = 0;
+
+struct BenchmarkResult
+{
+    double nsPerOp = 0.;
+    double allocationsPerOp = 0.;
+};
+
+template<typename F>
+static BenchmarkResult Measure(int iterations, F&& func)
+{
+    long allocationsStart = s_allocationsCount.load();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+        func(i);
+    }
+    auto end = chrono::steady_clock::now();
+    long allocations = s_allocationsCount.load() - allocationsStart;
+
+    BenchmarkResult result;
+    result.nsPerOp = chrono::duration<double, nano>(end - start).count() / iterations;
+    result.allocationsPerOp = static_cast<double>(allocations) / iterations;
+    return result;
+}
+
+static void PrintResult(const char* name, const BenchmarkResult& result)
+{
+    cout << "  " << name << ": " << result.nsPerOp << " ns/op, "
+        << result.allocationsPerOp << " allocations/op" << endl;
+}
+
+// InlineFunction vs std::function
+
+template<typename ValuePredicate, typename RecursionPredicate>
+static BenchmarkResult MeasureRecursivePredicate(int iterations, int pollsPerTransaction)
+{
+    return Measure(iterations, [pollsPerTransaction] (int i) {
+        // Same shape as SetPressureAsync predicate wrapped by NotifyWhenPressure
+        ValuePredicate isExpectedValue = [thresholdPressure = i, analyzer = SequenceTrendAnalyzer<16>()] (int curPressure) mutable {
+            analyzer.Push(curPressure);
+            return curPressure > thresholdPressure ? HwResult::Success : HwResult::Repeat;
+        };
+        int lastPressure = 0;
+        RecursionPredicate isRecursionCompleted = [&lastPressure, checkPressure = move(isExpectedValue)] {
+            return checkPressure(lastPressure);
+        };
+
+        // Transaction slot takes ownership
+        RecursionPredicate slot = move(isRecursionCompleted);
+        for (int poll = 0; poll < pollsPerTransaction; ++poll)
+        {
+            lastPressure = poll;
+            s_sink = s_sink + static_cast<int>(slot());
+        }
+    });
+}
+
+static void BenchmarkInlineFunction()
+{
+    static constexpr int c_iterations = 1'000'000;
+
+    for (int pollsPerTransaction : { 1, 100 })
+    {
+        cout << " Recursive predicate, " << pollsPerTransaction << " poll(s) per transaction" << endl;
+        PrintResult("std::function", MeasureRecursivePredicate<
+            function<HwResult(int)>, function<HwResult()>>(c_iterations, pollsPerTransaction));
+        PrintResult("InlineFunction", MeasureRecursivePredicate<
+            HwValuePredicate, I2cRecursionPredicate>(c_iterations, pollsPerTransaction));
+    }
+}
+
+// Sensor reads as they were implemented with separate syscalls per step
+static void FillLegacyPressureTransaction(I2cTransaction& transaction)
+{
+    transaction.AddCommand([] (I2cBus& i2cBus, std::chrono::milliseconds& delayNextCommand) {
+        static constexpr uint8_t requestMeasurementCmd[] = { 0xAA, 0x00, 0x00 };
+        if (i2cBus.Write(requestMeasurementCmd, sizeof(requestMeasurementCmd)) != sizeof(requestMeasurementCmd))
+        {
+            return HwResult::CommFailure;
+        }
+        delayNextCommand = 3ms;
+        return HwResult::Next;
+    });
+    transaction.AddCommand([] (I2cBus& i2cBus, std::chrono::milliseconds& delayNextCommand) {
+        uint8_t status = 0;
+        if (i2cBus.Read(&status, 1) < 0)
+        {
+            return HwResult::CommFailure;
+        }
+        if ((status & 0x20) == 0 || (status == 0xFF))
+        {
+            return HwResult::Next;
+        }
+        delayNextCommand = 1ms;
+        return HwResult::Repeat;
+    });
+    transaction.AddCommand([] (I2cBus& i2cBus, std::chrono::milliseconds& /*delayNextCommand*/) {
+        uint8_t readBuff[4];
+        if (i2cBus.Read(readBuff, sizeof(readBuff)) != sizeof(readBuff))
+        {
+            return HwResult::CommFailure;
+        }
+        return HwResult::Completed;
+    });
+}
+
+static void FillLegacyAngleTransaction(I2cTransaction& transaction)
+{
+    transaction.AddCommand([] (I2cBus& i2cBus, std::chrono::milliseconds& /*delayNextCommand*/) {
+        // Same as SMBus read word data
+        uint8_t angle[2];
+        return i2cBus.ReadRegisters(0x36, 0x0E, angle, 2) < 0 ? HwResult::CommFailure : HwResult::Completed;
+    });
+}
+
+static double MeasureLegacySyscallsPerSample(I2cAccessor& i2cAccessor, SimulatedI2cBus& i2cBus, int deviceAddress,
+    void (*fillTransaction)(I2cTransaction&), int samplesCount)
+{
+    int samples = 0;
+    I2cTransaction transaction = i2cAccessor.CreateTransaction(deviceAddress);
+    fillTransaction(transaction);
+    transaction.MakeRecursive([&samples, samplesCount] {
+        return ++samples < samplesCount ? HwResult::Repeat : HwResult::Success;
+    }, 0ms);
+    auto future = transaction.GetFuture();
+
+    uint64_t syscallsStart = i2cBus.GetOperationsCount();
+    i2cAccessor.PushTransaction(move(transaction));
+    future.wait();
+    return static_cast<double>(i2cBus.GetOperationsCount() - syscallsStart) / samples;
+}
+
+static void BenchmarkBatchSyscalls()
+{
+    static constexpr int c_samplesCount = 200;
+
+    // Every operation of the simulated bus is a syscall with LinuxI2cBus
+    auto spI2cBus = make_unique<SimulatedI2cBus>();
+    SimulatedI2cBus& i2cBus = *spI2cBus;
+    I2cAccessor i2cAccessor;
+    if (i2cAccessor.Init(move(spI2cBus)) != 0)
+    {
+        return;
+    }
+
+    PressureSensor pressureSensor(i2cAccessor);
+    MagnetSensor magnetSensor(i2cAccessor);
+
+    auto countSamples = [] (int& samples, int samplesCount) {
+        return [&samples, samplesCount] (int) {
+            return ++samples < samplesCount ? HwResult::Repeat : HwResult::Success;
+        };
+    };
+
+    cout << " Syscalls per sample" << endl;
+
+    cout << "  pressure, separate commands: "
+        << MeasureLegacySyscallsPerSample(i2cAccessor, i2cBus, 0x18, FillLegacyPressureTransaction, c_samplesCount) << endl;
+
+    {
+        int samples = 0;
+        uint64_t syscallsStart = i2cBus.GetOperationsCount();
+        pressureSensor.NotifyWhenPressure(countSamples(samples, c_samplesCount), [] (HwResult) {}).wait();
+        cout << "  pressure, batch commands: "
+            << static_cast<double>(i2cBus.GetOperationsCount() - syscallsStart) / samples << endl;
+    }
+
+    cout << "  angle, separate commands: "
+        << MeasureLegacySyscallsPerSample(i2cAccessor, i2cBus, 0x36, FillLegacyAngleTransaction, c_samplesCount) << endl;
+    cout << "  device selections saved for separate commands: " << i2cAccessor.GetSavedSelectIoctlsCount() << endl;
+
+    {
+        int samples = 0;
+        uint64_t syscallsStart = i2cBus.GetOperationsCount();
+        magnetSensor.NotifyWhenAngle(countSamples(samples, c_samplesCount), [] (HwResult) {}).wait();
+        cout << "  angle, batch commands: "
+            << static_cast<double>(i2cBus.GetOperationsCount() - syscallsStart) / samples << endl;
+    }
+
+    {
+        // Both sensors polled at the same time, due batches are combined
+        int pressureSamples = 0;
+        int angleSamples = 0;
+        uint64_t syscallsStart = i2cBus.GetOperationsCount();
+        auto pressureFuture = pressureSensor.NotifyWhenPressure(countSamples(pressureSamples, c_samplesCount), [] (HwResult) {});
+        auto angleFuture = magnetSensor.NotifyWhenAngle(countSamples(angleSamples, c_samplesCount), [] (HwResult) {});
+        pressureFuture.wait();
+        angleFuture.wait();
+        cout << "  pressure and angle, batch commands: "
+            << static_cast<double>(i2cBus.GetOperationsCount() - syscallsStart) / (pressureSamples + angleSamples) << endl;
+    }
+}
+
+static void BenchmarkPressureSampleRate()
+{
+    static constexpr int c_samplesCount = 200;
+
+    auto spI2cBus = make_unique<SimulatedI2cBus>();
+    SimulatedI2cBus& i2cBus = *spI2cBus;
+    I2cAccessor i2cAccessor;
+    if (i2cAccessor.Init(move(spI2cBus)) != 0)
+    {
+        return;
+    }
+
+    cout << " Samples per second, bus operations per sample" << endl;
+    for (auto conversionTime : { 1500us, 3500us })
+    {
+        i2cBus.GetPressureSensor().SetConversionTime(conversionTime);
+        for (bool isAdaptive : { false, true })
+        {
+            PressureSensor pressureSensor(i2cAccessor);
+            pressureSensor.SetAdaptiveConversion(isAdaptive);
+
+            // Model converges before the measurement
+            int samples = 0;
+            auto countSamples = [&samples] (int) { return ++samples < c_samplesCount ? HwResult::Repeat : HwResult::Success; };
+            pressureSensor.StartContinuousMeasurement(countSamples).wait();
+
+            samples = 0;
+            uint64_t operationsStart = i2cBus.GetOperationsCount();
+            auto start = chrono::steady_clock::now();
+            pressureSensor.StartContinuousMeasurement(countSamples).wait();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            cout << "  conversion " << conversionTime.count() << " us, " << (isAdaptive ? "adaptive" : "fixed 3 ms")
+                << ": " << static_cast<int>(samples / seconds) << " samples/s, "
+                << static_cast<double>(i2cBus.GetOperationsCount() - operationsStart) / samples << " operations";
+            if (isAdaptive)
+            {
+                cout << ", learnt " << pressureSensor.GetConversionTime().count() << " us";
+            }
+            cout << endl;
+        }
+    }
+}
+
+static void BenchmarkApproachPolling()
+{
+    static constexpr int c_runsCount = 10;
+    static constexpr int c_distance = 3000;
+    static constexpr int c_velocity = 8000;
+
+    auto spI2cBus = make_unique<SimulatedI2cBus>();
+    SimulatedI2cBus& i2cBus = *spI2cBus;
+    SimulatedMagnetSensor& simulatedSensor = i2cBus.GetMagnetSensor();
+    I2cAccessor i2cAccessor;
+    if (i2cAccessor.Init(move(spI2cBus)) != 0)
+    {
+        return;
+    }
+
+    cout << " Rotation by " << c_distance << " at " << c_velocity << " units/s, motor stops when the sensor sees the stop point"
+        << " or at the predicted crossing" << endl;
+    enum class Mode { Fixed, Adaptive, Scheduled };
+    for (Mode mode : { Mode::Fixed, Mode::Adaptive, Mode::Scheduled })
+    {
+        uint64_t operationsCount = 0;
+        int totalError = 0;
+        int maxError = 0;
+        for (int i = 0; i < c_runsCount; ++i)
+        {
+            MagnetSensor magnetSensor(i2cAccessor);
+            simulatedSensor.SetVelocity(0);
+            simulatedSensor.SetAngle(i * 400);
+            magnetSensor.ReadSampleAsync().Get();
+            int64_t targetAngle = magnetSensor.GetUnwrappedAngle() + c_distance;
+            int stopAngle = MagnetSensor::WrapAngle(static_cast<int>(targetAngle));
+
+            uint64_t operationsStart = i2cBus.GetOperationsCount();
+            simulatedSensor.SetVelocity(c_velocity);
+            HwCompletionAction stopAction = [&simulatedSensor] (HwResult) { simulatedSensor.SetVelocity(0); };
+            if (mode == Mode::Scheduled)
+            {
+                magnetSensor.ScheduleStopWhenApproaching(targetAngle, 1, 0, move(stopAction)).wait();
+            }
+            else
+            {
+                magnetSensor.NotifyWhenApproaching(targetAngle, 1, 0, move(stopAction), mode == Mode::Adaptive).wait();
+            }
+            operationsCount += i2cBus.GetOperationsCount() - operationsStart;
+
+            int error = MagnetSensor::GetAngleDiff(stopAngle, simulatedSensor.GetAngle());
+            totalError += abs(error);
+            maxError = max(maxError, abs(error));
+        }
+        const char* modeName = mode == Mode::Fixed ? "fixed 2 ms" : mode == Mode::Adaptive ? "adaptive" : "scheduled";
+        cout << "  " << modeName << ": " << operationsCount / c_runsCount
+            << " bus operations, stop error mean " << totalError / c_runsCount << ", max " << maxError << endl;
+    }
+}
+
+static void BenchmarkSimulatedNozzle()
+{
+    static constexpr int c_rotationsCount = 8;
+    static constexpr int c_rotation = MagnetSensor::c_angleRange / 3;
+
+    NozzleControl nozzle;
+    nozzle.SetCloseValveOnExit(false);
+    if (nozzle.InitSimulated() != 0)
+    {
+        return;
+    }
+    nozzle.StartMonitoring();
+
+    cout << " NozzleControl on simulated motors, rotations by " << c_rotation << " at full duty" << endl;
+    vector<int> errors;
+    for (int i = 0; i < c_rotationsCount; ++i)
+    {
+        int targetAngle = MagnetSensor::WrapAngle(nozzle.GetPositionFetch() + c_rotation);
+        nozzle.RotateToAsync(targetAngle, 100).wait();
+        // Coasted to a stop
+        this_thread::sleep_for(300ms);
+        errors.push_back(MagnetSensor::GetAngleDiff(targetAngle, nozzle.GetPositionFetch()));
+    }
+    cout << "  stop errors while the coast is learnt:";
+    for (int error : errors)
+    {
+        cout << " " << error;
+    }
+    cout << endl;
+}
+
+static void PrintLatencyStats(const char* name, const I2cLatencyStats& stats)
+{
+    cout << "  " << name << ": " << stats.commandsCount << " commands, mean "
+        << stats.GetMeanLatency().count() << " us, max " << stats.maxLatency.count() << " us, "
+        << stats.missedDeadlinesCount << " missed deadlines" << endl;
+}
+
+static void BenchmarkPriorityLatency()
+{
+    // 100 kHz bus: about 90 us per byte
+    auto spI2cBus = make_unique<SimulatedI2cBus>();
+    spI2cBus->SetLatency(50us, 90us);
+    I2cAccessor i2cAccessor;
+    if (i2cAccessor.Init(move(spI2cBus)) != 0)
+    {
+        return;
+    }
+
+    PressureSensor pressureSensor(i2cAccessor);
+    MagnetSensor magnetSensor(i2cAccessor);
+
+    // Angle watch while pressure is polled continuously
+    auto stopTime = chrono::steady_clock::now() + 500ms;
+    auto pressureFuture = pressureSensor.StartContinuousMeasurement([stopTime] (int) {
+        return chrono::steady_clock::now() < stopTime ? HwResult::Repeat : HwResult::Success;
+    });
+    auto angleFuture = magnetSensor.NotifyWhenAngle([stopTime] (int) {
+        return chrono::steady_clock::now() < stopTime ? HwResult::Repeat : HwResult::Success;
+    }, [] (HwResult) {});
+    pressureFuture.wait();
+    angleFuture.wait();
+
+    cout << " Bus latency of due commands" << endl;
+    PrintLatencyStats("motion critical", i2cAccessor.GetLatencyStats(I2cPriority::MotionCritical));
+    PrintLatencyStats("control", i2cAccessor.GetLatencyStats(I2cPriority::Control));
+    PrintLatencyStats("telemetry", i2cAccessor.GetLatencyStats(I2cPriority::Telemetry));
+}
+
+static void PrintJitter(const char* name, const LatencyHistogram<2000, 10>& histogram)
+{
+    cout << "  " << name << ": p50 " << histogram.GetPercentile(50).count() << " us, p99 "
+        << histogram.GetPercentile(99).count() << " us, max " << histogram.GetMax().count() << " us" << endl;
+}
+
+static I2cTask WaitPeriods(int periodsCount, chrono::microseconds period)
+{
+    for (int i = 0; i < periodsCount; ++i)
+    {
+        co_await I2cAsyncBus::Delay(period);
+    }
+    co_return HwResult::Success;
+}
+
+static void BenchmarkWakeupJitter()
+{
+    static constexpr int c_periodsCount = 500;
+    static constexpr auto c_period = 2ms;
+
+    cout << " Wakeup error for " << c_periodsCount << " delays of 2 ms" << endl;
+
+    {
+        // Previous loop implementation
+        mutex m;
+        condition_variable cv;
+        LatencyHistogram<2000, 10> histogram;
+        unique_lock lk(m);
+        for (int i = 0; i < c_periodsCount; ++i)
+        {
+            auto wakeupTime = chrono::steady_clock::now() + c_period;
+            cv.wait_until(lk, wakeupTime);
+            histogram.Add(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - wakeupTime));
+        }
+        PrintJitter("condition_variable::wait_until", histogram);
+    }
+
+    I2cAccessor i2cAccessor;
+    if (i2cAccessor.Init(make_unique<SimulatedI2cBus>()) != 0)
+    {
+        return;
+    }
+    I2cTransaction transaction = i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(WaitPeriods(c_periodsCount, c_period));
+    auto future = transaction.GetFuture();
+    i2cAccessor.PushTransaction(move(transaction));
+    future.wait();
+
+    I2cJitterReport report = i2cAccessor.GetWakeupJitter();
+    cout << "  I2cAccessor timerfd: p50 " << report.p50.count() << " us, p99 " << report.p99.count()
+        << " us, max " << report.max.count() << " us" << endl;
+}
+
+static constexpr int c_producersCount = 4;
+
+static void PrintPushLatency(const char* name, vector<long>& pushNs)
+{
+    sort(pushNs.begin(), pushNs.end());
+    auto percentile = [&pushNs] (int p) { return pushNs[(pushNs.size() - 1) * p / 100]; };
+    cout << "  " << name << ": p50 " << percentile(50) << " ns, p99 " << percentile(99) << " ns, max "
+        << pushNs.back() << " ns" << endl;
+}
+
+// Producers submit indices to a consumer which holds the queue for heap manipulation like the bus thread
+template<typename Prepare, typename Submit, typename Consume>
+static vector<long> MeasureSubmissions(int submissionsPerProducer, Prepare&& prepare, Submit&& submit, Consume&& consume)
+{
+    atomic<bool> quit = false;
+    thread consumer([&quit, &consume] {
+        while (!quit.load(memory_order_relaxed))
+        {
+            consume();
+        }
+    });
+
+    vector<long> pushNs[c_producersCount];
+    vector<thread> producers;
+    for (int producer = 0; producer < c_producersCount; ++producer)
+    {
+        pushNs[producer].reserve(submissionsPerProducer);
+        producers.emplace_back([&prepare, &submit, &pushNs, producer, submissionsPerProducer] {
+            for (int i = 0; i < submissionsPerProducer; ++i)
+            {
+                prepare(producer);
+                auto start = chrono::steady_clock::now();
+                submit(producer);
+                pushNs[producer].push_back(chrono::duration_cast<chrono::nanoseconds>(
+                    chrono::steady_clock::now() - start).count());
+                this_thread::sleep_for(20us);
+            }
+        });
+    }
+    for (thread& producer : producers)
+    {
+        producer.join();
+    }
+    quit = true;
+    consumer.join();
+
+    vector<long> allPushNs;
+    for (auto& producerPushNs : pushNs)
+    {
+        allPushNs.insert(allPushNs.end(), producerPushNs.begin(), producerPushNs.end());
+    }
+    return allPushNs;
+}
+
+static void BenchmarkSubmitContention()
+{
+    static constexpr int c_submissionsPerProducer = 5'000;
+    // Consumer pretends to run a command between queue accesses
+    auto runCommand = [] {
+        auto end = chrono::steady_clock::now() + 20us;
+        while (chrono::steady_clock::now() < end) {}
+    };
+
+    cout << " Submission latency with " << c_producersCount << " producer threads" << endl;
+
+    {
+        // Previous submission: producers and consumer share a mutex around heap manipulation
+        mutex m;
+        IndexHeap<c_producersCount> heap;
+        bool isQueued[c_producersCount] = {};
+        auto less = [] (int idx1, int idx2) { return idx1 < idx2; };
+        auto pushNs = MeasureSubmissions(c_submissionsPerProducer, [] (int) {},
+            [&] (int producer) {
+                lock_guard lk(m);
+                if (!isQueued[producer])
+                {
+                    heap.Push(producer, less);
+                    isQueued[producer] = true;
+                }
+            },
+            [&] {
+                {
+                    lock_guard lk(m);
+                    while (!heap.IsEmpty())
+                    {
+                        isQueued[heap.Pop(less)] = false;
+                    }
+                    runCommand();
+                }
+            });
+        PrintPushLatency("mutex", pushNs);
+    }
+
+    {
+        IndexMpscQueue<c_producersCount> queue;
+        atomic<bool> isQueued[c_producersCount] = {};
+        auto pushNs = MeasureSubmissions(c_submissionsPerProducer, [] (int) {},
+            [&] (int producer) {
+                if (!isQueued[producer].exchange(true))
+                {
+                    queue.Push(producer);
+                }
+            },
+            [&] {
+                int indices[c_producersCount];
+                int count = queue.PopAll(indices);
+                for (int i = 0; i < count; ++i)
+                {
+                    isQueued[indices[i]] = false;
+                }
+                runCommand();
+            });
+        PrintPushLatency("IndexMpscQueue", pushNs);
+    }
+
+    {
+        I2cAccessor i2cAccessor;
+        if (i2cAccessor.Init(make_unique<SimulatedI2cBus>()) != 0)
+        {
+            return;
+        }
+        // Every producer keeps a single transaction in flight, so the pool is never exhausted
+        atomic<bool> isCompleted[c_producersCount];
+        for (auto& completed : isCompleted)
+        {
+            completed = true;
+        }
+        auto pushNs = MeasureSubmissions(c_submissionsPerProducer,
+            [&isCompleted] (int producer) {
+                while (!isCompleted[producer].exchange(false))
+                {
+                    this_thread::yield();
+                }
+            },
+            [&] (int producer) {
+                // Own device address, so that producers do not abort each other
+                I2cTransaction transaction = i2cAccessor.CreateTransaction(0x40 + producer);
+                transaction.AddCommand([] (I2cBus&, chrono::milliseconds&) {
+                    // Bus transfer of a few bytes
+                    this_thread::sleep_for(20us);
+                    return HwResult::Completed;
+                });
+                transaction.SetCompletionAction([&isCompleted, producer] (HwResult) { isCompleted[producer] = true; });
+                i2cAccessor.PushTransaction(move(transaction));
+            },
+            [] { this_thread::sleep_for(1ms); });
+        PrintPushLatency("I2cAccessor::PushTransaction", pushNs);
+    }
+}
+
+struct Benchmark
+{
+    const char* name;
+    void (*func)();
+};
+
+static const Benchmark c_benchmarks[] = {
+    { "InlineFunction", BenchmarkInlineFunction },
+    { "BatchSyscalls", BenchmarkBatchSyscalls },
+    { "PressureSampleRate", BenchmarkPressureSampleRate },
+    { "ApproachPolling", BenchmarkApproachPolling },
+    { "SimulatedNozzle", BenchmarkSimulatedNozzle },
+    { "PriorityLatency", BenchmarkPriorityLatency },
+    { "WakeupJitter", BenchmarkWakeupJitter },
+    { "SubmitContention", BenchmarkSubmitContention },
+};
+
+int main(int argc, char *argv[])
+{
+    // Optional argument filters benchmarks by name
+    const char* filter = argc > 1 ? argv[1] : nullptr;
+
+    for (const Benchmark& benchmark : c_benchmarks)
+    {
+        if (filter != nullptr && strstr(benchmark.name, filter) == nullptr)
+        {
+            continue;
+        }
+        cout << benchmark.name << endl;
+        benchmark.func();
+    }
+
+    return 0;
+}
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <InlineFunction.h>
+#include <SampleRing.h>
+#include <SeqLock.h>
+
 #include <chrono>
+#include <cstdint>
 
 using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
 
@@ -24,6 +29,51 @@ enum class HwResult : int
     NoWaterPressure,
 };
 
+/// @brief Checks measured value.
+/// @return HwResult::Repeat to continue measurement, any other value completes it.
+using HwValuePredicate = InlineFunction<HwResult(int), 96>;
+using HwCompletionAction = InlineFunction<void(HwResult), 32>;
+/// @brief Longest interval until the next sample the watcher accepts, asked after every sample.
+using HwPollInterval = InlineFunction<std::chrono::microseconds(), 32>;
+
+/// @brief Sensor measurement with the time it was taken.
+struct HwSample
+{
+    int32_t value = 0;
+    // steady_clock microseconds at I/O completion
+    int64_t timeUs = 0;
+};
+
+/// @brief Measurement history published by a sensor, about 128 ms at 2 ms polling.
+using HwSampleRing = SampleRing<HwSample, 64>;
+
+/// @brief Latest state of the nozzle sensors, each sensor updates its part with every measurement.
+struct HwState
+{
+    // MagnetSensor, raw angle units
+    int32_t rawAngle = 0;
+    int32_t angularVelocity = 0;
+    int64_t unwrappedAngle = 0;
+    int64_t angleTimeUs = 0;
+
+    // PressureSensor, truncated pressure units
+    int32_t pressure = 0;
+    int32_t filteredPressure = 0;
+    int32_t pressureChangeRate = 0;
+    int64_t pressureTimeUs = 0;
+
+    /// @brief Both sensors were measured at least once.
+    bool IsValid() const { return angleTimeUs != 0 && pressureTimeUs != 0; }
+    /// @brief Both sensors were measured at most maxAgeUs before nowUs, steady_clock microseconds.
+    bool IsFresh(int64_t nowUs, int64_t maxAgeUs) const
+    {
+        return IsValid() && nowUs - angleTimeUs <= maxAgeUs && nowUs - pressureTimeUs <= maxAgeUs;
+    }
+};
+
+/// @brief Readers get a consistent HwState without waiting for the bus or the sensors.
+using HwStateLock = SeqLock<HwState>;
+
 constexpr const char c_i2cFileName[] = "/dev/i2c-1";
 
 #define Statement(x)  do { x; } while(0);
@@ -1,41 +1,135 @@
 #pragma once
 
 #include "CommonDefs.h"
+#include "I2cBatch.h"
+#include "I2cBus.h"
+#include "I2cCoroutine.h"
 
+#include <IndexHeap.h>
+#include <IndexMpscQueue.h>
+#include <InlineFunction.h>
+#include <LatencyHistogram.h>
+
+#include <cstdint>
+
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
-#include <functional>
 #include <future>
-#include <list>
+#include <initializer_list>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <queue>
+#include <string>
 #include <thread>
 
+class I2cAccessor;
+
+/// @brief Scheduling class of a transaction. Due commands of a higher class run first,
+/// commands of the same class run earliest deadline first.
+enum class I2cPriority
+{
+    MotionCritical,
+    Control,
+    Telemetry,
+    Count
+};
+
+/// @brief Time due commands of a priority class waited for the bus.
+struct I2cLatencyStats
+{
+    uint64_t commandsCount = 0;
+    uint64_t missedDeadlinesCount = 0;
+    std::chrono::microseconds totalLatency = {};
+    std::chrono::microseconds maxLatency = {};
+
+    std::chrono::microseconds GetMeanLatency() const
+    {
+        return commandsCount > 0 ? totalLatency / static_cast<int64_t>(commandsCount) : std::chrono::microseconds(0);
+    }
+};
+
+/// @brief Handling of HwResult::CommFailure of a transaction command.
+/// Failed command (or coroutine bus operation) is repeated after the backoff,
+/// transaction fails only when all attempts of the same command fail.
+struct I2cRetryPolicy
+{
+    // Attempts of a command including the first one, 1 disables retries
+    int maxAttempts = 3;
+    // Delay before the first retry, doubled for every next one
+    std::chrono::microseconds backoff = std::chrono::milliseconds(2);
+    // Bus is closed and reopened before a retry after this many consecutive failures, 0 never
+    int resetBusAfterFailures = 2;
+};
+
+/// @brief Transient bus failures handled by I2cAccessor.
+struct I2cRetryStats
+{
+    uint64_t retriesCount = 0;
+    // Commands which succeeded after failed attempts
+    uint64_t recoveredErrorsCount = 0;
+    uint64_t busResetsCount = 0;
+    // Commands which failed all attempts
+    uint64_t exhaustedCount = 0;
+};
+
 /// @brief 
-/// @param int: handle to I2C file.
+/// @param I2cBus&: bus with the transaction device selected.
 /// @param std::chrono::milliseconds&: delay next command for duration.
-using I2cCommand = std::function<HwResult(int, std::chrono::milliseconds&)>;
+using I2cCommand = InlineFunction<HwResult(I2cBus&, std::chrono::milliseconds&), 32>;
+using I2cCompletionAction = InlineFunction<void(HwResult), 64>;
+using I2cRecursionPredicate = InlineFunction<HwResult(), 128>;
+
+/// @brief Processes results of a completed I2cBatch.
+/// @param std::chrono::milliseconds&: delay next command for duration.
+using I2cBatchHandler = InlineFunction<HwResult(const I2cBatch&, std::chrono::milliseconds&), 32>;
+
+/// @brief Scheduling options of the I2cAccessor thread.
+struct I2cThreadOptions
+{
+    // SCHED_FIFO priority 1..99, 0 keeps the default scheduling policy
+    int realtimePriority = 0;
+    // CPU the thread is pinned to, -1 for any
+    int cpu = -1;
+    // Lock process memory, so that the bus thread does not stall on page faults
+    bool lockMemory = false;
+};
+
+/// @brief Difference between requested and actual wakeups of I2cAccessor thread.
+struct I2cJitterReport
+{
+    uint64_t wakeupsCount = 0;
+    std::chrono::microseconds mean = {};
+    std::chrono::microseconds p50 = {};
+    std::chrono::microseconds p99 = {};
+    std::chrono::microseconds max = {};
+};
 
 class I2cTransaction
 {
     friend class I2cAccessor;
 
-    I2cTransaction(int i2cHandle, int deviceAddress) :
-        m_i2cHandle(i2cHandle), m_deviceAddress(deviceAddress)
+    I2cTransaction(I2cBus* pI2cBus, int deviceAddress) :
+        m_pI2cBus(pI2cBus), m_deviceAddress(deviceAddress)
     {}
     I2cTransaction(const I2cTransaction&) = delete;
 
 public:
-    I2cTransaction(I2cTransaction&& other) : m_i2cHandle(other.m_i2cHandle),
+    I2cTransaction(I2cTransaction&& other) : m_pI2cBus(other.m_pI2cBus),
         m_deviceAddress(other.m_deviceAddress),
         m_commandsCount(other.m_commandsCount),
         m_curCommand(other.m_curCommand),
-        m_completionPromise(std::move(other.m_completionPromise)),
-        m_isAborted(other.m_isAborted),
-        m_optCompletionAction(std::move(other.m_optCompletionAction)),
-        m_optIsRecursionCompleted(std::move(other.m_optIsRecursionCompleted)),
-        m_delayNextIteration(other.m_delayNextIteration)
+        m_optCompletionPromise(std::move(other.m_optCompletionPromise)),
+        m_isAborted(other.m_isAborted.load()),
+        m_isCoroutine(other.m_isCoroutine),
+        m_task(std::move(other.m_task)),
+        m_priority(other.m_priority),
+        m_relativeDeadline(other.m_relativeDeadline),
+        m_retryPolicy(other.m_retryPolicy),
+        m_failedAttempts(other.m_failedAttempts),
+        m_completionAction(std::move(other.m_completionAction)),
+        m_isRecursionCompleted(std::move(other.m_isRecursionCompleted)),
+        m_delayNextIteration(other.m_delayNextIteration),
+        m_pSchedule(other.m_pSchedule)
     {
         for (int i = 0; i < m_commandsCount; ++i)
         {
@@ -47,28 +141,109 @@ public:
     {
         if (m_commandsCount < static_cast<int>(std::size(m_commands)))
         {
-            m_commands[m_commandsCount].emplace(std::move(command));
+            m_commands[m_commandsCount].command = std::move(command);
+            ++m_commandsCount;
+            return true;
+        }
+        return false;
+    }
+
+    /// @brief Adds command submitting all messages of the batch in a single transfer.
+    /// Due batch commands of different transactions are combined into one transfer.
+    bool AddBatchCommand(I2cBatch&& batch, I2cBatchHandler&& batchHandler)
+    {
+        if (m_commandsCount < static_cast<int>(std::size(m_commands)) && !batch.IsEmpty())
+        {
+            m_commands[m_commandsCount].batch = batch;
+            m_commands[m_commandsCount].batchHandler = std::move(batchHandler);
             ++m_commandsCount;
             return true;
         }
         return false;
     }
 
-    std::future<HwResult> GetFuture() { return m_completionPromise.get_future(); }
+    /// @brief Runs the coroutine instead of commands. Transaction is completed with its co_return value.
+    /// Invalid task (frame pool exhausted) completes the transaction with HwResult::Failure.
+    void SetCoroutine(I2cTask&& task)
+    {
+        m_task = std::move(task);
+        m_isCoroutine = true;
+        m_commandsCount = 1;
+    }
 
-    void MakeRecursive(std::function<HwResult()>&& isRecursionCompleted, std::chrono::milliseconds delayNextIteration)
+    // Promise is created on demand, transactions completed through
+    // SetCompletionAction only do not allocate shared state.
+    std::future<HwResult> GetFuture()
     {
-        m_optIsRecursionCompleted.emplace(std::move(isRecursionCompleted));
+        if (!m_optCompletionPromise.has_value())
+        {
+            m_optCompletionPromise.emplace();
+        }
+        return m_optCompletionPromise->get_future();
+    }
+
+    void MakeRecursive(I2cRecursionPredicate&& isRecursionCompleted, std::chrono::milliseconds delayNextIteration)
+    {
+        m_isRecursionCompleted = std::move(isRecursionCompleted);
         m_delayNextIteration = delayNextIteration;
     }
 
-    void SetCompletionAction(std::function<void(HwResult)>&& completionAction)
+    /// @brief Recursive transaction with iterations due at fixed rate instead of a delay after the previous one.
+    /// Accessor starts the schedule at the push. It must outlive the transaction and may be read for overruns meanwhile.
+    void MakePeriodic(I2cRecursionPredicate&& isRecursionCompleted, I2cPeriodicSchedule& schedule)
+    {
+        m_isRecursionCompleted = std::move(isRecursionCompleted);
+        m_delayNextIteration = {};
+        m_pSchedule = &schedule;
+    }
+
+    void SetCompletionAction(I2cCompletionAction&& completionAction)
+    {
+        m_completionAction = std::move(completionAction);
+    }
+
+    /// @brief Every command should start within relativeDeadline after it is due.
+    void SetPriority(I2cPriority priority, std::chrono::microseconds relativeDeadline)
+    {
+        m_priority = priority;
+        m_relativeDeadline = relativeDeadline;
+    }
+
+    void SetPriority(I2cPriority priority)
+    {
+        SetPriority(priority, GetDefaultDeadline(priority));
+    }
+
+    void SetRetryPolicy(const I2cRetryPolicy& retryPolicy)
     {
-        m_optCompletionAction.emplace(std::move(completionAction));
+        m_retryPolicy = retryPolicy;
     }
 
-    bool IsValid() const { return m_i2cHandle >= 0; }
+    static constexpr std::chrono::microseconds GetDefaultDeadline(I2cPriority priority)
+    {
+        using namespace std::chrono_literals;
+        switch (priority)
+        {
+        case I2cPriority::MotionCritical: return 500us;
+        case I2cPriority::Control: return 2ms;
+        default: return 10ms;
+        }
+    }
+
+    bool IsValid() const { return m_pI2cBus != nullptr && (!m_isCoroutine || m_task.IsValid()); }
     bool IsCompleted() const { return m_curCommand == m_commandsCount; }
+    bool IsBatchCommand() const
+    {
+        if (IsCompleted())
+        {
+            return false;
+        }
+        if (m_isCoroutine)
+        {
+            return m_task.IsValid() && m_task.m_handle.promise().m_pPendingBatch != nullptr;
+        }
+        return !m_commands[m_curCommand].batch.IsEmpty();
+    }
 
     void Abort()
     {
@@ -76,67 +251,214 @@ public:
     }
 
 private:
-    TimePoint RunCommand();
+    TimePoint RunCommand(I2cAccessor& i2cAccessor);
+    TimePoint ResumeCoroutine();
+    I2cBatch* GetCurrentBatch();
+    TimePoint CompleteBatchCommand(I2cAccessor& i2cAccessor, HwResult transferStatus);
+    TimePoint ProcessCommandStatus(I2cAccessor& i2cAccessor, HwResult status, std::chrono::milliseconds delayNextCommand);
+    TimePoint RetryCommand(I2cAccessor& i2cAccessor);
+    void ResetFailedAttempts(I2cAccessor& i2cAccessor);
     void Complete(HwResult status);
 
-    const int m_i2cHandle = -1;
+    I2cBus* const m_pI2cBus = nullptr;
     const int m_deviceAddress = 0;
-    std::optional<I2cCommand> m_commands[3];
+    struct Command
+    {
+        I2cCommand command;
+        // Batch command is used when batch is not empty
+        I2cBatch batch;
+        I2cBatchHandler batchHandler;
+    };
+
+    Command m_commands[3];
     int m_commandsCount = 0;
     int m_curCommand = 0;
-    std::promise<HwResult> m_completionPromise;
-    bool m_isAborted = false;
+    std::optional<std::promise<HwResult>> m_optCompletionPromise;
+    std::atomic<bool> m_isAborted = false;
+    bool m_isCoroutine = false;
+    I2cTask m_task;
+    I2cPriority m_priority = I2cPriority::Control;
+    std::chrono::microseconds m_relativeDeadline = GetDefaultDeadline(I2cPriority::Control);
+    I2cRetryPolicy m_retryPolicy;
+    // Consecutive failures of the current command
+    int m_failedAttempts = 0;
 
-    std::optional<std::function<void(HwResult)>> m_optCompletionAction;
+    I2cCompletionAction m_completionAction;
 
     // For recursive transaction
-    std::optional<std::function<HwResult()>> m_optIsRecursionCompleted;
+    I2cRecursionPredicate m_isRecursionCompleted;
     std::chrono::milliseconds m_delayNextIteration = {};
+    I2cPeriodicSchedule* m_pSchedule = nullptr;
 };
 
 class I2cAccessor
 {
+    friend class I2cTransaction;
+
 public:
-    I2cAccessor() {}
+    // Maximum number of transactions which can be in flight at the same time.
+    static constexpr int c_maxTransactions = 16;
+    // Maximum number of timer owners, see AcquireTimerOwner.
+    static constexpr int c_maxTimerOwners = 8;
+
+    I2cAccessor();
     ~I2cAccessor();
 
-    int Init(const char* i2cFileName);
+    /// @brief Opens Linux I2C device file.
+    int Init(const char* i2cFileName, const I2cThreadOptions& threadOptions = {});
+    /// @brief Opens the bus and starts processing transactions on it.
+    int Init(std::unique_ptr<I2cBus> spI2cBus, const I2cThreadOptions& threadOptions = {});
+    /// @brief true if the bus thread processes transactions.
+    bool IsRunning() const { return m_thread.has_value(); }
+
+    /// @brief Records every bus operation to the trace file, see I2cTraceRecorder. Must be called before Init.
+    void SetTraceFile(const char* traceFileName) { m_traceFileName = traceFileName; }
 
     I2cTransaction CreateTransaction(int deviceAddress) const
     {
-        return I2cTransaction(m_i2cHandle, deviceAddress);
+        return I2cTransaction(m_spI2cBus.get(), deviceAddress);
     }
 
+    /// @brief Moves transaction into a free slot of the transaction pool and submits it to the bus thread.
+    /// Lock-free, the bus thread schedules the transaction and aborts the previous one of the same device.
+    /// @return Pointer to the submitted transaction. nullptr if the pool is exhausted,
+    /// in this case transaction is completed with HwResult::Busy.
     I2cTransaction* PushTransaction(I2cTransaction&& transaction);
 
-    int GetI2cHandle() { return m_i2cHandle; }
+    /// @brief Aborts transactions of the device pushed before the call. Lock-free, the bus thread completes
+    /// waiting transaction with HwResult::Abort on its next wakeup, running one as soon as its current command returns.
+    void AbortDevice(int deviceAddress);
+
+    /// @brief Reserves an owner id for PushTimer. -1 if all are in use.
+    int AcquireTimerOwner();
+    /// @brief Owner must have no timer pending, e.g. after its cancelled timer completed.
+    void ReleaseTimerOwner(int ownerId);
+    /// @brief Runs action on the bus thread at time without touching the bus. The timer takes a slot
+    /// of the transaction pool and replaces the pending timer of the owner, as transactions of a device do.
+    /// Action runs once: HwResult::Success when due, HwResult::Abort if replaced or cancelled,
+    /// HwResult::Busy right away if the pool is exhausted, HwResult::Failure if the owner is invalid.
+    /// @return false if the timer was not pushed.
+    bool PushTimer(int ownerId, TimePoint time, I2cCompletionAction&& action);
+    /// @brief Cancels the timer of the owner pushed before the call. Lock-free, through the AbortDevice path.
+    void CancelTimer(int ownerId);
+
+    I2cBus& GetBus() { return *m_spI2cBus; }
+
+    /// @brief Must be called after device is selected on the bus outside of I2cAccessor.
+    void InvalidateSelectedDevice() { m_selectedDeviceAddress = -1; }
+
+    /// @brief Number of device selections skipped, because the device was already selected.
+    uint64_t GetSavedSelectIoctlsCount() const { return m_savedSelectIoctlsCount.load(); }
+
+    I2cLatencyStats GetLatencyStats(I2cPriority priority);
+    void ResetLatencyStats();
+
+    I2cJitterReport GetWakeupJitter();
+    void ResetWakeupJitter();
+
+    I2cRetryStats GetRetryStats() const;
+    void ResetRetryStats();
 
 private:
     void LoopFunc();
+    void ApplyThreadOptions();
+    void ArmTimer();
+    void WaitForEvents();
+    void Wake();
+    void RunCombinedBatchCommands(const int slotIndices[], int count, TimePoint nextTimes[]);
+    /// @brief Batch command which may be combined with others into one transfer. A failed combined transfer
+    /// is replayed transaction by transaction, while the messages before the failing device have executed
+    /// already. So only repeatable batches are combined, writes with side effects are transferred alone.
+    bool IsBatchCommandReady(int slotIdx);
+    bool SelectDevice(int deviceAddress);
+    void ResetBus();
 
-    int m_i2cHandle = -1;
-    using TransactionIterator = std::list<I2cTransaction>::iterator;
+    // Transaction pool, slots are acquired by producers and released by the bus thread
+    void ReleaseSlot(int slotIdx);
+    void AbortSlot(int slotIdx);
+    bool IsAbortRequested(int slotIdx) const;
+    bool IsTimerSlot(int slotIdx) const { return m_slots[slotIdx].timerOwner >= 0; }
+    /// @brief Entry of m_deviceSlots or m_timerSlots the slot is the latest of.
+    int& GetOwnerSlot(int slotIdx);
+    /// @brief Releases the slot first, so that the action may push the next timer.
+    void CompleteTimer(int slotIdx, HwResult status);
 
-    struct Task
+    // Bus thread only
+    void DrainSubmittedSlots();
+    void ProcessAbortRequests();
+
+    // Scheduling: transactions wait in the timer heap until startTime,
+    // due transactions are run from the ready heap by priority and deadline. Due timers complete right away.
+    void Schedule(int slotIdx, TimePoint startTime);
+    void MoveDueToReady(TimePoint curTime);
+    int PopReady(TimePoint curTime);
+    bool IsReadyBefore(int slotIdx1, int slotIdx2) const;
+    auto TimerLess() const
+    {
+        return [this] (int slotIdx1, int slotIdx2) { return m_slots[slotIdx1].startTime < m_slots[slotIdx2].startTime; };
+    }
+    auto ReadyLess() const
     {
-        Task(TimePoint start, TransactionIterator it) :
-            startTime(start), itTransaction(it) {}
+        return [this] (int slotIdx1, int slotIdx2) { return IsReadyBefore(slotIdx1, slotIdx2); };
+    }
+
+    std::unique_ptr<I2cBus> m_spI2cBus;
+    std::string m_traceFileName;
 
+    // Device address currently selected on m_spI2cBus
+    std::atomic<int> m_selectedDeviceAddress = -1;
+    std::atomic<uint64_t> m_savedSelectIoctlsCount = 0;
+
+    // Updated by the bus thread only
+    std::atomic<uint64_t> m_retriesCount = 0;
+    std::atomic<uint64_t> m_recoveredErrorsCount = 0;
+    std::atomic<uint64_t> m_busResetsCount = 0;
+    std::atomic<uint64_t> m_exhaustedRetriesCount = 0;
+
+    struct TransactionSlot
+    {
+        std::optional<I2cTransaction> transaction;
+        // Timer slot holds the action instead of a transaction
+        I2cCompletionAction timerAction;
+        int timerOwner = -1;
         TimePoint startTime;
-        TransactionIterator itTransaction;
+        TimePoint deadline;
+        // m_abortEpochs value of the device (m_timerAbortEpochs of the owner) when the slot was pushed
+        uint32_t abortEpoch = 0;
     };
 
-    struct CompareTasks {
-        bool operator()(const Task& t1, const Task& t2) {
-            return t1.startTime > t2.startTime;
-        }
-    };
+    TransactionSlot m_slots[c_maxTransactions];
+    IndexFreeList<c_maxTransactions> m_freeSlots;
+    IndexMpscQueue<c_maxTransactions> m_submittedSlots;
+
+    // Incremented by AbortDevice, transactions pushed with an older epoch are aborted
+    std::atomic<uint32_t> m_abortEpochs[I2cBus::c_maxDeviceAddress + 1] = {};
+    std::atomic<uint32_t> m_timerAbortEpochs[c_maxTimerOwners] = {};
+    std::atomic<bool> m_isAbortRequested = false;
+    IndexFreeList<c_maxTimerOwners> m_freeTimerOwners;
+
+    // State below is owned by the bus thread
+    // Slot of the latest transaction of every device address, -1 if there is none
+    int m_deviceSlots[I2cBus::c_maxDeviceAddress + 1];
+    // Slot of the pending timer of every owner, -1 if there is none
+    int m_timerSlots[c_maxTimerOwners];
+    IndexHeap<c_maxTransactions> m_timerHeap;
+    IndexHeap<c_maxTransactions> m_readyHeap;
+
+    // Guards statistics read by other threads
+    std::mutex m_statsMutex;
+    I2cLatencyStats m_latencyStats[static_cast<int>(I2cPriority::Count)];
 
-    std::priority_queue<Task, std::vector<Task>, CompareTasks> m_tasks{CompareTasks()};
-    std::list<I2cTransaction> m_transactions;
+    // Loop waits in epoll for the timer or for the wake event of PushTransaction
+    int m_epollHandle = -1;
+    int m_timerHandle = -1;
+    int m_wakeEventHandle = -1;
+    // Start time of the timer heap top, the timer is armed for. Max if disarmed.
+    TimePoint m_armedWakeupTime = TimePoint::max();
+    I2cThreadOptions m_threadOptions;
+    // 10 us buckets up to 20 ms
+    LatencyHistogram<2000, 10> m_wakeupJitter;
 
-    bool m_quit = false;
-    std::mutex m_mutex;
-    std::condition_variable m_cv;
+    std::atomic<bool> m_quit = false;
     std::optional<std::thread> m_thread;
 };
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "CommonDefs.h"
+#include "I2cBus.h"
+
+#include <cstdint>
+
+#include <algorithm>
+#include <initializer_list>
+
+/// @brief Messages of a combined I2C transfer, submitted with a single I2cBus::Transfer.
+/// Every message carries its own device address, so no device selection is required.
+class I2cBatch
+{
+public:
+    static constexpr int c_maxMessages = 2;
+    static constexpr int c_maxMessageLength = 16;
+
+    /// @return Index of the added message. -1 if the batch is full.
+    int AddWrite(int deviceAddress, const uint8_t* data, int length)
+    {
+        if (m_messagesCount == c_maxMessages || length > c_maxMessageLength)
+        {
+            return -1;
+        }
+        Message& message = m_messages[m_messagesCount];
+        message.deviceAddress = static_cast<uint16_t>(deviceAddress);
+        message.isRead = false;
+        message.length = static_cast<uint16_t>(length);
+        std::copy_n(data, length, message.data);
+        return m_messagesCount++;
+    }
+
+    int AddWrite(int deviceAddress, std::initializer_list<uint8_t> data)
+    {
+        return AddWrite(deviceAddress, data.begin(), static_cast<int>(data.size()));
+    }
+
+    /// @return Index of the added message. -1 if the batch is full.
+    int AddRead(int deviceAddress, int length)
+    {
+        if (m_messagesCount == c_maxMessages || length > c_maxMessageLength)
+        {
+            return -1;
+        }
+        Message& message = m_messages[m_messagesCount];
+        message.deviceAddress = static_cast<uint16_t>(deviceAddress);
+        message.isRead = true;
+        message.length = static_cast<uint16_t>(length);
+        return m_messagesCount++;
+    }
+
+    bool IsEmpty() const { return m_messagesCount == 0; }
+    /// @brief true if the messages may be transferred again after a failed transfer executed part of them:
+    /// reads, each write only setting the register pointer of the read following it.
+    bool IsRepeatable() const
+    {
+        for (int i = 0; i < m_messagesCount; ++i)
+        {
+            const Message& message = m_messages[i];
+            bool isRegisterPointer = message.length == 1 && i + 1 < m_messagesCount &&
+                m_messages[i + 1].isRead && m_messages[i + 1].deviceAddress == message.deviceAddress;
+            if (!message.isRead && !isRegisterPointer)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    int GetMessagesCount() const { return m_messagesCount; }
+    const uint8_t* GetData(int iMessage) const { return m_messages[iMessage].data; }
+    int GetLength(int iMessage) const { return m_messages[iMessage].length; }
+
+    /// @brief Submits messages of all batches with a single combined transfer.
+    static HwResult Transfer(I2cBus& i2cBus, I2cBatch* const batches[], int count);
+
+private:
+    struct Message
+    {
+        uint16_t deviceAddress = 0;
+        uint16_t length = 0;
+        bool isRead = false;
+        uint8_t data[c_maxMessageLength] = {};
+    };
+
+    Message m_messages[c_maxMessages];
+    int m_messagesCount = 0;
+};
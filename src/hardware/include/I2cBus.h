@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+/// @brief Segment of a combined transfer.
+struct I2cMessage
+{
+    uint16_t deviceAddress = 0;
+    uint16_t length = 0;
+    bool isRead = false;
+    uint8_t* data = nullptr;
+};
+
+/// @brief Backend executing I2C operations. All operations return negative value on failure.
+class I2cBus
+{
+public:
+    // Same as I2C_RDWR_IOCTL_MAX_MSGS
+    static constexpr int c_maxTransferMessages = 42;
+    // 7-bit addressing
+    static constexpr int c_maxDeviceAddress = 0x7F;
+
+    virtual ~I2cBus() = default;
+
+    virtual int Open() = 0;
+    virtual void Close() = 0;
+    virtual bool IsOpen() const = 0;
+
+    /// @brief Sets device used by Read and Write.
+    virtual int SelectDevice(int deviceAddress) = 0;
+
+    /// @return Number of bytes read.
+    virtual int Read(uint8_t* buffer, int length) = 0;
+
+    /// @return Number of bytes written.
+    virtual int Write(const uint8_t* buffer, int length) = 0;
+
+    /// @brief Executes all messages as one combined transfer. Messages carry their own device address.
+    virtual int Transfer(I2cMessage* messages, int count) = 0;
+
+    /// @brief Reads registers starting from firstRegister with a combined write+read transfer.
+    int ReadRegisters(int deviceAddress, uint8_t firstRegister, uint8_t* buffer, int length)
+    {
+        I2cMessage messages[2];
+        messages[0].deviceAddress = static_cast<uint16_t>(deviceAddress);
+        messages[0].length = 1;
+        messages[0].data = &firstRegister;
+        messages[1].deviceAddress = static_cast<uint16_t>(deviceAddress);
+        messages[1].length = static_cast<uint16_t>(length);
+        messages[1].isRead = true;
+        messages[1].data = buffer;
+        return Transfer(messages, 2);
+    }
+};
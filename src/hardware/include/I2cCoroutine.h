@@ -0,0 +1,330 @@
+#pragma once
+
+#include "CommonDefs.h"
+#include "I2cBatch.h"
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <initializer_list>
+#include <mutex>
+#include <utility>
+
+#define IfFailCoReturn(hr_) Statement( \
+    const auto hrLocal_ = (hr_); \
+    if (hrLocal_ != HwResult::Success) \
+    { \
+        co_return hrLocal_; \
+    })
+
+/// @brief Fixed pool of coroutine frames. I2cTask frames never come from the heap,
+/// coroutine which does not fit or finds the pool exhausted gets an invalid I2cTask.
+class I2cFramePool
+{
+public:
+    static constexpr int c_framesCount = 32;
+    static constexpr size_t c_frameSize = 1024;
+
+    static I2cFramePool& Instance();
+
+    void* Allocate(size_t size);
+    void Free(void* frame);
+
+    int GetFreeFramesCount();
+
+private:
+    I2cFramePool();
+
+    alignas(std::max_align_t) unsigned char m_frames[c_framesCount][c_frameSize];
+    int m_nextFree[c_framesCount] = {};
+    int m_firstFree = 0;
+    int m_freeFramesCount = c_framesCount;
+    std::mutex m_mutex;
+};
+
+class I2cTask;
+
+class I2cTaskPromise
+{
+    friend class I2cTask;
+    friend class I2cTransaction;
+    friend class I2cBatchAwaiter;
+    friend class I2cDelayAwaiter;
+    friend class I2cDelayUntilAwaiter;
+    friend class I2cTransferTimeAwaiter;
+
+public:
+    static void* operator new(size_t size) noexcept { return I2cFramePool::Instance().Allocate(size); }
+    static void operator delete(void* frame) noexcept { I2cFramePool::Instance().Free(frame); }
+    static I2cTask get_return_object_on_allocation_failure();
+
+    I2cTask get_return_object();
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(HwResult result) { m_result = result; }
+    void unhandled_exception() { std::terminate(); }
+
+private:
+    // Operation the suspended coroutine waits for: transfer of the batch or the delay
+    I2cBatch* m_pPendingBatch = nullptr;
+    std::chrono::microseconds m_pendingDelay = {};
+    // Absolute due time, used instead of the delay if set
+    TimePoint m_pendingDueTime;
+    HwResult m_batchStatus = HwResult::Success;
+    // When the last batch was transferred, before the coroutine was resumed
+    TimePoint m_batchCompletionTime;
+    HwResult m_result = HwResult::Failure;
+};
+
+/// @brief Coroutine running I2C protocol of a device as straight-line code.
+/// Resumed by I2cAccessor thread, every awaited bus operation is scheduled as a batch command,
+/// so higher priority transactions may run between operations of the coroutine.
+class I2cTask
+{
+    friend class I2cTaskPromise;
+    friend class I2cTransaction;
+
+public:
+    using promise_type = I2cTaskPromise;
+
+    I2cTask() = default;
+    I2cTask(const I2cTask&) = delete;
+    I2cTask& operator=(const I2cTask&) = delete;
+    I2cTask(I2cTask&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    I2cTask& operator=(I2cTask&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+    ~I2cTask() { Destroy(); }
+
+    bool IsValid() const { return static_cast<bool>(m_handle); }
+
+private:
+    explicit I2cTask(std::coroutine_handle<I2cTaskPromise> handle) : m_handle(handle) {}
+
+    void Destroy()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+            m_handle = nullptr;
+        }
+    }
+
+    std::coroutine_handle<I2cTaskPromise> m_handle;
+};
+
+inline I2cTask I2cTaskPromise::get_return_object_on_allocation_failure()
+{
+    return I2cTask();
+}
+
+inline I2cTask I2cTaskPromise::get_return_object()
+{
+    return I2cTask(std::coroutine_handle<I2cTaskPromise>::from_promise(*this));
+}
+
+/// @brief Suspends coroutine until the batch is transferred.
+/// @return Transfer status. Read data is copied to readBuffer if it was given.
+class I2cBatchAwaiter
+{
+public:
+    explicit I2cBatchAwaiter(I2cBatch& batch) : m_pBatch(&batch) {}
+    I2cBatchAwaiter(I2cBatch&& batch, bool isValid, int iReadMessage = -1, uint8_t* readBuffer = nullptr) :
+        m_ownBatch(std::move(batch)), m_isValid(isValid), m_iReadMessage(iReadMessage), m_readBuffer(readBuffer)
+    {}
+
+    bool await_ready() const { return !m_isValid; }
+
+    void await_suspend(std::coroutine_handle<I2cTaskPromise> handle)
+    {
+        m_pPromise = &handle.promise();
+        m_pPromise->m_pPendingBatch = GetBatch();
+    }
+
+    HwResult await_resume()
+    {
+        if (!m_isValid)
+        {
+            return HwResult::Failure;
+        }
+        HwResult status = m_pPromise->m_batchStatus;
+        if (status == HwResult::Success && m_readBuffer != nullptr)
+        {
+            I2cBatch* pBatch = GetBatch();
+            std::copy_n(pBatch->GetData(m_iReadMessage), pBatch->GetLength(m_iReadMessage), m_readBuffer);
+        }
+        return status;
+    }
+
+private:
+    I2cBatch* GetBatch() { return m_pBatch != nullptr ? m_pBatch : &m_ownBatch; }
+
+    I2cBatch* m_pBatch = nullptr;
+    I2cBatch m_ownBatch;
+    bool m_isValid = true;
+    int m_iReadMessage = -1;
+    uint8_t* m_readBuffer = nullptr;
+    I2cTaskPromise* m_pPromise = nullptr;
+};
+
+/// @brief Suspends coroutine for the duration without blocking I2cAccessor thread.
+class I2cDelayAwaiter
+{
+public:
+    explicit I2cDelayAwaiter(std::chrono::microseconds delay) : m_delay(delay) {}
+
+    bool await_ready() const { return m_delay <= std::chrono::microseconds(0); }
+
+    void await_suspend(std::coroutine_handle<I2cTaskPromise> handle)
+    {
+        handle.promise().m_pPendingBatch = nullptr;
+        handle.promise().m_pendingDelay = m_delay;
+    }
+
+    void await_resume() const {}
+
+private:
+    std::chrono::microseconds m_delay;
+};
+
+/// @brief Suspends coroutine until the due time, resumes right away if it passed.
+class I2cDelayUntilAwaiter
+{
+public:
+    explicit I2cDelayUntilAwaiter(TimePoint dueTime) : m_dueTime(dueTime) {}
+
+    bool await_ready() const { return m_dueTime <= std::chrono::steady_clock::now(); }
+
+    void await_suspend(std::coroutine_handle<I2cTaskPromise> handle)
+    {
+        handle.promise().m_pPendingBatch = nullptr;
+        handle.promise().m_pendingDueTime = m_dueTime;
+    }
+
+    void await_resume() const {}
+
+private:
+    TimePoint m_dueTime;
+};
+
+/// @brief Fixed rate schedule with absolute phase: iteration k is due at start + k * period,
+/// so the time iterations take does not accumulate. Iteration finishing after the next one was due
+/// is an overrun: the next iteration runs right away and the periods missed entirely are skipped.
+/// Schedule in use is started and advanced on the I2cAccessor thread only: by the coroutine sampling with it,
+/// or by the accessor for a periodic transaction. Period and counters may be read by any thread.
+class I2cPeriodicSchedule
+{
+public:
+    explicit I2cPeriodicSchedule(std::chrono::microseconds period) : m_period(period) {}
+
+    /// @brief Sets the phase, iteration 0 is due at startTime.
+    void Start(TimePoint startTime)
+    {
+        m_startTime = startTime;
+        m_iteration = 0;
+    }
+
+    /// @return Due time of the next iteration, in the past after an overrun.
+    TimePoint GetNextTime(TimePoint now)
+    {
+        TimePoint nextTime = m_startTime + m_period * static_cast<int64_t>(++m_iteration);
+        if (now > nextTime)
+        {
+            m_overrunsCount.fetch_add(1, std::memory_order_relaxed);
+            uint64_t missedCount = static_cast<uint64_t>((now - nextTime) / m_period);
+            m_iteration += missedCount;
+            m_skippedCount.fetch_add(missedCount, std::memory_order_relaxed);
+            nextTime += m_period * static_cast<int64_t>(missedCount);
+        }
+        return nextTime;
+    }
+
+    std::chrono::microseconds GetPeriod() const { return m_period; }
+    /// @brief Iterations which finished after the next one was due.
+    uint64_t GetOverrunsCount() const { return m_overrunsCount.load(std::memory_order_relaxed); }
+    /// @brief Iterations which were not run to keep the phase.
+    uint64_t GetSkippedCount() const { return m_skippedCount.load(std::memory_order_relaxed); }
+
+private:
+    const std::chrono::microseconds m_period;
+    TimePoint m_startTime;
+    uint64_t m_iteration = 0;
+    std::atomic<uint64_t> m_overrunsCount = 0;
+    std::atomic<uint64_t> m_skippedCount = 0;
+};
+
+/// @brief Does not suspend, returns the time the last awaited batch of the coroutine completed.
+/// Timestamps measurements at I/O completion instead of when the coroutine got resumed.
+class I2cTransferTimeAwaiter
+{
+public:
+    bool await_ready() const { return false; }
+
+    bool await_suspend(std::coroutine_handle<I2cTaskPromise> handle)
+    {
+        m_time = handle.promise().m_batchCompletionTime;
+        return false;
+    }
+
+    TimePoint await_resume() const { return m_time; }
+
+private:
+    TimePoint m_time;
+};
+
+/// @brief Awaitable bus operations on a device, for use inside I2cTask coroutines.
+/// Every operation is a combined transfer, so it does not depend on the selected device.
+class I2cAsyncBus
+{
+public:
+    explicit I2cAsyncBus(int deviceAddress) : m_deviceAddress(deviceAddress) {}
+
+    // Data is passed as pointer: initializer_list temporaries in co_await expressions are rejected by GCC 12
+    I2cBatchAwaiter Write(const uint8_t* data, int length) const
+    {
+        I2cBatch batch;
+        bool isValid = batch.AddWrite(m_deviceAddress, data, length) >= 0;
+        return I2cBatchAwaiter(std::move(batch), isValid);
+    }
+
+    I2cBatchAwaiter Read(uint8_t* buffer, int length) const
+    {
+        I2cBatch batch;
+        int iRead = batch.AddRead(m_deviceAddress, length);
+        return I2cBatchAwaiter(std::move(batch), iRead >= 0, iRead, buffer);
+    }
+
+    /// @brief Sets register pointer and reads registers with a single transfer.
+    I2cBatchAwaiter ReadRegisters(uint8_t firstRegister, uint8_t* buffer, int length) const
+    {
+        I2cBatch batch;
+        bool isValid = batch.AddWrite(m_deviceAddress, { firstRegister }) >= 0;
+        int iRead = batch.AddRead(m_deviceAddress, length);
+        return I2cBatchAwaiter(std::move(batch), isValid && iRead >= 0, iRead, buffer);
+    }
+
+    /// @brief Transfers batch owned by the coroutine, read data is available in the batch.
+    static I2cBatchAwaiter Transfer(I2cBatch& batch) { return I2cBatchAwaiter(batch); }
+
+    static I2cDelayAwaiter Delay(std::chrono::microseconds delay) { return I2cDelayAwaiter(delay); }
+    static I2cDelayUntilAwaiter DelayUntil(TimePoint dueTime) { return I2cDelayUntilAwaiter(dueTime); }
+    /// @brief Suspends until the next iteration of the schedule is due.
+    static I2cDelayUntilAwaiter NextPeriod(I2cPeriodicSchedule& schedule)
+    {
+        return I2cDelayUntilAwaiter(schedule.GetNextTime(std::chrono::steady_clock::now()));
+    }
+
+    /// @brief Completion time of the last transferred batch.
+    static I2cTransferTimeAwaiter GetTransferTime() { return I2cTransferTimeAwaiter(); }
+
+private:
+    const int m_deviceAddress;
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "I2cBus.h"
+
+#include <cstdint>
+#include <cstdio>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// @brief Binary trace of bus operations, host byte order.
+/// File starts with I2cTraceFileHeader, followed by records: I2cTraceRecordHeader and
+/// messagesCount times I2cTraceMessageHeader with length data bytes. Data of a write message
+/// is the written bytes, data of a read message is the bytes read (undefined if the operation failed).
+/// SelectDevice is recorded as a single message with zero length.
+namespace I2cTrace
+{
+    constexpr uint32_t c_magic = 0x54433249;  // "I2CT"
+    constexpr uint32_t c_version = 1;
+
+    enum class Operation : uint8_t
+    {
+        SelectDevice,
+        Read,
+        Write,
+        Transfer
+    };
+
+    struct FileHeader
+    {
+        uint32_t magic = c_magic;
+        uint32_t version = c_version;
+    };
+
+    struct RecordHeader
+    {
+        // Since the start of the recording
+        uint64_t timeUs = 0;
+        Operation operation = Operation::SelectDevice;
+        uint8_t messagesCount = 0;
+        uint16_t reserved = 0;
+        int32_t result = 0;
+    };
+
+    struct MessageHeader
+    {
+        static constexpr uint8_t c_readFlag = 0x01;
+
+        uint8_t deviceAddress = 0;
+        uint8_t flags = 0;
+        uint16_t length = 0;
+    };
+
+    static_assert(sizeof(RecordHeader) == 16 && sizeof(MessageHeader) == 4, "Trace records must not be padded");
+}
+
+/// @brief Records every operation of the wrapped bus to a trace file.
+/// Records are buffered by stdio and flushed on Close, when the buffer is full the bus thread writes it out.
+class I2cTraceRecorder : public I2cBus
+{
+public:
+    I2cTraceRecorder(std::unique_ptr<I2cBus> spI2cBus, const char* traceFileName);
+    ~I2cTraceRecorder() override;
+
+    /// @brief Opens the wrapped bus. Trace file is created by the first Open only,
+    /// reopening the bus after a reset appends to the same trace.
+    int Open() override;
+    void Close() override;
+    bool IsOpen() const override { return m_spI2cBus->IsOpen(); }
+
+    int SelectDevice(int deviceAddress) override;
+    int Read(uint8_t* buffer, int length) override;
+    int Write(const uint8_t* buffer, int length) override;
+    int Transfer(I2cMessage* messages, int count) override;
+
+    uint64_t GetRecordsCount() const { return m_recordsCount.load(); }
+
+private:
+    void WriteRecord(I2cTrace::Operation operation, int result, const I2cMessage* messages, int count);
+    void Flush();
+
+    static constexpr size_t c_fileBufferSize = 64 * 1024;
+
+    std::unique_ptr<I2cBus> m_spI2cBus;
+    const std::string m_traceFileName;
+    FILE* m_pTraceFile = nullptr;
+    std::chrono::steady_clock::time_point m_startTime;
+    int m_selectedDeviceAddress = -1;
+    std::atomic<uint64_t> m_recordsCount = 0;
+    std::mutex m_mutex;
+};
+
+/// @brief Bus which answers operations from a trace recorded by I2cTraceRecorder, without delays.
+/// Messages are replayed per device: every device gets the bytes it returned in the recording,
+/// in the same order, however operations of different devices interleave or are combined.
+/// Operation which does not match the next recorded message of its device fails and is counted as mismatch.
+class ReplayI2cBus : public I2cBus
+{
+public:
+    explicit ReplayI2cBus(const char* traceFileName);
+
+    /// @brief Loads the trace on the first Open, reopening does not rewind it.
+    int Open() override;
+    void Close() override;
+    bool IsOpen() const override { return m_isOpen.load(); }
+
+    int SelectDevice(int deviceAddress) override;
+    int Read(uint8_t* buffer, int length) override;
+    int Write(const uint8_t* buffer, int length) override;
+    int Transfer(I2cMessage* messages, int count) override;
+
+    uint64_t GetReplayedCount() const { return m_replayedCount.load(); }
+    uint64_t GetMismatchesCount() const { return m_mismatchesCount.load(); }
+    /// @brief All recorded messages were replayed.
+    bool IsCompleted();
+
+private:
+    struct Message
+    {
+        bool isRead = false;
+        bool isFailed = false;
+        uint16_t length = 0;
+        // Offset of the data in m_data
+        size_t dataOffset = 0;
+    };
+
+    struct DeviceTrace
+    {
+        std::vector<Message> messages;
+        size_t cursor = 0;
+    };
+
+    int LoadTrace();
+    // Replays the next message of the device, called with m_mutex held
+    int ReplayMessage(int deviceAddress, bool isRead, uint8_t* data, int length);
+
+    const std::string m_traceFileName;
+    std::vector<uint8_t> m_data;
+    DeviceTrace m_devices[c_maxDeviceAddress + 1];
+    bool m_isLoaded = false;
+    std::atomic<bool> m_isOpen = false;
+    int m_selectedDeviceAddress = -1;
+    std::atomic<uint64_t> m_replayedCount = 0;
+    std::atomic<uint64_t> m_mismatchesCount = 0;
+    std::mutex m_mutex;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "I2cBus.h"
+
+#include <string>
+
+/// @brief I2cBus on top of Linux i2c-dev device file.
+class LinuxI2cBus : public I2cBus
+{
+public:
+    LinuxI2cBus(const char* i2cFileName) : m_i2cFileName(i2cFileName) {}
+    ~LinuxI2cBus() override { Close(); }
+
+    int Open() override;
+    void Close() override;
+    bool IsOpen() const override { return m_i2cHandle >= 0; }
+
+    int SelectDevice(int deviceAddress) override;
+    int Read(uint8_t* buffer, int length) override;
+    int Write(const uint8_t* buffer, int length) override;
+    int Transfer(I2cMessage* messages, int count) override;
+
+private:
+    const std::string m_i2cFileName;
+    int m_i2cHandle = -1;
+};
@@ -1,19 +1,24 @@
 #pragma once
 
+#include "CommonDefs.h"
+#include "I2cCoroutine.h"
+#include "SamplingService.h"
+
 #include <PolarCoordinates.h>
+#include <RateEstimator.h>
 
 #include <cstdint>
 
 #include <atomic>
 #include <chrono>
-#include <functional>
+#include <condition_variable>
 #include <future>
+#include <mutex>
 
 class I2cAccessor;
-class I2cTransaction;
-
-enum class HwResult : int;
+class I2cTask;
 
+/// @brief CONF register of AS5600, byte 0x07 in the low bits.
 union ConfigReg
 {
     int raw;
@@ -42,31 +47,190 @@ union StatusReg
     } fields;
 };
 
+/// @brief Programmable registers of AS5600.
+struct MagnetConfig
+{
+    int zpos = 0;
+    int mpos = 0;
+    int mang = 0;
+    ConfigReg conf = { 0 };
+};
+
 class MagnetSensor
 {
     static constexpr int c_sensorAddress = 0x36;
+    static constexpr uint8_t c_configRegister = 0x01;
+    static constexpr int c_configLength = 8;
+    static constexpr uint8_t c_confRegister = 0x07;
+    static constexpr uint8_t c_statusRegister = 0x0B;
+    static constexpr uint8_t c_angleRegister = 0x0E;
+    static constexpr uint8_t c_agcRegister = 0x1A;
+    // STATUS, RAW ANGLE, ANGLE and AGC in a single block read
+    static constexpr int c_burstLength = c_agcRegister - c_statusRegister + 1;
+    // Regular angle measurements between burst reads checking the magnet
+    static constexpr int c_statusReadInterval = 50;
+    // Samples are evenly spaced for the angular velocity estimate
+    static constexpr std::chrono::microseconds c_samplingPeriod = std::chrono::milliseconds(2);
+    // Adaptive polling while approaching a stop point
+    static constexpr std::chrono::microseconds c_minPollInterval = std::chrono::microseconds(750);
+    static constexpr std::chrono::microseconds c_maxPollInterval = std::chrono::milliseconds(10);
+    // Samples taken within the predicted time to the stop point
+    static constexpr int c_approachSamplesCount = 4;
+    // Below this speed the arrival time is not predictable, raw angle units per second
+    static constexpr int c_minApproachSpeed = 200;
+    // Stop timer is armed when the predicted crossing is this close, later samples refine it
+    static constexpr std::chrono::microseconds c_stopSchedulingHorizon = std::chrono::milliseconds(10);
+    // Refined predictions closer than this to the armed time keep the timer
+    static constexpr int64_t c_stopRearmThresholdUs = 100;
+
+    enum Request : int
+    {
+        ReadConfigRequest = 1,
+        WriteConfigRequest = 2,
+        ReadStatusRequest = 4
+    };
 
 public:
     static constexpr int c_angleRange = HwCoord::c_angleRange;
 
-    MagnetSensor(I2cAccessor& i2cAccessor) : m_i2cAccessor(i2cAccessor) {}
+    /// @param pState: if not null, every measurement is published to it.
+    MagnetSensor(I2cAccessor& i2cAccessor, HwStateLock* pState = nullptr);
+    ~MagnetSensor();
 
-    void ReadConfig();
-    void ReadStatus();
+    /// @brief Reads ZPOS, MPOS, MANG and CONF, see GetConfig.
+    std::future<HwResult> ReadConfigAsync();
+    /// @brief Read-modify-write of CONF bits set in fieldsMask. Concurrent updates of different bits are merged.
+    std::future<HwResult> UpdateConfigAsync(ConfigReg config, int fieldsMask);
+    /// @brief Sets slow filter and fast filter threshold: faster response while moving, less noise at rest.
+    /// @param sf: 0 - 16x (slowest) ... 3 - 2x.
+    /// @param fth: 0 - slow filter only, 1..7 - threshold of 6, 7, 9, 18, 21, 24, 10 LSB.
+    std::future<HwResult> SetFilterAsync(int sf, int fth);
+    /// @brief Reads STATUS, angle and AGC in one block, see GetLastStatus.
+    /// The measurement stream does the same every c_statusReadInterval samples.
+    std::future<HwResult> ReadStatusAsync();
 
+    MagnetConfig GetConfig() const;
+    StatusReg GetLastStatus() const { return StatusReg { static_cast<unsigned char>(m_lastStatus.load()) }; }
+    int GetLastAgc() const { return m_lastStatus.load() >> 8; }
+    bool IsMagnetHealthy() const
+    {
+        StatusReg status = GetLastStatus();
+        return status.fields.magnet_detected && !status.fields.magnet_high && !status.fields.magnet_low;
+    }
+
+    /// @brief Operations below watch the same measurement stream and may run concurrently.
     std::future<HwResult> ReadAngleAsync();
-    std::future<HwResult> NotifyWhenAngle(std::function<HwResult(int)>&& isExpectedValue,
-        std::function<void(HwResult)>&& completionAction);
+    /// @brief Completes with the raw angle measured for this read.
+    HwSampleFuture ReadSampleAsync();
+    /// @param pollInterval: if not null, the stream may sample less often, see HwPollInterval.
+    /// Watcher added meanwhile gets its first sample after the interval.
+    std::future<HwResult> NotifyWhenAngle(HwValuePredicate&& isExpectedValue,
+        HwCompletionAction&& completionAction, HwPollInterval&& pollInterval = nullptr);
+    /// @brief Completes when the rotation in directionSign reaches stopDistance before the unwrapped target.
+    /// @param isAdaptive: poll sparsely while the stop point is far in time, densest right before it.
+    /// Otherwise poll at the fixed sampling period.
+    std::future<HwResult> NotifyWhenApproaching(int64_t targetUnwrappedAngle, int directionSign, int stopDistance,
+        HwCompletionAction&& completionAction, bool isAdaptive = true);
+    /// @brief As adaptive NotifyWhenApproaching, but stopAction runs on a timer of the I2cAccessor thread
+    /// at the crossing time predicted from the latest samples, not at the first sample past the stop point.
+    /// The sample past the stop point remains the safety net. stopAction runs once, with HwResult::Success
+    /// or with the failure of the operation. Future completes at the next sample after it.
+    /// A new scheduled stop drops the stopAction of the pending one.
+    std::future<HwResult> ScheduleStopWhenApproaching(int64_t targetUnwrappedAngle, int directionSign,
+        int stopDistance, HwCompletionAction&& stopAction);
+    /// @brief Completes all pending operations with HwResult::Abort.
+    void AbortMeasurement() { m_sampling.Abort(); }
     
     int GetLastRawAngle() const { return m_lastRawAngle.load(); }
-    uint32_t GetLastMeasurementTimeMs() const { return m_lastMeasurementTimeMs.load(); }
+    /// @brief Continuous angle counting full turns, raw angle units.
+    /// Sensor must be sampled at least once per half turn, including between measurements.
+    int64_t GetUnwrappedAngle() const { return m_unwrappedAngle.load(); }
+    /// @brief Filtered estimates, raw angle units per second and per second squared.
+    int GetAngularVelocity() const { return m_angularVelocity.load(); }
+    int GetAngularAcceleration() const { return m_angularAcceleration.load(); }
+    /// @brief Time when the rotation in directionSign reaches the unwrapped angle, extrapolated from the last
+    /// measurement with the filtered velocity and acceleration.
+    /// @return steady_clock microseconds, -1 if the rotation is too slow or stops before the angle.
+    int64_t PredictArrivalTimeUs(int64_t unwrappedAngle, int directionSign) const;
+    /// @brief steady_clock microseconds at I/O completion of the last measurement.
+    int64_t GetLastMeasurementTimeUs() const { return m_lastMeasurementTimeUs.load(); }
+    /// @brief Raw angle measurements, published by the I2cAccessor thread.
+    const HwSampleRing& GetSamples() const { return m_samples; }
     bool IsMeasurementStale() const;
     int GetRawAngleFetchIfStale();
 
+    /// @brief Fixed rate of the measurement stream, overruns and skipped samples.
+    /// Intervals of adaptive polling are not counted.
+    const I2cPeriodicSchedule& GetSamplingSchedule() const { return m_samplingSchedule; }
+
+    /// @brief Replaces the default filter of the unwrapped angle. Must not be called while measuring.
+    void SetFilterOptions(const RateEstimatorOptions& options) { m_angleFilter.SetOptions(options); }
+    static RateEstimatorOptions GetDefaultFilterOptions();
+
+    /// @return angle in [0, c_angleRange).
+    static int WrapAngle(int angle) { return (angle % c_angleRange + c_angleRange) % c_angleRange; }
+    /// @return Shortest signed rotation from one raw angle to another, [-c_angleRange / 2, c_angleRange / 2).
+    static int GetAngleDiff(int fromAngle, int toAngle)
+    {
+        return WrapAngle(toAngle - fromAngle + c_angleRange / 2) - c_angleRange / 2;
+    }
+    /// @return Rotation in the given direction from one raw angle to another, [0, c_angleRange).
+    static int GetAngleDistance(int fromAngle, int toAngle, bool isIncreasing)
+    {
+        return WrapAngle(isIncreasing ? toAngle - fromAngle : fromAngle - toAngle);
+    }
+
 private:
-    void FillI2cTransactionReadAngle(I2cTransaction& transaction);
+    /// @brief Measures while the sampling service has watchers.
+    I2cTask RunSampling();
+    void ProcessAngle(int rawAngle, int64_t timeUs);
+    /// @brief Interval which samples the remaining time to the stop point c_approachSamplesCount times.
+    std::chrono::microseconds GetApproachPollInterval(int64_t stopUnwrappedAngle, int directionSign) const;
+    /// @brief Predicate of a scheduled stop, called for every sample.
+    HwResult CheckScheduledStop(uint64_t stopId, int64_t stopUnwrappedAngle, int directionSign);
+    /// @brief Pushes a stop timer unless the armed one is due about the same time.
+    void ArmStopTimer(uint64_t stopId, int64_t stopTimeUs);
+    /// @brief Runs the stop action if the stop is still pending.
+    void CompleteStop(uint64_t stopId, HwResult status);
+    bool IsStopPending(uint64_t stopId) const;
+    void StoreConfig(const uint8_t* data);
+    /// @brief Requests are served by the measurement stream, the future completes after the request is.
+    std::future<HwResult> PushRequest(Request request);
 
     I2cAccessor& m_i2cAccessor;
+    SamplingService m_sampling;
+    I2cPeriodicSchedule m_samplingSchedule { c_samplingPeriod };
+    HwStateLock* m_pState;
     std::atomic_int32_t m_lastRawAngle = 0;
-    std::atomic_uint32_t m_lastMeasurementTimeMs = 0;
+    std::atomic_int64_t m_lastMeasurementTimeUs = 0;
+    std::atomic_int32_t m_requests = 0;
+    std::atomic_uint64_t m_requestsCount = 0;
+    std::atomic_uint64_t m_servedRequestsCount = 0;
+    // Pending CONF update: mask in the high word, value in the low one
+    std::atomic_uint32_t m_configUpdate = 0;
+    mutable std::mutex m_configMutex;
+    MagnetConfig m_config;
+    // STATUS in the low byte, AGC above
+    std::atomic_int32_t m_lastStatus = 0;
+    std::atomic_int64_t m_unwrappedAngle = 0;
+    std::atomic_int32_t m_angularVelocity = 0;
+    std::atomic_int32_t m_angularAcceleration = 0;
+    HwSampleRing m_samples;
+    // Owned by the I2cAccessor thread. Velocity is estimated from the angle, acceleration from the velocity
+    RateEstimator m_angleFilter;
+    RateEstimator m_velocityFilter;
+
+    // Scheduled stop, the action is taken by whichever of the timer and the sample comes first
+    mutable std::mutex m_stopMutex;
+    uint64_t m_stopId = 0;
+    HwCompletionAction m_stopAction;
+    // Pushed stop timer replaces the pending one of the owner, -1 if none was available
+    int m_stopTimerOwner = -1;
+    // Owned by the I2cAccessor thread
+    uint64_t m_armedStopId = 0;
+    int64_t m_armedStopTimeUs = 0;
+    // Guarded by m_stopMutex: pushed stop timers not completed yet, they refer to this sensor
+    int m_stopTimersCount = 0;
+    bool m_isDestroying = false;
+    std::condition_variable m_stopTimersCompleted;
 };
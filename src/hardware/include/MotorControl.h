@@ -1,28 +1,22 @@
 #pragma once
 
 #include "CommonDefs.h"
+#include "MotorDriver.h"
 
+#include <memory>
 #include <thread>
 
-enum class MotorDirection : int
-{
-    Close = 0,
-    Open = 1,
-    Left = 1,
-    Right = 0,
-};
-
 class MotorControl
 {
-private:
-    static constexpr int c_pwmFreq = 10000;
-
 public:
     MotorControl(int pwmPin, int drainPin) :
         m_pwmPin(pwmPin), m_drainPin(drainPin) {}
     ~MotorControl() { Stop(); }
 
+    /// @brief Drives the motor with pigpio on the pins of the constructor.
     int Init();
+    /// @brief Drives the motor with the given driver, e.g. SimulatedMotor.
+    int Init(std::unique_ptr<MotorDriver> spDriver);
     void Run(MotorDirection direction, int dutyPercent);
     template <class _Rep, class _Period>
     void RunDuration(MotorDirection direction, const std::chrono::duration<_Rep, _Period>& duration, int dutyPercent)
@@ -38,11 +32,10 @@ public:
     TimePoint RunStartedAt() { return m_runStartTime; }
     void RestoreInitialPosition();
 
-    static int InitializeGpio();
-
 private:
     const int m_pwmPin = -1;
     const int m_drainPin = -1;
+    std::unique_ptr<MotorDriver> m_spDriver;
 
     MotorDirection m_lastDirection = MotorDirection::Close;
 
@@ -0,0 +1,24 @@
+#pragma once
+
+enum class MotorDirection : int
+{
+    Close = 0,
+    Open = 1,
+    Left = 1,
+    Right = 0,
+};
+
+/// @brief Power stage of a DC motor. All operations return negative value on failure.
+class MotorDriver
+{
+public:
+    virtual ~MotorDriver() = default;
+
+    virtual int Init() = 0;
+
+    /// @brief Drives the motor in direction with dutyPercent of the supply voltage.
+    virtual int Run(MotorDirection direction, int dutyPercent) = 0;
+
+    /// @brief Drives both motor terminals low, the motor brakes to a stop.
+    virtual int Stop() = 0;
+};
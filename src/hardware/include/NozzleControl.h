@@ -2,11 +2,13 @@
 
 #include "MagnetSensor.h"
 #include "MotorControl.h"
+#include "MotorDriver.h"
 #include "PressureSensor.h"
 
 #include <atomic>
 #include <memory>
 
+class I2cBus;
 class Logger;
 enum LogLevel : int;
 
@@ -21,12 +23,29 @@ private:
     // Custom definitions
     static constexpr int c_waterPressureThreshold = 10;
     static constexpr int c_valveOpeningTimeoutMs = 3'000;
+    // Pressure units per second, faster changes share the overshoot of this rate
+    static constexpr int c_maxPressureChangeRate = 10'000;
+    // Raw angle units per second, faster rotations share the coast of this speed
+    static constexpr int c_maxAngularVelocity = 16'000;
+    // Nozzle measured this long after the motor stop has stopped coasting
+    static constexpr int64_t c_nozzleSettleTimeUs = 100'000;
+    // Monitoring accepts sparser sampling, so that it does not override adaptive polling
+    static constexpr std::chrono::microseconds c_monitoringInterval = std::chrono::milliseconds(10);
 
 public:
     NozzleControl();
     ~NozzleControl();
 
-    int Init();
+    /// @brief Initializes I2C bus and motors.
+    /// @param i2cTraceFileName: if not null, every I2C operation is recorded to the file for offline replay.
+    int Init(const char* i2cTraceFileName = nullptr);
+    /// @brief Initializes with the given I2C bus, e.g. ReplayI2cBus.
+    int Init(std::unique_ptr<I2cBus> spI2cBus);
+    /// @brief Initializes with the given bus and motor drivers, e.g. SimulatedI2cBus and SimulatedMotor.
+    int Init(std::unique_ptr<I2cBus> spI2cBus, std::unique_ptr<MotorDriver> spNozzleDriver,
+        std::unique_ptr<MotorDriver> spValveDriver);
+    /// @brief Runs without a Pi: simulated motors turn the simulated magnet and valve, see ConnectSimulatedNozzle.
+    int InitSimulated();
 
     std::future<HwResult> RotateToAsync(int targetAngle, int dutyPercent);
     std::future<HwResult> RotateToDirectionAsync(MotorDirection direction, int targetAngle, int dutyPercent);
@@ -36,6 +55,14 @@ public:
     int GetPositionFetchIfStale() { return m_magnetSensor.GetRawAngleFetchIfStale(); }
     int GetPositionFetch();
 
+    /// @brief Latest angle and pressure, never waits for the bus. Fresh while the sensors are sampled,
+    /// e.g. after StartMonitoring.
+    HwState GetState() const { return m_state.Load(); }
+    /// @brief Keeps both sensors sampling until StopMonitoring. Re-arms a sensor whose monitoring failed.
+    void StartMonitoring();
+    /// @brief Monitoring of each sensor completes with its next sample.
+    void StopMonitoring() { m_isMonitoring = false; }
+
     std::future<HwResult> SetPressureAsync(int targetPressure, int dutyPercent);
     std::future<HwResult> SetPressureDiffAsync(int diffPressure, int dutyPercent);
     std::future<HwResult> FetchPressure() { return m_pressureSensor.ReadPressureAsync(); }
@@ -78,6 +105,11 @@ public:
 protected:
     HwResult ProcessPressureMeasurement(int curPressure);
     void StopMotorValveIfRunning(int curPressure, int changeRate);
+    void StopMotorNozzle(HwResult status, int64_t stopUnwrappedAngle);
+    /// @brief Learns the coast of the last stop if the nozzle has settled since.
+    void LearnNozzleCoast();
+    void MonitorAngle();
+    void MonitorPressure();
 
     bool IsItWaterPressure(int curPressure) {
         return curPressure > m_pressureSensor.GetMinPressure() + c_waterPressureThreshold;
@@ -93,14 +125,28 @@ protected:
     MotorControl m_motorValve;
     
     std::unique_ptr<I2cAccessor> m_spI2cAccessor;
+    // Published by the sensors, must outlive them
+    HwStateLock m_state;
+    std::atomic<bool> m_isMonitoring = false;
+    // Set while the monitoring watcher of the sensor is active
+    std::atomic<bool> m_isAngleMonitored = false;
+    std::atomic<bool> m_isPressureMonitored = false;
     MagnetSensor m_magnetSensor;
     PressureSensor m_pressureSensor;
     
     std::atomic<int> m_targetPressure = 0;
-    OvershootInterpolator<20, 1000, int> m_overshootInterpolator;
+    OvershootInterpolator<20, c_maxPressureChangeRate, int64_t> m_overshootInterpolator;
     int m_iPressureMeasurementAfterMotorStart = 0;
     int m_pressureAtMotorStop = -1;
-    int m_changeRateAtMotorStop = 0;    Logger* m_pLogger = nullptr;
+    int m_changeRateAtMotorStop = 0;
+    // Coast after the nozzle motor stop, learnt per angular velocity at the stop
+    OvershootInterpolator<20, c_maxAngularVelocity, int64_t> m_coastInterpolator;
+    int m_lastNozzleStopSpeed = 0;
+    // Written by the stop action on the I2cAccessor thread, velocity is written last
+    std::atomic<int64_t> m_nozzleStopAngle = 0;
+    std::atomic<int64_t> m_nozzleStopTimeUs = 0;
+    std::atomic<int> m_nozzleStopVelocity = 0;
+    Logger* m_pLogger = nullptr;
 };
 
 class Interpolator;
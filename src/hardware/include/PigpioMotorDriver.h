@@ -0,0 +1,23 @@
+#pragma once
+
+#include "MotorDriver.h"
+
+/// @brief MotorDriver on top of pigpio: hardware PWM pin and a drain pin selecting the direction.
+class PigpioMotorDriver : public MotorDriver
+{
+    static constexpr int c_pwmFreq = 10000;
+
+public:
+    PigpioMotorDriver(int pwmPin, int drainPin) :
+        m_pwmPin(pwmPin), m_drainPin(drainPin) {}
+
+    int Init() override;
+    int Run(MotorDirection direction, int dutyPercent) override;
+    int Stop() override;
+
+    static int InitializeGpio();
+
+private:
+    const int m_pwmPin = -1;
+    const int m_drainPin = -1;
+};
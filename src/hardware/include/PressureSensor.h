@@ -1,15 +1,20 @@
 #pragma once
 
+#include "CommonDefs.h"
+#include "I2cCoroutine.h"
+#include "SamplingService.h"
+
+#include <RateEstimator.h>
+
 #include <climits>
+#include <cstdint>
 
 #include <atomic>
-#include <functional>
+#include <chrono>
 #include <future>
 
 class I2cAccessor;
-class I2cTransaction;
-
-enum class HwResult : int;
+class I2cTask;
 
 class PressureSensor
 {
@@ -17,31 +22,75 @@ class PressureSensor
     static constexpr int c_busyFlag = 0x20;
     static constexpr int c_integrityFlag = 0x04;
     static constexpr int c_mathSatFlag = 0x01;
+    static constexpr int c_measurementLength = 4;
 
     static constexpr int c_maxPsi = 25;
     static constexpr int c_minPsi = 0;
     static constexpr int c_outputMax = 0xE66666;
     static constexpr int c_outputMin = 0x19999A;
     static constexpr int c_truncateShift = 10;
-    static constexpr int c_rateMultiplyer = 1;
+
+    // Conversion time model: wait for the learnt conversion time, poll the status only while busy
+    static constexpr std::chrono::microseconds c_datasheetConversionTime = std::chrono::milliseconds(3);
+    static constexpr std::chrono::microseconds c_busyPollInterval = std::chrono::milliseconds(1);
+    static constexpr std::chrono::microseconds c_adaptiveBusyPollInterval = std::chrono::microseconds(200);
+    static constexpr std::chrono::microseconds c_minConversionTime = std::chrono::microseconds(200);
+    static constexpr std::chrono::microseconds c_maxConversionTime = std::chrono::milliseconds(20);
+    static constexpr int c_conversionProbeDivisor = 64;
+    static constexpr int c_minConversionProbeUs = 10;
+    // Fits the datasheet conversion time and a busy poll
+    static constexpr std::chrono::microseconds c_samplingPeriod = std::chrono::milliseconds(4);
 
 public:
-    PressureSensor(I2cAccessor& i2cAccessor) : m_i2cAccessor(i2cAccessor) {}
+    /// @param pState: if not null, every measurement is published to it.
+    PressureSensor(I2cAccessor& i2cAccessor, HwStateLock* pState = nullptr);
 
+    /// @brief Operations below watch the same measurement stream and may run concurrently.
     std::future<HwResult> ReadPressureAsync();
-    std::future<HwResult> NotifyWhenPressure(std::function<HwResult(int)>&& isExpectedValue,
-        std::function<void(HwResult)>&& completionAction);
+    /// @brief Completes with the pressure measured for this read, truncated like GetLastPressure.
+    HwSampleFuture ReadSampleAsync();
+    std::future<HwResult> NotifyWhenPressure(HwValuePredicate&& isExpectedValue,
+        HwCompletionAction&& completionAction);
 
-    std::future<HwResult> StartContinuousMeasurement(std::function<HwResult(int)>&& onValue);
+    std::future<HwResult> StartContinuousMeasurement(HwValuePredicate&& onValue);
+    /// @brief Completes all pending operations with HwResult::Abort.
     void AbortMeasurement();
 
     int GetLastRawPressure() const { return m_lastRawValue.load(); }
     int GetLastPressure() const { return TruncateNoise(GetLastRawPressure()); }
     int GetMinRawPressure() const { return m_minRawValue.load(); }
     int GetMinPressure() const { return TruncateNoise(GetMinRawPressure()); }
-    int GetLastChangeRate() const { return m_lastChangeRate.load(); }
 
-    uint32_t GetLastMeasurementTimeMs() const { return m_lastMeasurementTimeMs.load(); }
+    /// @brief Pressure and its rate of change estimated from the measurements, see SetFilterOptions.
+    int GetFilteredRawPressure() const { return m_filteredRawValue.load(); }
+    int GetFilteredPressure() const { return TruncateNoise(GetFilteredRawPressure()); }
+    /// @brief Raw pressure units per second.
+    int GetRawChangeRate() const { return m_rawChangeRate.load(); }
+    /// @brief Pressure units per second.
+    int GetChangeRate() const { return TruncateNoise(GetRawChangeRate()); }
+
+    /// @brief Adaptive (default): the result is read after the conversion time learnt from previous measurements.
+    /// Otherwise after the fixed datasheet time.
+    void SetAdaptiveConversion(bool isAdaptive) { m_isAdaptiveConversion = isAdaptive; }
+    std::chrono::microseconds GetConversionTime() const { return std::chrono::microseconds(m_conversionTimeUs.load()); }
+    /// @brief Conversion time model after a measurement read with the adaptive conversion.
+    /// @param busyReadsCount: reads which found the conversion running, c_adaptiveBusyPollInterval apart.
+    /// @param elapsedUs: from the request to the read of the result.
+    static int LearnConversionTimeUs(int conversionTimeUs, int busyReadsCount, int64_t elapsedUs);
+    /// @brief Status reads which found the conversion still running.
+    uint64_t GetBusyReadsCount() const { return m_busyReadsCount.load(); }
+
+    /// @brief Fixed rate of the measurement stream, overruns and skipped samples.
+    const I2cPeriodicSchedule& GetSamplingSchedule() const { return m_samplingSchedule; }
+
+    /// @brief Replaces the default Kalman filter of the raw pressure. Must not be called while measuring.
+    void SetFilterOptions(const RateEstimatorOptions& options) { m_filter.SetOptions(options); }
+    static RateEstimatorOptions GetDefaultFilterOptions();
+
+    /// @brief steady_clock microseconds at I/O completion of the last measurement.
+    int64_t GetLastMeasurementTimeUs() const { return m_lastMeasurementTimeUs.load(); }
+    /// @brief Raw pressure measurements, published by the I2cAccessor thread.
+    const HwSampleRing& GetSamples() const { return m_samples; }
     bool IsMeasurementStale() const;
     int GetPressureFetchIfStale();
 
@@ -58,14 +107,29 @@ public:
         return ConvertRawToPsi(value << c_truncateShift);
     }
 
+    /// @brief 24-bit output of the sensor at the pressure, e.g. for a simulated sensor.
+    static int ConvertPsiToOutput(double psi)
+    {
+        return c_outputMin + static_cast<int>((psi - c_minPsi) * (c_outputMax - c_outputMin) / (c_maxPsi - c_minPsi));
+    }
+
 private:
-    void FillI2cTransaction(I2cTransaction& transaction);
-    void ProcessMeasurement(int curValue);
+    /// @brief Measures while the sampling service has watchers.
+    I2cTask RunSampling();
+    void ProcessMeasurement(int curValue, int64_t timeUs);
 
-    I2cAccessor& m_i2cAccessor;
-    I2cTransaction* m_pCurTransaction = nullptr;
+    SamplingService m_sampling;
+    I2cPeriodicSchedule m_samplingSchedule { c_samplingPeriod };
+    HwStateLock* m_pState;
     std::atomic_int32_t m_lastRawValue = 0;
-    std::atomic_int32_t m_lastChangeRate = 0;
+    std::atomic_int32_t m_filteredRawValue = 0;
+    std::atomic_int32_t m_rawChangeRate = 0;
     std::atomic_int32_t m_minRawValue = INT_MAX / 2;
-    std::atomic_uint32_t m_lastMeasurementTimeMs = 0;
+    std::atomic_int64_t m_lastMeasurementTimeUs = 0;
+    HwSampleRing m_samples;
+    std::atomic<bool> m_isAdaptiveConversion = true;
+    std::atomic_int32_t m_conversionTimeUs = static_cast<int32_t>(c_datasheetConversionTime.count());
+    std::atomic_uint64_t m_busyReadsCount = 0;
+    // Owned by the I2cAccessor thread
+    RateEstimator m_filter;
 };
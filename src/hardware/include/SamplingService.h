@@ -0,0 +1,228 @@
+#pragma once
+
+#include "CommonDefs.h"
+
+#include <atomic>
+#include <future>
+#include <utility>
+
+class I2cAccessor;
+class I2cTask;
+enum class I2cPriority;
+
+/// @brief Sample which completed a watcher.
+struct HwSampleResult
+{
+    HwResult status = HwResult::Busy;
+    // Last published sample, taken by the sensor whatever the status is
+    HwSample sample;
+};
+
+using HwSampleContinuation = InlineFunction<void(const HwSampleResult&), 32>;
+
+/// @brief Shared state of HwSampleFuture, pooled by SampleWatchers.
+/// Referenced by the watcher until it completes and by the future until it is destroyed.
+class SampleCompletion
+{
+public:
+    /// @return false if the completion is still referenced.
+    bool TryAcquire();
+    void Release() { m_refCount.fetch_sub(1, std::memory_order_acq_rel); }
+
+    /// @brief Sampling thread. Runs the continuation if it is set already.
+    void Complete(const HwSampleResult& result);
+
+    bool IsReady() const { return m_state.load(std::memory_order_acquire) == State::Completed; }
+    const HwSampleResult& Wait() const;
+    void Then(HwSampleContinuation&& continuation);
+
+private:
+    enum class State : int
+    {
+        Pending,
+        Continued,
+        Completed
+    };
+
+    std::atomic<int> m_refCount = 0;
+    std::atomic<State> m_state = State::Pending;
+    HwSampleResult m_result;
+    HwSampleContinuation m_continuation;
+};
+
+/// @brief Result of a sensor read carrying the sample itself, so the caller does not read
+/// the latest value separately, which may already be a newer sample.
+/// Completed without std::promise allocation. Move-only, must not outlive the sensor.
+class HwSampleFuture
+{
+public:
+    HwSampleFuture() = default;
+    explicit HwSampleFuture(SampleCompletion* pCompletion) : m_pCompletion(pCompletion) {}
+    /// @brief Future which is ready right away.
+    explicit HwSampleFuture(const HwSampleResult& result) : m_result(result) {}
+
+    HwSampleFuture(HwSampleFuture&& other) noexcept :
+        m_pCompletion(std::exchange(other.m_pCompletion, nullptr)), m_result(other.m_result)
+    {}
+    HwSampleFuture& operator=(HwSampleFuture&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+            m_pCompletion = std::exchange(other.m_pCompletion, nullptr);
+            m_result = other.m_result;
+        }
+        return *this;
+    }
+    ~HwSampleFuture() { Reset(); }
+
+    bool IsReady() const { return m_pCompletion == nullptr || m_pCompletion->IsReady(); }
+    /// @brief Waits for the result.
+    HwSampleResult Get() const { return m_pCompletion != nullptr ? m_pCompletion->Wait() : m_result; }
+    /// @brief Sets the only continuation. It runs on the sampling thread when the future completes,
+    /// or on the calling thread if it is ready already.
+    void Then(HwSampleContinuation&& continuation)
+    {
+        if (m_pCompletion != nullptr)
+        {
+            m_pCompletion->Then(std::move(continuation));
+        }
+        else
+        {
+            continuation(m_result);
+        }
+    }
+
+private:
+    void Reset()
+    {
+        if (m_pCompletion != nullptr)
+        {
+            m_pCompletion->Release();
+            m_pCompletion = nullptr;
+        }
+    }
+
+    SampleCompletion* m_pCompletion = nullptr;
+    HwSampleResult m_result;
+};
+
+/// @brief Registry of watchers of a sample stream. Lock-free: watchers are added from any thread,
+/// the sampling thread passes samples to them.
+class SampleWatchers
+{
+public:
+    static constexpr int c_maxWatchers = 8;
+
+    /// @brief Predicate gets every sample until it returns anything but HwResult::Repeat,
+    /// the watcher is completed with that result. Predicate and completion action run on the sampling thread.
+    /// @return Future of the watcher, completed with HwResult::Busy right away if the registry is full.
+    /// @param pollInterval: if null, the watcher accepts the default interval of the stream.
+    std::future<HwResult> Add(HwValuePredicate&& isExpectedValue, HwCompletionAction&& completionAction,
+        HwPollInterval&& pollInterval = nullptr);
+    /// @brief Same as Add, the future gets the sample which completed the watcher.
+    HwSampleFuture AddSampleWatcher(HwValuePredicate&& isExpectedValue);
+
+    /// @brief Sampling thread only. Passes the sample value to every watcher, completed watchers are removed.
+    /// @return true if a watcher still waits for samples.
+    bool Notify(const HwSample& sample);
+
+    /// @brief Sampling thread only. Completes all watchers with status.
+    void CompleteAll(HwResult status);
+
+    /// @brief Any thread. Watchers added before the call are completed with HwResult::Abort by the sampling thread.
+    void CancelAll();
+    /// @brief Sampling thread only. Completes cancelled watchers.
+    void CompleteCancelled();
+
+    bool HasWatchers() const { return m_watchersCount.load() > 0; }
+
+    /// @brief Sampling thread only.
+    /// @return Shortest interval accepted by all watchers.
+    std::chrono::microseconds GetPollInterval(std::chrono::microseconds defaultInterval) const;
+
+private:
+    enum class State : int
+    {
+        Free,
+        Adding,
+        Active
+    };
+
+    struct Watcher
+    {
+        std::atomic<State> state = State::Free;
+        std::atomic<bool> isCancelled = false;
+        HwValuePredicate isExpectedValue;
+        HwCompletionAction completionAction;
+        HwPollInterval pollInterval;
+        std::promise<HwResult> promise;
+        // Completed instead of the promise if set
+        SampleCompletion* pCompletion = nullptr;
+    };
+
+    /// @return Watcher in the Adding state, nullptr if the registry is full.
+    Watcher* Reserve();
+    void Activate(Watcher& watcher, HwValuePredicate&& isExpectedValue, HwCompletionAction&& completionAction,
+        HwPollInterval&& pollInterval, SampleCompletion* pCompletion);
+    void Complete(Watcher& watcher, HwResult status);
+
+    Watcher m_watchers[c_maxWatchers];
+    // Futures may keep completions after their watchers are completed
+    SampleCompletion m_completions[2 * c_maxWatchers];
+    // Sampling thread only
+    HwSample m_lastSample;
+    // Added and active watchers
+    std::atomic<int> m_watchersCount = 0;
+};
+
+/// @brief Continuous sampling of a sensor shared by any number of watchers.
+/// Sampling transaction runs while there are watchers, so concurrent operations on the sensor
+/// observe the same samples instead of aborting each other's transactions.
+class SamplingService
+{
+public:
+    /// @brief Creates the sampling coroutine. It must call Publish with every sample and
+    /// co_return HwResult::Success when Publish returns false.
+    using TaskFactory = InlineFunction<I2cTask(), 16>;
+
+    SamplingService(I2cAccessor& i2cAccessor, int deviceAddress, I2cPriority priority, TaskFactory&& taskFactory) :
+        m_i2cAccessor(i2cAccessor), m_deviceAddress(deviceAddress), m_priority(priority),
+        m_taskFactory(std::move(taskFactory))
+    {}
+    /// @brief Aborts sampling and waits until the bus thread no longer refers to the service.
+    ~SamplingService();
+
+    /// @brief Adds watcher of the samples, starts sampling if it is not running.
+    std::future<HwResult> AddWatcher(HwValuePredicate&& isExpectedValue, HwCompletionAction&& completionAction,
+        HwPollInterval&& pollInterval = nullptr);
+    HwSampleFuture AddSampleWatcher(HwValuePredicate&& isExpectedValue);
+
+    /// @brief Sampling coroutine only.
+    /// @return false if no watcher is left and sampling should stop.
+    bool Publish(const HwSample& sample) { return m_watchers.Notify(sample); }
+    /// @brief Sampling coroutine only, see SampleWatchers::GetPollInterval.
+    std::chrono::microseconds GetPollInterval(std::chrono::microseconds defaultInterval) const
+    {
+        return m_watchers.GetPollInterval(defaultInterval);
+    }
+
+    /// @brief Completes current watchers with HwResult::Abort and stops sampling unless new watchers are added.
+    void Abort();
+
+    bool IsSampling() const { return m_isSampling.load(); }
+
+private:
+    void Start();
+
+    I2cAccessor& m_i2cAccessor;
+    const int m_deviceAddress;
+    const I2cPriority m_priority;
+    TaskFactory m_taskFactory;
+    SampleWatchers m_watchers;
+    // Sampling transaction is pushed and not completed yet
+    std::atomic<bool> m_isSampling = false;
+    // Completion action of the sampling transaction runs. Watchers are completed before the transaction,
+    // so their owners may destroy the service while the bus thread still refers to it
+    std::atomic<bool> m_isCompleting = false;
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "CommonDefs.h"
+#include "I2cBus.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+/// @brief Physical quantity measured by a simulated sensor, e.g. position of a SimulatedMotor.
+using SimulatedSignal = std::function<int()>;
+
+/// @brief Device attached to SimulatedI2cBus. Called with the bus lock held.
+class SimulatedI2cDevice
+{
+public:
+    virtual ~SimulatedI2cDevice() = default;
+
+    virtual int Read(uint8_t* buffer, int length) = 0;
+    virtual int Write(const uint8_t* buffer, int length) = 0;
+};
+
+/// @brief Pressure sensor model. Measurement is started with AA 00 00 command,
+/// busy flag is reported until the conversion time passes, then 24-bit output is read.
+class SimulatedPressureSensor : public SimulatedI2cDevice
+{
+public:
+    static constexpr int c_address = 0x18;
+    static constexpr uint8_t c_statusPowered = 0x40;
+    static constexpr uint8_t c_statusBusy = 0x20;
+
+    void SetConversionTime(std::chrono::microseconds conversionTime) { m_conversionTime = conversionTime; }
+    /// @brief Sets 24-bit output returned by the following conversions.
+    void SetOutput(int rawOutput) { m_rawOutput = rawOutput; }
+    /// @brief Conversions latch the source instead of the set output. Must be set before the bus is used.
+    void SetOutputSource(SimulatedSignal&& outputSource) { m_outputSource = std::move(outputSource); }
+    int GetMeasurementsCount() const { return m_measurementsCount.load(); }
+
+    int Read(uint8_t* buffer, int length) override;
+    int Write(const uint8_t* buffer, int length) override;
+
+private:
+    std::atomic<std::chrono::microseconds> m_conversionTime = std::chrono::microseconds(3500);
+    std::atomic<int> m_rawOutput = 0;
+    std::atomic<int> m_measurementsCount = 0;
+    SimulatedSignal m_outputSource;
+
+    bool m_isConverting = false;
+    TimePoint m_conversionEndTime;
+    int m_latchedOutput = 0;
+};
+
+/// @brief AS5600 magnet sensor model. Register pointer is set by the first written byte,
+/// reads auto-increment it. ANGLE and RAW ANGLE registers return the current angle.
+class SimulatedMagnetSensor : public SimulatedI2cDevice
+{
+public:
+    static constexpr int c_address = 0x36;
+    static constexpr int c_registersCount = 0x20;
+    static constexpr uint8_t c_statusMagnetDetected = 0x20;
+
+    SimulatedMagnetSensor();
+
+    /// @brief Sets 12-bit raw angle, the magnet keeps rotating from it at the set velocity.
+    void SetAngle(int rawAngle);
+    int GetAngle() const;
+    /// @brief Constant rotation, raw angle units per second.
+    void SetVelocity(int unitsPerSecond);
+    /// @brief Magnet follows the source, set angle and velocity are ignored. Must be set before the bus is used.
+    /// @param angleSource: unwrapped angle, raw angle units.
+    void SetAngleSource(SimulatedSignal&& angleSource) { m_angleSource = std::move(angleSource); }
+
+    int Read(uint8_t* buffer, int length) override;
+    int Write(const uint8_t* buffer, int length) override;
+
+private:
+    uint8_t ReadRegister(int reg, int rawAngle) const;
+
+    std::atomic<int> m_rawAngle = 0;
+    std::atomic<int> m_velocity = 0;
+    // steady_clock microseconds when the magnet was at m_rawAngle
+    std::atomic<int64_t> m_angleTimeUs = 0;
+    SimulatedSignal m_angleSource;
+    uint8_t m_registers[c_registersCount] = {};
+    int m_registerPointer = 0;
+};
+
+/// @brief In-process I2cBus with the pressure sensor and the AS5600 magnet sensor attached.
+/// Allows running hardware code in unit tests and benchmarks without I2C hardware.
+class SimulatedI2cBus : public I2cBus
+{
+public:
+    SimulatedI2cBus();
+
+    int Open() override;
+    void Close() override;
+    bool IsOpen() const override { return m_isOpen.load(); }
+
+    int SelectDevice(int deviceAddress) override;
+    int Read(uint8_t* buffer, int length) override;
+    int Write(const uint8_t* buffer, int length) override;
+    int Transfer(I2cMessage* messages, int count) override;
+
+    /// @brief Duration of every bus operation: perOperation + perByte * bytes transferred.
+    void SetLatency(std::chrono::microseconds perOperation, std::chrono::microseconds perByte);
+
+    /// @brief Attaches additional device. Device must outlive the bus.
+    void AttachDevice(int deviceAddress, SimulatedI2cDevice* pDevice);
+
+    SimulatedPressureSensor& GetPressureSensor() { return m_pressureSensor; }
+    SimulatedMagnetSensor& GetMagnetSensor() { return m_magnetSensor; }
+
+    /// @brief Next count Read, Write and Transfer operations fail as if the bus glitched.
+    void FailNextOperations(int count);
+
+    /// @brief Number of bus operations, each of them is a system call with LinuxI2cBus.
+    uint64_t GetOperationsCount() const { return m_operationsCount.load(); }
+    uint64_t GetSelectDeviceCount() const { return m_selectDeviceCount.load(); }
+    uint64_t GetOpenCount() const { return m_openCount.load(); }
+
+private:
+    SimulatedI2cDevice* FindDevice(int deviceAddress) const;
+    void WaitLatency(int bytesCount) const;
+    bool ConsumeInjectedFailure();
+
+    SimulatedPressureSensor m_pressureSensor;
+    SimulatedMagnetSensor m_magnetSensor;
+    SimulatedI2cDevice* m_devices[c_maxDeviceAddress + 1] = {};
+
+    std::atomic<bool> m_isOpen = false;
+    int m_selectedDeviceAddress = -1;
+    std::chrono::microseconds m_operationLatency = {};
+    std::chrono::microseconds m_byteLatency = {};
+    int m_failOperationsCount = 0;
+
+    std::atomic<uint64_t> m_operationsCount = 0;
+    std::atomic<uint64_t> m_selectDeviceCount = 0;
+    std::atomic<uint64_t> m_openCount = 0;
+
+    std::mutex m_mutex;
+};
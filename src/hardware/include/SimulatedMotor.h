@@ -0,0 +1,106 @@
+#pragma once
+
+#include "CommonDefs.h"
+#include "MotorDriver.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+class SimulatedI2cBus;
+
+struct SimulatedMotorOptions
+{
+    // No-load speed at full duty, position units per second
+    double maxSpeed = 12'000;
+    // Inertia: speed follows the duty with this time constant, also when braking to a stop
+    std::chrono::microseconds timeConstant = std::chrono::milliseconds(40);
+    // Friction as the duty the motor needs to start, steady speed is linear in the duty above it
+    int startDutyPercent = 10;
+    // Gearbox backlash and driver dead time: reversed motor is not driven for this long
+    std::chrono::microseconds directionChangeDelay = std::chrono::milliseconds(20);
+};
+
+/// @brief DC motor with gearbox: duty-to-speed curve, inertia, friction and direction change delay.
+/// Position increases with MotorDirection::Right. Thread-safe, the state is integrated up to every call.
+class SimulatedMotor : public MotorDriver
+{
+    static constexpr std::chrono::microseconds c_integrationStep = std::chrono::microseconds(100);
+
+public:
+    explicit SimulatedMotor(const SimulatedMotorOptions& options = {});
+
+    int Init() override { return 0; }
+    int Run(MotorDirection direction, int dutyPercent) override;
+    int Stop() override;
+
+    /// @brief Position units, raw angle units of AS5600 for the nozzle.
+    double GetPosition() const;
+    void SetPosition(double position);
+    /// @brief Position units per second.
+    double GetSpeed() const;
+
+    /// @brief Nozzle turning a few times per second, valve turning half a turn in about two seconds.
+    static SimulatedMotorOptions GetNozzleOptions() { return {}; }
+    static SimulatedMotorOptions GetValveOptions();
+
+private:
+    void SetDuty(double duty);
+    /// @brief Integrates the motion up to now. Called with the lock held.
+    void Advance() const;
+
+    const SimulatedMotorOptions m_options;
+    mutable std::mutex m_mutex;
+    mutable TimePoint m_time;
+    mutable double m_position = 0;
+    mutable double m_speed = 0;
+    // Signed fraction of the supply voltage, applied from m_dutyTime after a reversal
+    mutable double m_duty = 0;
+    mutable double m_pendingDuty = 0;
+    mutable TimePoint m_dutyTime;
+    int m_lastDriveSign = 0;
+};
+
+struct SimulatedValveOptions
+{
+    // Valve motor position of half a turn of the ball: closed at 0, fully open in the middle
+    double halfTurnPosition = 2'000;
+    // Ball seals this far on both sides of the closed position
+    double sealedPosition = 100;
+    // Fully open valve passes this many times the flow area of the nozzle
+    double maxAreaRatio = 3.0;
+    double supplyPsi = 15.0;
+    // Pipe filling and draining: pressure follows the valve with this time constant
+    std::chrono::microseconds timeConstant = std::chrono::milliseconds(80);
+};
+
+/// @brief Ball valve turned by a SimulatedMotor, pressure in front of the nozzle follows its opening.
+class SimulatedValve
+{
+public:
+    SimulatedValve(const SimulatedMotor& motor, const SimulatedValveOptions& options = {});
+
+    /// @brief 24-bit output of the pressure sensor.
+    int GetPressureOutput();
+    double GetPressurePsi();
+    /// @brief Zero supply simulates missing water pressure.
+    void SetSupplyPsi(double supplyPsi);
+
+private:
+    /// @brief Pressure the flow settles at for the current valve position.
+    double GetSteadyPressurePsi() const;
+    void Advance();
+
+    const SimulatedMotor& m_motor;
+    const SimulatedValveOptions m_options;
+    std::mutex m_mutex;
+    TimePoint m_time;
+    double m_supplyPsi = 0;
+    double m_pressurePsi = 0;
+};
+
+/// @brief Sensors of the bus follow the motors: the magnet turns with the nozzle motor,
+/// pressure follows the valve turned by the valve motor. Motors must outlive the bus.
+/// @return Valve shared with the pressure sensor, e.g. to turn the water supply off.
+std::shared_ptr<SimulatedValve> ConnectSimulatedNozzle(SimulatedI2cBus& i2cBus, const SimulatedMotor& nozzleMotor,
+    const SimulatedMotor& valveMotor, const SimulatedValveOptions& valveOptions = {});
@@ -1,45 +1,108 @@
 #include "I2cAccessor.h"
+#include "I2cTrace.h"
+#include "LinuxI2cBus.h"
 
 #include <errno.h>
-#include <fcntl.h>
-#include <linux/i2c-dev.h>
-#include <sys/ioctl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
+#include <cstring>
 #include <iostream>
 
 using namespace std;
 static constexpr TimePoint c_errorTime = chrono::steady_clock::time_point::min();
 
+static_assert(I2cAccessor::c_maxTransactions * I2cBatch::c_maxMessages <= I2cBus::c_maxTransferMessages,
+    "Combined batches may exceed transfer messages limit");
+
+I2cAccessor::I2cAccessor()
+{
+    for (int& slotIdx : m_deviceSlots)
+    {
+        slotIdx = -1;
+    }
+    for (int& slotIdx : m_timerSlots)
+    {
+        slotIdx = -1;
+    }
+    for (int i = c_maxTransactions; i-- > 0;)
+    {
+        ReleaseSlot(i);
+    }
+    for (int i = c_maxTimerOwners; i-- > 0;)
+    {
+        m_freeTimerOwners.Push(i);
+    }
+}
+
 I2cAccessor::~I2cAccessor()
 {
     if (m_thread.has_value())
     {
         cout << "Quit I2cAccessor thread" << endl;
-        {
-            unique_lock lk(m_mutex);
-            m_quit = true;
-        }
-        m_cv.notify_one();
+        m_quit = true;
+        Wake();
         m_thread->join();
     }
 
-    if (m_i2cHandle >= 0)
+    for (int handle : { m_epollHandle, m_timerHandle, m_wakeEventHandle })
     {
-        close(m_i2cHandle);
+        if (handle >= 0)
+        {
+            close(handle);
+        }
     }
 }
 
-int I2cAccessor::Init(const char* i2cFileName)
+int I2cAccessor::Init(const char* i2cFileName, const I2cThreadOptions& threadOptions)
 {
-    errno = 0;
-    m_i2cHandle = open(i2cFileName, O_RDWR);
-    if (m_i2cHandle < 0)
+    return Init(make_unique<LinuxI2cBus>(i2cFileName), threadOptions);
+}
+
+int I2cAccessor::Init(unique_ptr<I2cBus> spI2cBus, const I2cThreadOptions& threadOptions)
+{
+    if (spI2cBus != nullptr && !m_traceFileName.empty())
+    {
+        spI2cBus = make_unique<I2cTraceRecorder>(move(spI2cBus), m_traceFileName.c_str());
+    }
+    if (spI2cBus == nullptr || spI2cBus->Open() < 0)
+    {
+        return -1;
+    }
+    m_spI2cBus = move(spI2cBus);
+
+    m_epollHandle = epoll_create1(EPOLL_CLOEXEC);
+    m_timerHandle = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_wakeEventHandle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollHandle < 0 || m_timerHandle < 0 || m_wakeEventHandle < 0)
     {
-        cout << "Open i2c file failed with: " << hex << errno << dec << endl;
+        cerr << "I2cAccessor::Init: failed to create loop handles: " << strerror(errno) << endl;
         return -1;
     }
 
+    for (int handle : { m_timerHandle, m_wakeEventHandle })
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = handle;
+        if (epoll_ctl(m_epollHandle, EPOLL_CTL_ADD, handle, &event) < 0)
+        {
+            cerr << "I2cAccessor::Init: epoll_ctl failed: " << strerror(errno) << endl;
+            return -1;
+        }
+    }
+
+    m_threadOptions = threadOptions;
+    if (m_threadOptions.lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        cerr << "I2cAccessor::Init: mlockall failed: " << strerror(errno) << endl;
+    }
+
     m_thread.emplace([this]{ LoopFunc(); });
 
     return 0;
@@ -47,72 +110,521 @@ int I2cAccessor::Init(const char* i2cFileName)
 
 I2cTransaction* I2cAccessor::PushTransaction(I2cTransaction&& newTransaction)
 {
-    I2cTransaction* pushedTransaction = nullptr;
+    int deviceAddress = newTransaction.m_deviceAddress;
+    if (deviceAddress < 0 || deviceAddress > I2cBus::c_maxDeviceAddress)
+    {
+        cerr << "I2cAccessor::PushTransaction: invalid device address " << deviceAddress << endl;
+        newTransaction.Complete(HwResult::Failure);
+        return nullptr;
+    }
+
+    int slotIdx = m_freeSlots.Pop();
+    if (slotIdx < 0)
+    {
+        cerr << "I2cAccessor::PushTransaction: transaction pool exhausted" << endl;
+        newTransaction.Complete(HwResult::Busy);
+        return nullptr;
+    }
+
+    // Slot is owned by this thread until it is submitted
+    TransactionSlot& slot = m_slots[slotIdx];
+    slot.abortEpoch = m_abortEpochs[deviceAddress].load();
+    slot.startTime = chrono::steady_clock::now();
+    I2cTransaction* pushedTransaction = &slot.transaction.emplace(move(newTransaction));
+    m_submittedSlots.Push(slotIdx);
+
+    Wake();
+
+    return pushedTransaction;
+}
+
+void I2cAccessor::AbortDevice(int deviceAddress)
+{
+    if (deviceAddress < 0 || deviceAddress > I2cBus::c_maxDeviceAddress)
+    {
+        return;
+    }
+
+    m_abortEpochs[deviceAddress].fetch_add(1);
+    m_isAbortRequested = true;
+    Wake();
+}
+
+int I2cAccessor::AcquireTimerOwner()
+{
+    return m_freeTimerOwners.Pop();
+}
+
+void I2cAccessor::ReleaseTimerOwner(int ownerId)
+{
+    if (ownerId >= 0 && ownerId < c_maxTimerOwners)
+    {
+        m_freeTimerOwners.Push(ownerId);
+    }
+}
+
+bool I2cAccessor::PushTimer(int ownerId, TimePoint time, I2cCompletionAction&& action)
+{
+    if (ownerId < 0 || ownerId >= c_maxTimerOwners)
+    {
+        cerr << "I2cAccessor::PushTimer: invalid owner " << ownerId << endl;
+        action(HwResult::Failure);
+        return false;
+    }
+
+    int slotIdx = m_freeSlots.Pop();
+    if (slotIdx < 0)
+    {
+        cerr << "I2cAccessor::PushTimer: transaction pool exhausted" << endl;
+        action(HwResult::Busy);
+        return false;
+    }
+
+    // Slot is owned by this thread until it is submitted
+    TransactionSlot& slot = m_slots[slotIdx];
+    slot.abortEpoch = m_timerAbortEpochs[ownerId].load();
+    slot.startTime = time;
+    slot.timerOwner = ownerId;
+    slot.timerAction = move(action);
+    m_submittedSlots.Push(slotIdx);
+
+    Wake();
+
+    return true;
+}
+
+void I2cAccessor::CancelTimer(int ownerId)
+{
+    if (ownerId < 0 || ownerId >= c_maxTimerOwners)
     {
-        unique_lock lk(m_mutex);
-        for (auto& transaction : m_transactions)
+        return;
+    }
+
+    m_timerAbortEpochs[ownerId].fetch_add(1);
+    m_isAbortRequested = true;
+    Wake();
+}
+
+void I2cAccessor::DrainSubmittedSlots()
+{
+    int slotIndices[c_maxTransactions];
+    int slotsCount = m_submittedSlots.PopAll(slotIndices);
+    for (int i = 0; i < slotsCount; ++i)
+    {
+        int slotIdx = slotIndices[i];
+        // Abort old transaction with same device address, or old timer of the owner
+        int& ownerSlotIdx = GetOwnerSlot(slotIdx);
+        if (ownerSlotIdx >= 0)
         {
-            // Abort all old transactions with same device address
-            if (transaction.m_deviceAddress == newTransaction.m_deviceAddress)
-            {
-                transaction.m_isAborted = true;
-            }
+            AbortSlot(ownerSlotIdx);
         }
-        pushedTransaction = &m_transactions.emplace_front(move(newTransaction));
-        auto curTime = chrono::steady_clock::now();
-        m_tasks.emplace(curTime, m_transactions.begin());
+        ownerSlotIdx = slotIdx;
+        if (!IsTimerSlot(slotIdx) && m_slots[slotIdx].transaction->m_pSchedule != nullptr)
+        {
+            // Schedule is advanced by this thread only
+            m_slots[slotIdx].transaction->m_pSchedule->Start(m_slots[slotIdx].startTime);
+        }
+        Schedule(slotIdx, m_slots[slotIdx].startTime);
     }
-    m_cv.notify_one();
+}
 
-    return pushedTransaction;
+void I2cAccessor::ProcessAbortRequests()
+{
+    if (!m_isAbortRequested.exchange(false))
+    {
+        return;
+    }
+
+    for (int slotIdx : m_deviceSlots)
+    {
+        if (slotIdx >= 0 && IsAbortRequested(slotIdx))
+        {
+            AbortSlot(slotIdx);
+        }
+    }
+    for (int slotIdx : m_timerSlots)
+    {
+        if (slotIdx >= 0 && IsAbortRequested(slotIdx))
+        {
+            AbortSlot(slotIdx);
+        }
+    }
+}
+
+bool I2cAccessor::IsAbortRequested(int slotIdx) const
+{
+    const TransactionSlot& slot = m_slots[slotIdx];
+    if (IsTimerSlot(slotIdx))
+    {
+        return slot.abortEpoch != m_timerAbortEpochs[slot.timerOwner].load();
+    }
+    return slot.abortEpoch != m_abortEpochs[slot.transaction->m_deviceAddress].load();
+}
+
+int& I2cAccessor::GetOwnerSlot(int slotIdx)
+{
+    const TransactionSlot& slot = m_slots[slotIdx];
+    return IsTimerSlot(slotIdx) ? m_timerSlots[slot.timerOwner] : m_deviceSlots[slot.transaction->m_deviceAddress];
+}
+
+void I2cAccessor::CompleteTimer(int slotIdx, HwResult status)
+{
+    I2cCompletionAction action = move(m_slots[slotIdx].timerAction);
+    ReleaseSlot(slotIdx);
+    action(status);
+}
+
+void I2cAccessor::AbortSlot(int slotIdx)
+{
+    // Transactions are in one of the heaps whenever the bus thread does not run them
+    if (m_timerHeap.Contains(slotIdx))
+    {
+        m_timerHeap.Remove(slotIdx, TimerLess());
+    }
+    else if (m_readyHeap.Contains(slotIdx))
+    {
+        m_readyHeap.Remove(slotIdx, ReadyLess());
+    }
+
+    if (IsTimerSlot(slotIdx))
+    {
+        CompleteTimer(slotIdx, HwResult::Abort);
+        return;
+    }
+    m_slots[slotIdx].transaction->Complete(HwResult::Abort);
+    ReleaseSlot(slotIdx);
 }
 
 void I2cAccessor::LoopFunc()
 {
-    while (true)
+    ApplyThreadOptions();
+
+    while (!m_quit)
     {
-        unique_lock lk(m_mutex);
-        if (m_quit) break;
+        DrainSubmittedSlots();
+        ProcessAbortRequests();
 
-        if (m_tasks.empty())
+        auto curTime = chrono::steady_clock::now();
+        MoveDueToReady(curTime);
+
+        if (m_readyHeap.IsEmpty())
         {
-            m_cv.wait(lk);
+            // Transactions submitted meanwhile have signaled the wake event, so epoll returns right away
+            ArmTimer();
+            WaitForEvents();
+            continue;
+        }
+
+        int slotIndices[c_maxTransactions];
+        int slotsCount = 0;
+        slotIndices[slotsCount++] = PopReady(curTime);
+
+        if (IsBatchCommandReady(slotIndices[0]))
+        {
+            // Combine batch commands of all due transactions into a single transfer
+            while (!m_readyHeap.IsEmpty() && IsBatchCommandReady(m_readyHeap.Top()))
+            {
+                slotIndices[slotsCount++] = PopReady(curTime);
+            }
+        }
+
+        TimePoint nextTimes[c_maxTransactions];
+        if (slotsCount > 1)
+        {
+            RunCombinedBatchCommands(slotIndices, slotsCount, nextTimes);
         }
         else
         {
-            auto curTime = chrono::steady_clock::now();
-            if (curTime < m_tasks.top().startTime)
+            nextTimes[0] = m_slots[slotIndices[0]].transaction->RunCommand(*this);
+        }
+
+        for (int i = 0; i < slotsCount; ++i)
+        {
+            int slotIdx = slotIndices[i];
+            I2cTransaction& transaction = *m_slots[slotIdx].transaction;
+            // Aborted while running
+            if ((transaction.m_isAborted || IsAbortRequested(slotIdx)) && !transaction.IsCompleted())
+            {
+                transaction.Complete(HwResult::Abort);
+            }
+
+            if (transaction.IsCompleted())
+            {
+                ReleaseSlot(slotIdx);
+            }
+            else
             {
-                m_cv.wait_until(lk, m_tasks.top().startTime);
+                Schedule(slotIdx, nextTimes[i]);
             }
         }
-        
-        if (m_quit) break;
-        if (m_tasks.empty()) continue;
-        auto curTime = chrono::steady_clock::now();
-        if (curTime < m_tasks.top().startTime) continue;
+    }
+}
 
-        auto curTask = m_tasks.top();
-        m_tasks.pop();
-        
-        lk.unlock();
+void I2cAccessor::ApplyThreadOptions()
+{
+    if (m_threadOptions.realtimePriority > 0)
+    {
+        sched_param param = {};
+        param.sched_priority = m_threadOptions.realtimePriority;
+        int status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (status != 0)
+        {
+            cerr << "I2cAccessor: SCHED_FIFO priority " << param.sched_priority << " failed: " << strerror(status) << endl;
+        }
+    }
 
-        TimePoint nextTime = curTask.itTransaction->RunCommand();
+    if (m_threadOptions.cpu >= 0)
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(m_threadOptions.cpu, &cpuSet);
+        int status = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (status != 0)
+        {
+            cerr << "I2cAccessor: pinning to CPU " << m_threadOptions.cpu << " failed: " << strerror(status) << endl;
+        }
+    }
+}
 
-        lk.lock();
+void I2cAccessor::ArmTimer()
+{
+    TimePoint wakeupTime = m_timerHeap.IsEmpty() ? TimePoint::max() : m_slots[m_timerHeap.Top()].startTime;
+    if (wakeupTime == m_armedWakeupTime)
+    {
+        return;
+    }
+    m_armedWakeupTime = wakeupTime;
+
+    // steady_clock is CLOCK_MONOTONIC, zero timer value disarms the timer
+    itimerspec timerSpec = {};
+    if (wakeupTime != TimePoint::max())
+    {
+        auto timeNs = chrono::duration_cast<chrono::nanoseconds>(wakeupTime.time_since_epoch()).count();
+        timerSpec.it_value.tv_sec = static_cast<time_t>(timeNs / 1'000'000'000);
+        timerSpec.it_value.tv_nsec = static_cast<long>(timeNs % 1'000'000'000);
+    }
+    timerfd_settime(m_timerHandle, TFD_TIMER_ABSTIME, &timerSpec, nullptr);
+}
+
+void I2cAccessor::WaitForEvents()
+{
+    epoll_event events[2];
+    int eventsCount = epoll_wait(m_epollHandle, events, 2, -1);
+    auto curTime = chrono::steady_clock::now();
 
-        if (curTask.itTransaction->IsCompleted())
+    for (int i = 0; i < eventsCount; ++i)
+    {
+        uint64_t value = 0;
+        if (read(events[i].data.fd, &value, sizeof(value)) < 0)
         {
-            m_transactions.erase(curTask.itTransaction);
+            continue;
         }
-        else
+
+        if (events[i].data.fd == m_timerHandle && m_armedWakeupTime != TimePoint::max())
         {
-            m_tasks.emplace(nextTime, curTask.itTransaction);
+            // Expired timer is disarmed
+            lock_guard lk(m_statsMutex);
+            m_wakeupJitter.Add(chrono::duration_cast<chrono::microseconds>(curTime - m_armedWakeupTime));
+            m_armedWakeupTime = TimePoint::max();
         }
     }
 }
 
-TimePoint I2cTransaction::RunCommand()
+void I2cAccessor::Wake()
+{
+    if (m_wakeEventHandle < 0)
+    {
+        return;
+    }
+
+    uint64_t value = 1;
+    if (write(m_wakeEventHandle, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        cerr << "I2cAccessor::Wake: eventfd write failed: " << strerror(errno) << endl;
+    }
+}
+
+I2cJitterReport I2cAccessor::GetWakeupJitter()
+{
+    lock_guard lk(m_statsMutex);
+    I2cJitterReport report;
+    report.wakeupsCount = m_wakeupJitter.GetCount();
+    report.mean = m_wakeupJitter.GetMean();
+    report.p50 = m_wakeupJitter.GetPercentile(50);
+    report.p99 = m_wakeupJitter.GetPercentile(99);
+    report.max = m_wakeupJitter.GetMax();
+    return report;
+}
+
+void I2cAccessor::ResetWakeupJitter()
+{
+    lock_guard lk(m_statsMutex);
+    m_wakeupJitter.Reset();
+}
+
+bool I2cAccessor::SelectDevice(int deviceAddress)
+{
+    if (m_selectedDeviceAddress.load() == deviceAddress)
+    {
+        m_savedSelectIoctlsCount.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    if (m_spI2cBus->SelectDevice(deviceAddress) < 0)
+    {
+        m_selectedDeviceAddress = -1;
+        return false;
+    }
+
+    m_selectedDeviceAddress = deviceAddress;
+    return true;
+}
+
+void I2cAccessor::ResetBus()
+{
+    // Runs on the bus thread, no operation of I2cAccessor is in progress
+    cerr << "I2cAccessor: resetting the bus after repeated failures" << endl;
+    m_busResetsCount.fetch_add(1, memory_order_relaxed);
+    m_selectedDeviceAddress = -1;
+    m_spI2cBus->Close();
+    if (m_spI2cBus->Open() < 0)
+    {
+        cerr << "I2cAccessor: failed to reopen the bus" << endl;
+    }
+}
+
+I2cRetryStats I2cAccessor::GetRetryStats() const
+{
+    I2cRetryStats stats;
+    stats.retriesCount = m_retriesCount.load();
+    stats.recoveredErrorsCount = m_recoveredErrorsCount.load();
+    stats.busResetsCount = m_busResetsCount.load();
+    stats.exhaustedCount = m_exhaustedRetriesCount.load();
+    return stats;
+}
+
+void I2cAccessor::ResetRetryStats()
+{
+    m_retriesCount = 0;
+    m_recoveredErrorsCount = 0;
+    m_busResetsCount = 0;
+    m_exhaustedRetriesCount = 0;
+}
+
+bool I2cAccessor::IsBatchCommandReady(int slotIdx)
+{
+    I2cTransaction& transaction = *m_slots[slotIdx].transaction;
+    return transaction.IsBatchCommand() && transaction.IsValid() && !transaction.m_isAborted &&
+        transaction.GetCurrentBatch()->IsRepeatable();
+}
+
+void I2cAccessor::RunCombinedBatchCommands(const int slotIndices[], int count, TimePoint nextTimes[])
+{
+    I2cBatch* batches[c_maxTransactions] = {};
+    for (int i = 0; i < count; ++i)
+    {
+        batches[i] = m_slots[slotIndices[i]].transaction->GetCurrentBatch();
+    }
+
+    if (I2cBatch::Transfer(*m_spI2cBus, batches, count) != HwResult::Success)
+    {
+        // Run transactions one by one to find out which device failed, batches are repeatable
+        for (int i = 0; i < count; ++i)
+        {
+            nextTimes[i] = m_slots[slotIndices[i]].transaction->RunCommand(*this);
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        nextTimes[i] = m_slots[slotIndices[i]].transaction->CompleteBatchCommand(*this, HwResult::Success);
+    }
+}
+
+void I2cAccessor::ReleaseSlot(int slotIdx)
+{
+    TransactionSlot& slot = m_slots[slotIdx];
+    if ((slot.transaction.has_value() || IsTimerSlot(slotIdx)) && GetOwnerSlot(slotIdx) == slotIdx)
+    {
+        GetOwnerSlot(slotIdx) = -1;
+    }
+    slot.transaction.reset();
+    slot.timerAction.Reset();
+    slot.timerOwner = -1;
+    m_freeSlots.Push(slotIdx);
+}
+
+void I2cAccessor::Schedule(int slotIdx, TimePoint startTime)
+{
+    TransactionSlot& slot = m_slots[slotIdx];
+    slot.startTime = startTime;
+    slot.deadline = IsTimerSlot(slotIdx) ? startTime : startTime + slot.transaction->m_relativeDeadline;
+    m_timerHeap.Push(slotIdx, TimerLess());
+}
+
+void I2cAccessor::MoveDueToReady(TimePoint curTime)
+{
+    while (!m_timerHeap.IsEmpty() && m_slots[m_timerHeap.Top()].startTime <= curTime)
+    {
+        int slotIdx = m_timerHeap.Pop(TimerLess());
+        if (IsTimerSlot(slotIdx))
+        {
+            // Cancelled after the abort requests were processed
+            CompleteTimer(slotIdx, IsAbortRequested(slotIdx) ? HwResult::Abort : HwResult::Success);
+            continue;
+        }
+        m_readyHeap.Push(slotIdx, ReadyLess());
+    }
+}
+
+int I2cAccessor::PopReady(TimePoint curTime)
+{
+    int slotIdx = m_readyHeap.Pop(ReadyLess());
+    const TransactionSlot& slot = m_slots[slotIdx];
+
+    // Waiting time of the first command is counted from the push
+    auto latency = chrono::duration_cast<chrono::microseconds>(curTime - slot.startTime);
+    lock_guard lk(m_statsMutex);
+    I2cLatencyStats& stats = m_latencyStats[static_cast<int>(slot.transaction->m_priority)];
+    ++stats.commandsCount;
+    stats.totalLatency += latency;
+    stats.maxLatency = max(stats.maxLatency, latency);
+    if (curTime > slot.deadline)
+    {
+        ++stats.missedDeadlinesCount;
+    }
+
+    return slotIdx;
+}
+
+bool I2cAccessor::IsReadyBefore(int slotIdx1, int slotIdx2) const
+{
+    const TransactionSlot& slot1 = m_slots[slotIdx1];
+    const TransactionSlot& slot2 = m_slots[slotIdx2];
+    if (slot1.transaction->m_priority != slot2.transaction->m_priority)
+    {
+        return slot1.transaction->m_priority < slot2.transaction->m_priority;
+    }
+    return slot1.deadline < slot2.deadline;
+}
+
+I2cLatencyStats I2cAccessor::GetLatencyStats(I2cPriority priority)
+{
+    lock_guard lk(m_statsMutex);
+    return m_latencyStats[static_cast<int>(priority)];
+}
+
+void I2cAccessor::ResetLatencyStats()
+{
+    lock_guard lk(m_statsMutex);
+    for (auto& stats : m_latencyStats)
+    {
+        stats = {};
+    }
+}
+
+TimePoint I2cTransaction::RunCommand(I2cAccessor& i2cAccessor)
 {
     if (m_isAborted)
     {
@@ -120,20 +632,142 @@ TimePoint I2cTransaction::RunCommand()
         return c_errorTime;
     }
 
-    if (IsCompleted() || !IsValid())
+    if (IsCompleted())
     {
         return c_errorTime;
     }
 
-    if (ioctl(m_i2cHandle, I2C_SLAVE, m_deviceAddress) < 0)
+    if (!IsValid())
     {
-        Complete(HwResult::CommFailure);
+        Complete(HwResult::Failure);
         return c_errorTime;
     }
 
+    if (I2cBatch* batch = GetCurrentBatch(); batch != nullptr)
+    {
+        return CompleteBatchCommand(i2cAccessor, I2cBatch::Transfer(*m_pI2cBus, &batch, 1));
+    }
+
+    if (m_isCoroutine)
+    {
+        // Started or delay elapsed
+        return ResumeCoroutine();
+    }
+
+    if (!i2cAccessor.SelectDevice(m_deviceAddress))
+    {
+        return RetryCommand(i2cAccessor);
+    }
+
     std::chrono::milliseconds delayNextCommand = 0ms;
-    HwResult status = (*m_commands[m_curCommand])(m_i2cHandle, delayNextCommand);
-    
+    HwResult status = m_commands[m_curCommand].command(*m_pI2cBus, delayNextCommand);
+
+    return ProcessCommandStatus(i2cAccessor, status, delayNextCommand);
+}
+
+TimePoint I2cTransaction::ResumeCoroutine()
+{
+    I2cTaskPromise& promise = m_task.m_handle.promise();
+    promise.m_pPendingBatch = nullptr;
+    promise.m_pendingDelay = {};
+    promise.m_pendingDueTime = {};
+
+    m_task.m_handle.resume();
+
+    if (m_task.m_handle.done())
+    {
+        Complete(promise.m_result);
+        return c_errorTime;
+    }
+
+    if (promise.m_pendingDueTime != TimePoint())
+    {
+        return promise.m_pendingDueTime;
+    }
+    return chrono::steady_clock::now() + promise.m_pendingDelay;
+}
+
+I2cBatch* I2cTransaction::GetCurrentBatch()
+{
+    if (!IsBatchCommand())
+    {
+        return nullptr;
+    }
+    return m_isCoroutine ? m_task.m_handle.promise().m_pPendingBatch : &m_commands[m_curCommand].batch;
+}
+
+TimePoint I2cTransaction::CompleteBatchCommand(I2cAccessor& i2cAccessor, HwResult transferStatus)
+{
+    if (transferStatus == HwResult::CommFailure)
+    {
+        // Pending batch is kept and transferred again, coroutine resumes with the failure when retries are exhausted
+        return RetryCommand(i2cAccessor);
+    }
+
+    if (m_isCoroutine)
+    {
+        ResetFailedAttempts(i2cAccessor);
+        m_task.m_handle.promise().m_batchStatus = transferStatus;
+        m_task.m_handle.promise().m_batchCompletionTime = chrono::steady_clock::now();
+        return ResumeCoroutine();
+    }
+
+    if (transferStatus != HwResult::Success)
+    {
+        return ProcessCommandStatus(i2cAccessor, transferStatus, 0ms);
+    }
+
+    Command& command = m_commands[m_curCommand];
+    std::chrono::milliseconds delayNextCommand = 0ms;
+    HwResult status = command.batchHandler(command.batch, delayNextCommand);
+
+    return ProcessCommandStatus(i2cAccessor, status, delayNextCommand);
+}
+
+TimePoint I2cTransaction::RetryCommand(I2cAccessor& i2cAccessor)
+{
+    if (++m_failedAttempts >= m_retryPolicy.maxAttempts)
+    {
+        i2cAccessor.m_exhaustedRetriesCount.fetch_add(1, memory_order_relaxed);
+        m_failedAttempts = 0;
+        if (m_isCoroutine)
+        {
+            // Let the coroutine handle the failure
+            m_task.m_handle.promise().m_batchStatus = HwResult::CommFailure;
+            return ResumeCoroutine();
+        }
+        Complete(HwResult::CommFailure);
+        return c_errorTime;
+    }
+
+    if (m_retryPolicy.resetBusAfterFailures > 0 && m_failedAttempts >= m_retryPolicy.resetBusAfterFailures)
+    {
+        i2cAccessor.ResetBus();
+    }
+
+    i2cAccessor.m_retriesCount.fetch_add(1, memory_order_relaxed);
+    return chrono::steady_clock::now() + m_retryPolicy.backoff * (1 << min(m_failedAttempts - 1, 10));
+}
+
+void I2cTransaction::ResetFailedAttempts(I2cAccessor& i2cAccessor)
+{
+    if (m_failedAttempts > 0)
+    {
+        i2cAccessor.m_recoveredErrorsCount.fetch_add(1, memory_order_relaxed);
+        m_failedAttempts = 0;
+    }
+}
+
+TimePoint I2cTransaction::ProcessCommandStatus(I2cAccessor& i2cAccessor, HwResult status,
+    std::chrono::milliseconds delayNextCommand)
+{
+    if (status == HwResult::CommFailure)
+    {
+        return RetryCommand(i2cAccessor);
+    }
+    ResetFailedAttempts(i2cAccessor);
+
+    bool isNextIteration = false;
     switch (status)
     {
     case HwResult::Next:
@@ -143,16 +777,17 @@ TimePoint I2cTransaction::RunCommand()
         }
         [[fallthrough]];
     case HwResult::Completed:
-        if (!m_optIsRecursionCompleted.has_value())
+        if (!m_isRecursionCompleted)
         {
             Complete(HwResult::Success);
             break;
         }
-        status = (*m_optIsRecursionCompleted)();
+        status = m_isRecursionCompleted();
         if (status == HwResult::Repeat)
         {
             m_curCommand = 0;
             delayNextCommand = m_delayNextIteration;
+            isNextIteration = true;
         }
         else
         {
@@ -161,24 +796,32 @@ TimePoint I2cTransaction::RunCommand()
         break;
     case HwResult::Repeat:
         break;
-    case HwResult::CommFailure:
     default:
         Complete(status);
         return c_errorTime;
     }
 
     auto curTime = chrono::steady_clock::now();
+    if (isNextIteration && m_pSchedule != nullptr)
+    {
+        return m_pSchedule->GetNextTime(curTime);
+    }
     return curTime + delayNextCommand;
 }
 
 void I2cTransaction::Complete(HwResult status)
 {
     m_curCommand = m_commandsCount;
+    // Return the coroutine frame to the pool before anyone waiting for completion can push a new one
+    m_task = I2cTask();
     
-    if (m_optCompletionAction.has_value())
+    if (m_completionAction)
     {
-        (*m_optCompletionAction)(status);
+        m_completionAction(status);
     }
 
-    m_completionPromise.set_value(status);
+    if (m_optCompletionPromise.has_value())
+    {
+        m_optCompletionPromise->set_value(status);
+    }
 }
@@ -0,0 +1,29 @@
+#include "I2cBatch.h"
+
+using namespace std;
+
+HwResult I2cBatch::Transfer(I2cBus& i2cBus, I2cBatch* const batches[], int count)
+{
+    I2cMessage messages[I2cBus::c_maxTransferMessages];
+    int messagesCount = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        for (int iMessage = 0; iMessage < batches[i]->GetMessagesCount(); ++iMessage)
+        {
+            auto& message = batches[i]->m_messages[iMessage];
+            I2cMessage& i2cMessage = messages[messagesCount++];
+            i2cMessage.deviceAddress = message.deviceAddress;
+            i2cMessage.isRead = message.isRead;
+            i2cMessage.length = message.length;
+            i2cMessage.data = message.data;
+        }
+    }
+
+    if (i2cBus.Transfer(messages, messagesCount) < 0)
+    {
+        return HwResult::CommFailure;
+    }
+
+    return HwResult::Success;
+}
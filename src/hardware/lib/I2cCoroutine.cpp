@@ -0,0 +1,56 @@
+#include "I2cCoroutine.h"
+
+#include <iostream>
+
+using namespace std;
+
+I2cFramePool& I2cFramePool::Instance()
+{
+    static I2cFramePool s_framePool;
+    return s_framePool;
+}
+
+I2cFramePool::I2cFramePool()
+{
+    for (int i = 0; i < c_framesCount; ++i)
+    {
+        m_nextFree[i] = i + 1 < c_framesCount ? i + 1 : -1;
+    }
+}
+
+void* I2cFramePool::Allocate(size_t size)
+{
+    if (size > c_frameSize)
+    {
+        cerr << "I2cFramePool::Allocate: coroutine frame of " << size << " bytes exceeds " << c_frameSize << endl;
+        return nullptr;
+    }
+
+    lock_guard lk(m_mutex);
+    if (m_firstFree < 0)
+    {
+        cerr << "I2cFramePool::Allocate: coroutine frames exhausted" << endl;
+        return nullptr;
+    }
+
+    int frameIdx = m_firstFree;
+    m_firstFree = m_nextFree[frameIdx];
+    --m_freeFramesCount;
+    return m_frames[frameIdx];
+}
+
+void I2cFramePool::Free(void* frame)
+{
+    int frameIdx = static_cast<int>((static_cast<unsigned char*>(frame) - m_frames[0]) / static_cast<ptrdiff_t>(c_frameSize));
+
+    lock_guard lk(m_mutex);
+    m_nextFree[frameIdx] = m_firstFree;
+    m_firstFree = frameIdx;
+    ++m_freeFramesCount;
+}
+
+int I2cFramePool::GetFreeFramesCount()
+{
+    lock_guard lk(m_mutex);
+    return m_freeFramesCount;
+}
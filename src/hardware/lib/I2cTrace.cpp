@@ -0,0 +1,314 @@
+#include "I2cTrace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+using namespace I2cTrace;
+
+I2cTraceRecorder::I2cTraceRecorder(unique_ptr<I2cBus> spI2cBus, const char* traceFileName) :
+    m_spI2cBus(move(spI2cBus)), m_traceFileName(traceFileName)
+{}
+
+I2cTraceRecorder::~I2cTraceRecorder()
+{
+    if (m_pTraceFile != nullptr)
+    {
+        fclose(m_pTraceFile);
+    }
+}
+
+int I2cTraceRecorder::Open()
+{
+    lock_guard lk(m_mutex);
+    if (m_pTraceFile == nullptr)
+    {
+        m_pTraceFile = fopen(m_traceFileName.c_str(), "wb");
+        if (m_pTraceFile == nullptr)
+        {
+            cerr << "I2cTraceRecorder: failed to create " << m_traceFileName << ": " << strerror(errno) << endl;
+            return -1;
+        }
+        setvbuf(m_pTraceFile, nullptr, _IOFBF, c_fileBufferSize);
+
+        FileHeader fileHeader;
+        fwrite(&fileHeader, sizeof(fileHeader), 1, m_pTraceFile);
+        m_startTime = chrono::steady_clock::now();
+    }
+    return m_spI2cBus->Open();
+}
+
+void I2cTraceRecorder::Close()
+{
+    lock_guard lk(m_mutex);
+    m_spI2cBus->Close();
+    Flush();
+}
+
+int I2cTraceRecorder::SelectDevice(int deviceAddress)
+{
+    lock_guard lk(m_mutex);
+    int result = m_spI2cBus->SelectDevice(deviceAddress);
+    if (result >= 0)
+    {
+        m_selectedDeviceAddress = deviceAddress;
+    }
+    I2cMessage message = { static_cast<uint16_t>(deviceAddress), 0, false, nullptr };
+    WriteRecord(Operation::SelectDevice, result, &message, 1);
+    return result;
+}
+
+int I2cTraceRecorder::Read(uint8_t* buffer, int length)
+{
+    lock_guard lk(m_mutex);
+    int result = m_spI2cBus->Read(buffer, length);
+    I2cMessage message = { static_cast<uint16_t>(m_selectedDeviceAddress), static_cast<uint16_t>(length), true, buffer };
+    WriteRecord(Operation::Read, result, &message, 1);
+    return result;
+}
+
+int I2cTraceRecorder::Write(const uint8_t* buffer, int length)
+{
+    lock_guard lk(m_mutex);
+    int result = m_spI2cBus->Write(buffer, length);
+    // Message data is only read by WriteRecord
+    I2cMessage message = { static_cast<uint16_t>(m_selectedDeviceAddress), static_cast<uint16_t>(length), false,
+        const_cast<uint8_t*>(buffer) };
+    WriteRecord(Operation::Write, result, &message, 1);
+    return result;
+}
+
+int I2cTraceRecorder::Transfer(I2cMessage* messages, int count)
+{
+    lock_guard lk(m_mutex);
+    int result = m_spI2cBus->Transfer(messages, count);
+    WriteRecord(Operation::Transfer, result, messages, count);
+    return result;
+}
+
+void I2cTraceRecorder::WriteRecord(Operation operation, int result, const I2cMessage* messages, int count)
+{
+    if (m_pTraceFile == nullptr || count < 0 || count > c_maxTransferMessages)
+    {
+        return;
+    }
+
+    RecordHeader recordHeader;
+    recordHeader.timeUs = static_cast<uint64_t>(
+        chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - m_startTime).count());
+    recordHeader.operation = operation;
+    recordHeader.messagesCount = static_cast<uint8_t>(count);
+    recordHeader.result = result;
+    fwrite(&recordHeader, sizeof(recordHeader), 1, m_pTraceFile);
+
+    for (int i = 0; i < count; ++i)
+    {
+        MessageHeader messageHeader;
+        messageHeader.deviceAddress = static_cast<uint8_t>(messages[i].deviceAddress);
+        messageHeader.flags = messages[i].isRead ? MessageHeader::c_readFlag : 0;
+        messageHeader.length = messages[i].length;
+        fwrite(&messageHeader, sizeof(messageHeader), 1, m_pTraceFile);
+        fwrite(messages[i].data, 1, messages[i].length, m_pTraceFile);
+    }
+    m_recordsCount.fetch_add(1, memory_order_relaxed);
+}
+
+void I2cTraceRecorder::Flush()
+{
+    if (m_pTraceFile != nullptr && fflush(m_pTraceFile) != 0)
+    {
+        cerr << "I2cTraceRecorder: failed to write " << m_traceFileName << endl;
+    }
+}
+
+ReplayI2cBus::ReplayI2cBus(const char* traceFileName) :
+    m_traceFileName(traceFileName)
+{}
+
+int ReplayI2cBus::Open()
+{
+    lock_guard lk(m_mutex);
+    if (!m_isLoaded)
+    {
+        if (LoadTrace() < 0)
+        {
+            return -1;
+        }
+        m_isLoaded = true;
+    }
+    m_isOpen = true;
+    return 0;
+}
+
+void ReplayI2cBus::Close()
+{
+    lock_guard lk(m_mutex);
+    m_isOpen = false;
+    m_selectedDeviceAddress = -1;
+}
+
+int ReplayI2cBus::LoadTrace()
+{
+    FILE* pTraceFile = fopen(m_traceFileName.c_str(), "rb");
+    if (pTraceFile == nullptr)
+    {
+        cerr << "ReplayI2cBus: failed to open " << m_traceFileName << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    fseek(pTraceFile, 0, SEEK_END);
+    long fileSize = ftell(pTraceFile);
+    fseek(pTraceFile, 0, SEEK_SET);
+    m_data.resize(fileSize > 0 ? static_cast<size_t>(fileSize) : 0);
+    size_t readSize = fread(m_data.data(), 1, m_data.size(), pTraceFile);
+    fclose(pTraceFile);
+
+    FileHeader fileHeader;
+    if (readSize != m_data.size() || readSize < sizeof(fileHeader))
+    {
+        cerr << "ReplayI2cBus: failed to read " << m_traceFileName << endl;
+        return -1;
+    }
+    memcpy(&fileHeader, m_data.data(), sizeof(fileHeader));
+    if (fileHeader.magic != c_magic || fileHeader.version != c_version)
+    {
+        cerr << "ReplayI2cBus: " << m_traceFileName << " is not a trace of version " << c_version << endl;
+        return -1;
+    }
+
+    size_t offset = sizeof(fileHeader);
+    while (offset + sizeof(RecordHeader) <= m_data.size())
+    {
+        RecordHeader recordHeader;
+        memcpy(&recordHeader, &m_data[offset], sizeof(recordHeader));
+        offset += sizeof(recordHeader);
+
+        for (int i = 0; i < recordHeader.messagesCount; ++i)
+        {
+            MessageHeader messageHeader;
+            if (offset + sizeof(messageHeader) > m_data.size())
+            {
+                break;
+            }
+            memcpy(&messageHeader, &m_data[offset], sizeof(messageHeader));
+            offset += sizeof(messageHeader);
+            if (offset + messageHeader.length > m_data.size())
+            {
+                // Truncated by a crash, ignore the incomplete record
+                offset = m_data.size();
+                break;
+            }
+
+            // Device selection is not a bus transfer
+            if (recordHeader.operation != Operation::SelectDevice && messageHeader.deviceAddress <= c_maxDeviceAddress)
+            {
+                Message message;
+                message.isRead = (messageHeader.flags & MessageHeader::c_readFlag) != 0;
+                message.isFailed = recordHeader.result < 0;
+                message.length = messageHeader.length;
+                message.dataOffset = offset;
+                m_devices[messageHeader.deviceAddress].messages.push_back(message);
+            }
+            offset += messageHeader.length;
+        }
+    }
+    return 0;
+}
+
+int ReplayI2cBus::SelectDevice(int deviceAddress)
+{
+    lock_guard lk(m_mutex);
+    if (!m_isOpen || deviceAddress < 0 || deviceAddress > c_maxDeviceAddress)
+    {
+        return -1;
+    }
+    m_selectedDeviceAddress = deviceAddress;
+    return 0;
+}
+
+int ReplayI2cBus::Read(uint8_t* buffer, int length)
+{
+    lock_guard lk(m_mutex);
+    if (!m_isOpen || m_selectedDeviceAddress < 0)
+    {
+        return -1;
+    }
+    return ReplayMessage(m_selectedDeviceAddress, true, buffer, length);
+}
+
+int ReplayI2cBus::Write(const uint8_t* buffer, int length)
+{
+    lock_guard lk(m_mutex);
+    if (!m_isOpen || m_selectedDeviceAddress < 0)
+    {
+        return -1;
+    }
+    // Written data is only compared
+    return ReplayMessage(m_selectedDeviceAddress, false, const_cast<uint8_t*>(buffer), length);
+}
+
+int ReplayI2cBus::Transfer(I2cMessage* messages, int count)
+{
+    lock_guard lk(m_mutex);
+    if (!m_isOpen || count > c_maxTransferMessages)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        I2cMessage& message = messages[i];
+        if (message.deviceAddress > c_maxDeviceAddress ||
+            ReplayMessage(message.deviceAddress, message.isRead, message.data, message.length) < 0)
+        {
+            return -1;
+        }
+    }
+    return count;
+}
+
+int ReplayI2cBus::ReplayMessage(int deviceAddress, bool isRead, uint8_t* data, int length)
+{
+    DeviceTrace& deviceTrace = m_devices[deviceAddress];
+    if (deviceTrace.cursor == deviceTrace.messages.size())
+    {
+        m_mismatchesCount.fetch_add(1, memory_order_relaxed);
+        return -1;
+    }
+
+    const Message& message = deviceTrace.messages[deviceTrace.cursor];
+    if (message.isRead != isRead || message.length != length)
+    {
+        m_mismatchesCount.fetch_add(1, memory_order_relaxed);
+        return -1;
+    }
+    ++deviceTrace.cursor;
+    m_replayedCount.fetch_add(1, memory_order_relaxed);
+
+    if (message.isFailed)
+    {
+        return -1;
+    }
+
+    const uint8_t* recordedData = &m_data[message.dataOffset];
+    if (isRead)
+    {
+        copy_n(recordedData, length, data);
+    }
+    else if (!equal(data, data + length, recordedData))
+    {
+        // Driver wrote different bytes than in the recording, the replay goes on
+        m_mismatchesCount.fetch_add(1, memory_order_relaxed);
+    }
+    return length;
+}
+
+bool ReplayI2cBus::IsCompleted()
+{
+    lock_guard lk(m_mutex);
+    return all_of(begin(m_devices), end(m_devices), [] (const DeviceTrace& deviceTrace) {
+        return deviceTrace.cursor == deviceTrace.messages.size();
+    });
+}
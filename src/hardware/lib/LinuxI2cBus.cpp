@@ -0,0 +1,75 @@
+#include "LinuxI2cBus.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <iostream>
+
+using namespace std;
+
+static_assert(I2cBus::c_maxTransferMessages == I2C_RDWR_IOCTL_MAX_MSGS);
+
+int LinuxI2cBus::Open()
+{
+    errno = 0;
+    m_i2cHandle = open(m_i2cFileName.c_str(), O_RDWR);
+    if (m_i2cHandle < 0)
+    {
+        cout << "Open i2c file failed with: " << hex << errno << dec << endl;
+        return -1;
+    }
+    return 0;
+}
+
+void LinuxI2cBus::Close()
+{
+    if (m_i2cHandle >= 0)
+    {
+        close(m_i2cHandle);
+        m_i2cHandle = -1;
+    }
+}
+
+int LinuxI2cBus::SelectDevice(int deviceAddress)
+{
+    return ioctl(m_i2cHandle, I2C_SLAVE, deviceAddress);
+}
+
+int LinuxI2cBus::Read(uint8_t* buffer, int length)
+{
+    return static_cast<int>(read(m_i2cHandle, buffer, static_cast<size_t>(length)));
+}
+
+int LinuxI2cBus::Write(const uint8_t* buffer, int length)
+{
+    return static_cast<int>(write(m_i2cHandle, buffer, static_cast<size_t>(length)));
+}
+
+int LinuxI2cBus::Transfer(I2cMessage* messages, int count)
+{
+    if (count > c_maxTransferMessages)
+    {
+        return -1;
+    }
+
+    i2c_msg i2cMessages[I2C_RDWR_IOCTL_MAX_MSGS];
+    for (int i = 0; i < count; ++i)
+    {
+        i2cMessages[i].addr = messages[i].deviceAddress;
+        i2cMessages[i].flags = messages[i].isRead ? I2C_M_RD : 0;
+        i2cMessages[i].len = messages[i].length;
+        i2cMessages[i].buf = messages[i].data;
+    }
+
+    i2c_rdwr_ioctl_data transferData = { i2cMessages, static_cast<uint32_t>(count) };
+    if (ioctl(m_i2cHandle, I2C_RDWR, &transferData) < 0)
+    {
+        cerr << "I2C_RDWR transfer failed with: " << errno << ", messages: " << count << endl;
+        return -1;
+    }
+    return count;
+}
@@ -2,152 +2,404 @@
 #include "I2cAccessor.h"
 #include "Utils.h"
 
-extern "C" {
-#include <i2c/smbus.h>
-}
-#include <linux/i2c-dev.h>
-#include <math.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
-
+#include <cmath>
 #include <iostream>
+#include <thread>
 
 using namespace std;
 
-// TODO: convert to async
-void MagnetSensor::ReadConfig()
+MagnetSensor::MagnetSensor(I2cAccessor& i2cAccessor, HwStateLock* pState) :
+    m_i2cAccessor(i2cAccessor),
+    m_sampling(i2cAccessor, c_sensorAddress, I2cPriority::MotionCritical, [this] { return RunSampling(); }),
+    m_pState(pState),
+    m_angleFilter(GetDefaultFilterOptions()),
+    m_stopTimerOwner(i2cAccessor.AcquireTimerOwner())
 {
-    int i2cHandle = m_i2cAccessor.GetI2cHandle();
+    RateEstimatorOptions velocityOptions;
+    velocityOptions.type = RateEstimatorOptions::Type::Kalman;
+    velocityOptions.measurementNoise = 1e4;
+    velocityOptions.processNoise = 1e10;
+    velocityOptions.initialRateVariance = 1e12;
+    m_velocityFilter.SetOptions(velocityOptions);
+}
 
-    if (ioctl(i2cHandle, I2C_SLAVE, c_sensorAddress) < 0)
+MagnetSensor::~MagnetSensor()
+{
     {
-        cerr << "ReadConfig: ioctl failed" << endl;
-        return;
+        // Samples arriving meanwhile do not arm new timers
+        lock_guard lk(m_stopMutex);
+        m_isDestroying = true;
+    }
+    m_i2cAccessor.CancelTimer(m_stopTimerOwner);
+    if (m_i2cAccessor.IsRunning())
+    {
+        // Cancelled timer completes on the bus thread, pushed timers are never run otherwise
+        unique_lock lk(m_stopMutex);
+        m_stopTimersCompleted.wait(lk, [this] { return m_stopTimersCount == 0; });
     }
-    
-    int zpos = i2c_smbus_read_word_data(i2cHandle, 1);
-    cout << "ZPOS: " << zpos << endl;
-    
-    int mpos = i2c_smbus_read_word_data(i2cHandle, 3);
-    cout << "MPOS: " << mpos << endl;
-    
-    int mang = i2c_smbus_read_word_data(i2cHandle, 5);
-    cout << "MANG: " << mang << endl;
+    m_i2cAccessor.ReleaseTimerOwner(m_stopTimerOwner);
+}
 
-    int wConf = i2c_smbus_read_word_data(i2cHandle, 0x7);
-    if (wConf < 0)
+RateEstimatorOptions MagnetSensor::GetDefaultFilterOptions()
+{
+    RateEstimatorOptions options;
+    options.type = RateEstimatorOptions::Type::Kalman;
+    // About one LSB of noise
+    options.measurementNoise = 4.0;
+    // Nozzle motor spins up to a few turns per second within tens of milliseconds
+    options.processNoise = 1e7;
+    options.initialRateVariance = 1e8;
+    return options;
+}
+
+I2cTask MagnetSensor::RunSampling()
+{
+    I2cAsyncBus bus(c_sensorAddress);
+    uint8_t data[c_burstLength] = {};
+    int samplesCount = 0;
+
+    m_samplingSchedule.Start(chrono::steady_clock::now());
+    bool isPeriodic = true;
+    while (true)
     {
-        cerr << "ReadConfig: read word failed. status: " << wConf << endl;
-        return;
+        // Requests counted before taking their flags are served by this iteration
+        uint64_t requestsCount = m_requestsCount.load();
+        bool hasRequests = requestsCount != m_servedRequestsCount.load();
+        int requests = hasRequests ? m_requests.exchange(0) : 0;
+
+        if (requests & WriteConfigRequest)
+        {
+            uint32_t configUpdate = m_configUpdate.exchange(0);
+            int mask = static_cast<int>(configUpdate >> 16);
+            IfFailCoReturn(co_await bus.ReadRegisters(c_confRegister, data, 2));
+            int conf = ((data[0] | (data[1] << 8)) & ~mask) | (static_cast<int>(configUpdate) & mask);
+            uint8_t writeBuff[] = { c_confRegister, static_cast<uint8_t>(conf), static_cast<uint8_t>(conf >> 8) };
+            IfFailCoReturn(co_await bus.Write(writeBuff, sizeof(writeBuff)));
+            // Read back what the sensor accepted
+            requests |= ReadConfigRequest;
+        }
+        if (requests & ReadConfigRequest)
+        {
+            IfFailCoReturn(co_await bus.ReadRegisters(c_configRegister, data, c_configLength));
+            StoreConfig(data);
+        }
+
+        int rawAngle = 0;
+        if ((requests & ReadStatusRequest) || samplesCount % c_statusReadInterval == 0)
+        {
+            // Magnet health at the cost of a longer read instead of a separate transfer
+            IfFailCoReturn(co_await bus.ReadRegisters(c_statusRegister, data, c_burstLength));
+            m_lastStatus.store(data[0] | (data[c_agcRegister - c_statusRegister] << 8));
+            rawAngle = (data[c_angleRegister - c_statusRegister] << 8) | data[c_angleRegister - c_statusRegister + 1];
+        }
+        else
+        {
+            // Set register pointer and read big endian angle in a single combined transfer
+            IfFailCoReturn(co_await bus.ReadRegisters(c_angleRegister, data, 2));
+            rawAngle = (data[0] << 8) | data[1];
+        }
+        ++samplesCount;
+
+        int64_t timeUs = ToTimeUs(co_await bus.GetTransferTime());
+        ProcessAngle(rawAngle, timeUs);
+        if (hasRequests)
+        {
+            m_servedRequestsCount.store(requestsCount);
+        }
+
+        if (!m_sampling.Publish(HwSample { rawAngle, timeUs }))
+        {
+            co_return HwResult::Success;
+        }
+
+        chrono::microseconds pollInterval = m_sampling.GetPollInterval(c_samplingPeriod);
+        if (pollInterval == c_samplingPeriod)
+        {
+            if (!isPeriodic)
+            {
+                // New phase, adaptive intervals are not overruns
+                m_samplingSchedule.Start(chrono::steady_clock::now());
+                isPeriodic = true;
+            }
+            co_await bus.NextPeriod(m_samplingSchedule);
+        }
+        else
+        {
+            isPeriodic = false;
+            co_await bus.Delay(pollInterval);
+        }
     }
+}
 
-    ConfigReg confReg { wConf };
-    
-    cout << "WD: " << confReg.fields.wd << endl;
-    cout << "FTH: " << confReg.fields.fth << endl;
-    cout << "SF: " << confReg.fields.sf << endl;
+void MagnetSensor::StoreConfig(const uint8_t* data)
+{
+    // 12 bit positions are big endian, CONF is kept with register 0x07 in the low byte
+    lock_guard lk(m_configMutex);
+    m_config.zpos = ((data[0] & 0x0F) << 8) | data[1];
+    m_config.mpos = ((data[2] & 0x0F) << 8) | data[3];
+    m_config.mang = ((data[4] & 0x0F) << 8) | data[5];
+    m_config.conf.raw = data[6] | (data[7] << 8);
+}
 
-    cout << "PWMF: " << confReg.fields.pwmf << endl;
-    cout << "OUTS: " << confReg.fields.outs << endl;
-    cout << "HYST: " << confReg.fields.hyst << endl;
-    cout << "PM: " << confReg.fields.pm << endl << endl;
+MagnetConfig MagnetSensor::GetConfig() const
+{
+    lock_guard lk(m_configMutex);
+    return m_config;
 }
 
-// TODO: convert to async
-void MagnetSensor::ReadStatus()
+std::future<HwResult> MagnetSensor::PushRequest(Request request)
 {
-    int i2cHandle = m_i2cAccessor.GetI2cHandle();
+    m_requests.fetch_or(request);
+    uint64_t requestIdx = ++m_requestsCount;
+    return m_sampling.AddWatcher([this, requestIdx] (int) {
+        return m_servedRequestsCount.load() >= requestIdx ? HwResult::Success : HwResult::Repeat;
+    }, nullptr);
+}
+
+std::future<HwResult> MagnetSensor::ReadConfigAsync()
+{
+    return PushRequest(ReadConfigRequest);
+}
 
-    if (ioctl(i2cHandle, I2C_SLAVE, c_sensorAddress) < 0)
+std::future<HwResult> MagnetSensor::UpdateConfigAsync(ConfigReg config, int fieldsMask)
+{
+    uint32_t mask = static_cast<uint32_t>(fieldsMask) & 0xFFFF;
+    uint32_t configUpdate = m_configUpdate.load();
+    uint32_t newConfigUpdate = 0;
+    do
     {
-        cerr << "ReadStatus: ioctl failed" << endl;
-        return;
+        uint32_t newMask = (configUpdate >> 16) | mask;
+        uint32_t newValue = (configUpdate & ~mask & 0xFFFF) | (static_cast<uint32_t>(config.raw) & mask);
+        newConfigUpdate = (newMask << 16) | newValue;
     }
+    while (!m_configUpdate.compare_exchange_weak(configUpdate, newConfigUpdate));
+
+    return PushRequest(WriteConfigRequest);
+}
+
+std::future<HwResult> MagnetSensor::SetFilterAsync(int sf, int fth)
+{
+    ConfigReg config = { 0 };
+    config.fields.sf = static_cast<uint32_t>(sf) & 0x3;
+    config.fields.fth = static_cast<uint32_t>(fth) & 0x7;
+
+    ConfigReg mask = { 0 };
+    mask.fields.sf = 0x3;
+    mask.fields.fth = 0x7;
+    return UpdateConfigAsync(config, mask.raw);
+}
+
+std::future<HwResult> MagnetSensor::ReadStatusAsync()
+{
+    return PushRequest(ReadStatusRequest);
+}
 
-    int b = i2c_smbus_read_byte_data(i2cHandle, 0x0B);
-    if (b < 0)
+void MagnetSensor::ProcessAngle(int rawAngle, int64_t timeUs)
+{
+    int64_t unwrappedAngle = rawAngle;
+    if (m_samples.GetPushedCount() > 0)
     {
-        cerr << "ReadConfig: read status failed. status: " << b << endl;
-        return;
+        unwrappedAngle = m_unwrappedAngle.load() + GetAngleDiff(m_lastRawAngle.load(), rawAngle);
     }
 
-    StatusReg statusReg { static_cast<__u8>(b) };
+    m_lastRawAngle.store(rawAngle);
+    m_unwrappedAngle.store(unwrappedAngle);
+    m_lastMeasurementTimeUs.store(timeUs);
+    m_samples.Push(HwSample { rawAngle, timeUs });
 
-    cout << "Magnet high: " << statusReg.fields.magnet_high << endl;
-    cout << "Magnet low: " << statusReg.fields.magnet_low << endl;
-    cout << "Magnet detected: " << statusReg.fields.magnet_detected << endl;
+    m_angleFilter.Update(static_cast<double>(unwrappedAngle), timeUs);
+    m_velocityFilter.Update(m_angleFilter.GetRate(), timeUs);
+    m_angularVelocity.store(static_cast<int>(lround(m_angleFilter.GetRate())));
+    m_angularAcceleration.store(static_cast<int>(lround(m_velocityFilter.GetRate())));
 
-    b = i2c_smbus_read_byte_data(i2cHandle, 0x1A);
-    if (b < 0)
+    if (m_pState != nullptr)
     {
-        cerr << "ReadConfig: read agc failed. status: " << b << endl;
-        return;
+        m_pState->Update([&] (HwState& state) {
+            state.rawAngle = rawAngle;
+            state.angularVelocity = GetAngularVelocity();
+            state.unwrappedAngle = unwrappedAngle;
+            state.angleTimeUs = timeUs;
+        });
     }
+}
 
-    cout << "Automatic Gain Control: " << b << endl << endl;
+std::future<HwResult> MagnetSensor::ReadAngleAsync()
+{
+    return m_sampling.AddWatcher([] (int) { return HwResult::Success; }, nullptr);
 }
 
-void MagnetSensor::FillI2cTransactionReadAngle(I2cTransaction& transaction)
+HwSampleFuture MagnetSensor::ReadSampleAsync()
 {
-    transaction.AddCommand([this] (int i2cHandle, std::chrono::milliseconds& /*delayNextCommand*/) {
-        int angle = i2c_smbus_read_word_data(i2cHandle, 0x0E);
-        if (angle < 0)
-        {
-            cerr << "ReadAngle: read angle failed. status: " << angle << endl;
-            return HwResult::CommFailure;
-        }
+    return m_sampling.AddSampleWatcher([] (int) { return HwResult::Success; });
+}
 
-        angle = SwapBytesWord(angle);
-        m_lastRawAngle.store(angle);
-        m_lastMeasurementTimeMs.store(TimeSinceEpochMs());
-        
-        return HwResult::Completed;
-    });
+std::future<HwResult> MagnetSensor::NotifyWhenAngle(HwValuePredicate&& isExpectedValue,
+        HwCompletionAction&& completionAction, HwPollInterval&& pollInterval)
+{
+    return m_sampling.AddWatcher(move(isExpectedValue), move(completionAction), move(pollInterval));
 }
 
-std::future<HwResult> MagnetSensor::ReadAngleAsync()
+std::future<HwResult> MagnetSensor::NotifyWhenApproaching(int64_t targetUnwrappedAngle, int directionSign,
+    int stopDistance, HwCompletionAction&& completionAction, bool isAdaptive)
 {
-    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(c_sensorAddress);
-    
-    FillI2cTransactionReadAngle(transaction);
+    int64_t stopAngle = targetUnwrappedAngle - directionSign * stopDistance;
+    HwValuePredicate isExpectedValue = [this, stopAngle, directionSign] (int) {
+        return (stopAngle - GetUnwrappedAngle()) * directionSign <= 0 ? HwResult::Success : HwResult::Repeat;
+    };
+    HwPollInterval pollInterval;
+    if (isAdaptive)
+    {
+        pollInterval = [this, stopAngle, directionSign] { return GetApproachPollInterval(stopAngle, directionSign); };
+    }
+    return NotifyWhenAngle(move(isExpectedValue), move(completionAction), move(pollInterval));
+}
 
-    future<HwResult> measurementFuture = transaction.GetFuture();
-    m_i2cAccessor.PushTransaction(move(transaction));
+chrono::microseconds MagnetSensor::GetApproachPollInterval(int64_t stopUnwrappedAngle, int directionSign) const
+{
+    int64_t speed = static_cast<int64_t>(GetAngularVelocity()) * directionSign;
+    if (speed < c_minApproachSpeed)
+    {
+        // Spinning up or stalled, arrival time is unknown
+        return c_samplingPeriod;
+    }
+    int64_t remainingDistance = (stopUnwrappedAngle - GetUnwrappedAngle()) * directionSign;
+    chrono::microseconds timeToStop(max<int64_t>(remainingDistance, 0) * 1'000'000 / speed);
+    return clamp(timeToStop / c_approachSamplesCount, c_minPollInterval, c_maxPollInterval);
+}
 
-    return measurementFuture;
+std::future<HwResult> MagnetSensor::ScheduleStopWhenApproaching(int64_t targetUnwrappedAngle, int directionSign,
+    int stopDistance, HwCompletionAction&& stopAction)
+{
+    uint64_t stopId = 0;
+    {
+        lock_guard lk(m_stopMutex);
+        stopId = ++m_stopId;
+        m_stopAction = move(stopAction);
+    }
+
+    int64_t stopAngle = targetUnwrappedAngle - directionSign * stopDistance;
+    return NotifyWhenAngle(
+        [this, stopId, stopAngle, directionSign] (int) { return CheckScheduledStop(stopId, stopAngle, directionSign); },
+        // Safety net and failures of the measurement
+        [this, stopId] (HwResult status) { CompleteStop(stopId, status); },
+        [this, stopAngle, directionSign] { return GetApproachPollInterval(stopAngle, directionSign); });
 }
 
-std::future<HwResult> MagnetSensor::NotifyWhenAngle(std::function<HwResult(int)>&& isExpectedValue,
-        std::function<void(HwResult)>&& completionAction)
+HwResult MagnetSensor::CheckScheduledStop(uint64_t stopId, int64_t stopUnwrappedAngle, int directionSign)
 {
-    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(c_sensorAddress);
-    
-    FillI2cTransactionReadAngle(transaction);
+    if (!IsStopPending(stopId))
+    {
+        // Stopped by the timer, or superseded by another scheduled stop
+        return HwResult::Success;
+    }
+    if ((stopUnwrappedAngle - GetUnwrappedAngle()) * directionSign <= 0)
+    {
+        return HwResult::Success;
+    }
 
-    transaction.MakeRecursive([this, checkAngle = move(isExpectedValue)] {
-        return checkAngle(GetLastRawAngle());
-    }, 2ms);
+    int64_t arrivalTimeUs = PredictArrivalTimeUs(stopUnwrappedAngle, directionSign);
+    if (arrivalTimeUs >= 0 && arrivalTimeUs - GetLastMeasurementTimeUs() <= c_stopSchedulingHorizon.count())
+    {
+        ArmStopTimer(stopId, arrivalTimeUs);
+    }
+    return HwResult::Repeat;
+}
 
-    transaction.SetCompletionAction(move(completionAction));
+int64_t MagnetSensor::PredictArrivalTimeUs(int64_t unwrappedAngle, int directionSign) const
+{
+    double distance = static_cast<double>((unwrappedAngle - GetUnwrappedAngle()) * directionSign);
+    double speed = GetAngularVelocity() * directionSign;
+    double acceleration = GetAngularAcceleration() * directionSign;
+    if (speed < c_minApproachSpeed)
+    {
+        return -1;
+    }
+    if (distance <= 0)
+    {
+        return GetLastMeasurementTimeUs();
+    }
+
+    // distance = speed * t + acceleration * t^2 / 2
+    double discriminant = speed * speed + 2 * acceleration * distance;
+    if (discriminant < 0)
+    {
+        return -1;
+    }
+    // Root without cancellation, also for zero acceleration
+    double timeSec = 2 * distance / (speed + sqrt(discriminant));
+    return GetLastMeasurementTimeUs() + llround(timeSec * 1e6);
+}
+
+void MagnetSensor::ArmStopTimer(uint64_t stopId, int64_t stopTimeUs)
+{
+    if (stopId == m_armedStopId && abs(stopTimeUs - m_armedStopTimeUs) < c_stopRearmThresholdUs)
+    {
+        return;
+    }
+
+    if (m_stopTimerOwner < 0)
+    {
+        // Timer owners exhausted, the sample watcher stops alone
+        return;
+    }
+    {
+        // Counted first, so that the destructor either waits for the timer or this does not push it
+        lock_guard lk(m_stopMutex);
+        if (m_isDestroying)
+        {
+            return;
+        }
+        ++m_stopTimersCount;
+    }
+    m_armedStopId = stopId;
+    m_armedStopTimeUs = stopTimeUs;
+
+    // Replaces the armed timer, aborted one leaves the stop to the sample watcher
+    m_i2cAccessor.PushTimer(m_stopTimerOwner, TimePoint(chrono::microseconds(stopTimeUs)),
+        [this, stopId] (HwResult status) {
+            if (status == HwResult::Success)
+            {
+                CompleteStop(stopId, HwResult::Success);
+            }
+            // Notified under the lock, the destructor returns only after it is released
+            lock_guard lk(m_stopMutex);
+            --m_stopTimersCount;
+            m_stopTimersCompleted.notify_all();
+        });
+}
 
-    future<HwResult> measurementFuture = transaction.GetFuture();
-    m_i2cAccessor.PushTransaction(move(transaction));
+void MagnetSensor::CompleteStop(uint64_t stopId, HwResult status)
+{
+    HwCompletionAction stopAction;
+    {
+        lock_guard lk(m_stopMutex);
+        if (stopId != m_stopId || !m_stopAction)
+        {
+            return;
+        }
+        stopAction = move(m_stopAction);
+    }
+    stopAction(status);
+}
 
-    return measurementFuture;
+bool MagnetSensor::IsStopPending(uint64_t stopId) const
+{
+    lock_guard lk(m_stopMutex);
+    return stopId == m_stopId && m_stopAction;
 }
 
 bool MagnetSensor::IsMeasurementStale() const
 {
-    static constexpr uint32_t staleMeasurementThresholdMs = 50;
-    return TimeSinceEpochMs() - GetLastMeasurementTimeMs() > staleMeasurementThresholdMs;
+    static constexpr int64_t staleMeasurementThresholdUs = 50'000;
+    return TimeSinceEpochUs() - GetLastMeasurementTimeUs() > staleMeasurementThresholdUs;
 }
 
 int MagnetSensor::GetRawAngleFetchIfStale()
 {
     if (IsMeasurementStale())
     {
-        auto measurementFuture = ReadAngleAsync();
-        measurementFuture.wait();
+        HwSampleResult result = ReadSampleAsync().Get();
+        return result.status == HwResult::Success ? result.sample.value : GetLastRawAngle();
     }
     return GetLastRawAngle();
 }
@@ -1,6 +1,6 @@
 #include "MotorControl.h"
 
-#include <pigpio.h>
+#include "PigpioMotorDriver.h"
 
 #include <iostream>
 #include <thread>
@@ -9,32 +9,13 @@ using namespace std;
 
 int MotorControl::Init()
 {
-    int status = InitializeGpio();
-    if (status < 0)
-    {
-        cerr << "InitializeGpio failed" << endl;
-        return status;
-    }
-
-    gpioSetMode(m_pwmPin, PI_OUTPUT);
-    gpioWrite(m_pwmPin, 0);
-    gpioSetMode(m_drainPin, PI_OUTPUT);
-    gpioWrite(m_drainPin, 0);
-
-    return 0;
+    return Init(make_unique<PigpioMotorDriver>(m_pwmPin, m_drainPin));
 }
 
-int MotorControl::InitializeGpio()
+int MotorControl::Init(unique_ptr<MotorDriver> spDriver)
 {
-    static bool gpioInitialized = false;
-    if (!gpioInitialized)
-    {
-        if (gpioCfgClock(5, 1, 0)) return -1;
-        if (gpioInitialise() < 0) return -2;
-        gpioInitialized = true;
-    }
-
-    return 0;
+    m_spDriver = move(spDriver);
+    return m_spDriver->Init();
 }
 
 void MotorControl::Run(MotorDirection direction, int dutyPercent)
@@ -48,36 +29,24 @@ void MotorControl::Run(MotorDirection direction, int dutyPercent)
         Stop();
     }
 
-    int drainValue = static_cast<int>(direction);
-    dutyPercent += (100 - dutyPercent * 2) * drainValue; // Invert duty in case drainValue == 1.
-    int duty = dutyPercent * 10000;
-
-    int status = gpioHardwarePWM(m_pwmPin, c_pwmFreq, duty);
-    if (status != 0)
+    if (m_spDriver == nullptr || m_spDriver->Run(direction, dutyPercent) < 0)
     {
-        cerr << __func__ << ", gpioHardwarePWM failed with: " << status << endl;
         return;
     }
 
-    gpioWrite(m_drainPin, drainValue);
-
     m_runStartTime = chrono::steady_clock::now();
-    m_runDirection = drainValue * 2 - 1;
+    m_runDirection = static_cast<int>(direction) * 2 - 1;
     m_lastDirection = direction;
 }
 
 void MotorControl::Stop()
 {
-    int status = gpioHardwarePWM(m_pwmPin, 0, 0);
-    if (status != 0)
+    // Not initialized, nothing is driven
+    if (m_spDriver == nullptr || m_spDriver->Stop() < 0)
     {
-        cerr << __func__ << ", gpioHardwarePWM failed with: " << status << endl;
         return;
     }
 
-    gpioWrite(m_pwmPin, 0);
-    gpioWrite(m_drainPin, 0);
-
     if (m_runDirection != 0)
     {
         auto end = chrono::steady_clock::now();
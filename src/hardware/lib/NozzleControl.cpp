@@ -1,6 +1,9 @@
 #include "NozzleControl.h"
 
 #include "I2cAccessor.h"
+#include "LinuxI2cBus.h"
+#include "SimulatedI2cBus.h"
+#include "SimulatedMotor.h"
 #include "Utils.h"
 
 #include <Logger.h>
@@ -28,63 +31,126 @@ NozzleControl::NozzleControl() :
     m_motorNozzle(c_pwmPinNozzle, c_drainPinNozzle),
     m_motorValve(c_pwmPinValve, c_drainPinValve),
     m_spI2cAccessor(new I2cAccessor()),
-    m_magnetSensor(*m_spI2cAccessor),
-    m_pressureSensor(*m_spI2cAccessor)
+    m_magnetSensor(*m_spI2cAccessor, &m_state),
+    m_pressureSensor(*m_spI2cAccessor, &m_state)
 {}
 
 NozzleControl::~NozzleControl()
 {
+    StopMonitoring();
     if (m_closeValveOnExit)
     {
         CloseValve(true /*fCloseTight*/);
     }
 }
 
-int NozzleControl::Init()
+int NozzleControl::Init(const char* i2cTraceFileName)
 {
-    IfFailRet(m_spI2cAccessor->Init(c_i2cFileName));
+    if (i2cTraceFileName != nullptr)
+    {
+        m_spI2cAccessor->SetTraceFile(i2cTraceFileName);
+    }
+    return Init(make_unique<LinuxI2cBus>(c_i2cFileName));
+}
+
+int NozzleControl::Init(unique_ptr<I2cBus> spI2cBus)
+{
+    IfFailRet(m_spI2cAccessor->Init(move(spI2cBus)));
     IfFailRet(m_motorNozzle.Init());
     IfFailRet(m_motorValve.Init());
     cout << "NozzleControl::Init succeeded" << endl;
     return 0;
 }
 
-int NozzleControl::GetPositionFetch()
+int NozzleControl::Init(unique_ptr<I2cBus> spI2cBus, unique_ptr<MotorDriver> spNozzleDriver,
+    unique_ptr<MotorDriver> spValveDriver)
 {
-    auto measurementFuture = m_magnetSensor.ReadAngleAsync();
-    measurementFuture.wait();
-    return GetPosition();
+    IfFailRet(m_spI2cAccessor->Init(move(spI2cBus)));
+    IfFailRet(m_motorNozzle.Init(move(spNozzleDriver)));
+    IfFailRet(m_motorValve.Init(move(spValveDriver)));
+    cout << "NozzleControl::Init succeeded" << endl;
+    return 0;
 }
 
-int NozzleControl::GetPressureFetch()
+int NozzleControl::InitSimulated()
 {
-    auto measurementFuture = m_pressureSensor.ReadPressureAsync();
-    measurementFuture.wait();
-    return GetPressure();
+    auto spI2cBus = make_unique<SimulatedI2cBus>();
+    auto spNozzleMotor = make_unique<SimulatedMotor>(SimulatedMotor::GetNozzleOptions());
+    auto spValveMotor = make_unique<SimulatedMotor>(SimulatedMotor::GetValveOptions());
+    // Motors are destroyed after the I2C accessor owning the bus
+    ConnectSimulatedNozzle(*spI2cBus, *spNozzleMotor, *spValveMotor);
+    return Init(move(spI2cBus), move(spNozzleMotor), move(spValveMotor));
 }
 
-std::future<HwResult> NozzleControl::RotateToDirectionAsync(MotorDirection direction, int targetAngle, int dutyPercent)
+int NozzleControl::GetPositionFetch()
 {
-    int startAngle = m_magnetSensor.GetRawAngleFetchIfStale();
+    // Sample of this read, the last angle may be newer already
+    HwSampleResult result = m_magnetSensor.ReadSampleAsync().Get();
+    return result.status == HwResult::Success ? result.sample.value : GetPosition();
+}
 
-    int distance = 0;
+int NozzleControl::GetPressureFetch()
+{
+    HwSampleResult result = m_pressureSensor.ReadSampleAsync().Get();
+    return result.status == HwResult::Success ? result.sample.value : GetPressure();
+}
 
-    // Angle increases when direction == MotorDirection::Right
-    // and decreases when direction == MotorDirection::Left
-    if (direction == MotorDirection::Right)
+void NozzleControl::StartMonitoring()
+{
+    m_isMonitoring = true;
+    if (!m_isAngleMonitored.exchange(true))
     {
-        distance = targetAngle - startAngle;
+        MonitorAngle();
     }
-    else
+    if (!m_isPressureMonitored.exchange(true))
     {
-        distance = startAngle - targetAngle;
+        MonitorPressure();
     }
+}
 
-    // If passing through 0 point, distance will be negative
-    if (distance < 0)
-    {
-        distance += MagnetSensor::c_angleRange;
-    }
+void NozzleControl::MonitorAngle()
+{
+    // Watchers share the streams with control operations, they only keep sampling running
+    m_magnetSensor.NotifyWhenAngle(
+        [this] (int) {
+            return m_isMonitoring ? HwResult::Repeat : HwResult::Success;
+        },
+        [this] (HwResult status) {
+            // Cleared first: StartMonitoring called meanwhile either re-arms or is seen below.
+            // Failed monitoring stays cleared until the next StartMonitoring.
+            m_isAngleMonitored = false;
+            if (status == HwResult::Success && m_isMonitoring && !m_isAngleMonitored.exchange(true))
+            {
+                MonitorAngle();
+            }
+        },
+        [] { return c_monitoringInterval; });
+}
+
+void NozzleControl::MonitorPressure()
+{
+    m_pressureSensor.NotifyWhenPressure(
+        [this] (int) {
+            return m_isMonitoring ? HwResult::Repeat : HwResult::Success;
+        },
+        [this] (HwResult status) {
+            m_isPressureMonitored = false;
+            if (status == HwResult::Success && m_isMonitoring && !m_isPressureMonitored.exchange(true))
+            {
+                MonitorPressure();
+            }
+        });
+}
+
+std::future<HwResult> NozzleControl::RotateToDirectionAsync(MotorDirection direction, int targetAngle, int dutyPercent)
+{
+    int startAngle = m_magnetSensor.GetRawAngleFetchIfStale();
+    LearnNozzleCoast();
+
+    // Angle increases when direction == MotorDirection::Right
+    // and decreases when direction == MotorDirection::Left
+    int directionSign = direction == MotorDirection::Right ? 1 : -1;
+    int distance = MagnetSensor::GetAngleDistance(startAngle, targetAngle, direction == MotorDirection::Right);
 
     static constexpr int epsilon = 3;
     static constexpr int inertialConst = 30;
@@ -96,42 +162,53 @@ std::future<HwResult> NozzleControl::RotateToDirectionAsync(MotorDirection direc
 
     m_motorNozzle.Run(direction, dutyPercent);
 
-    int inertialOffset = inertialConst * dutyPercent / 100;
+    // Expected speed at the stop is the speed of the last stop, until then the coast is a guess
+    int inertialOffset = m_coastInterpolator.PredictOvershoot(directionSign * m_lastNozzleStopSpeed);
+    if (inertialOffset <= 0)
+    {
+        inertialOffset = inertialConst * dutyPercent / 100;
+    }
     inertialOffset = max(min(inertialOffset, distance / 2), epsilon);
 
-    int maxAngle = targetAngle + epsilon;
-    int minAngle = targetAngle - epsilon;
+    // Unwrapped angle passes the target once, even if the motor overshoots between two measurements
+    int64_t targetUnwrappedAngle = m_magnetSensor.GetUnwrappedAngle() + directionSign * distance;
+    int64_t stopUnwrappedAngle = targetUnwrappedAngle - directionSign * inertialOffset;
 
-    if (direction == MotorDirection::Right)
-    {
-        minAngle = targetAngle - inertialOffset;
-    }
-    else
-    {
-        maxAngle = targetAngle + inertialOffset;
-    }
+    cout << "targetAngle: " << targetAngle << ", inertialOffset: " << inertialOffset << endl;
 
-    minAngle = (minAngle + MagnetSensor::c_angleRange) % MagnetSensor::c_angleRange;
-    maxAngle %= MagnetSensor::c_angleRange;
+    // Stops at the predicted crossing instead of the next poll, polls sparsely far from the target
+    return m_magnetSensor.ScheduleStopWhenApproaching(targetUnwrappedAngle, directionSign, inertialOffset,
+        [this, stopUnwrappedAngle] (HwResult status) { StopMotorNozzle(status, stopUnwrappedAngle); });
+}
 
-    std::function<HwResult(int)> isExpectedValue;
+void NozzleControl::StopMotorNozzle(HwResult status, int64_t stopUnwrappedAngle)
+{
+    m_motorNozzle.Stop();
+    if (status != HwResult::Success)
+    {
+        return;
+    }
+    // Coast is counted from the planned stop point, so that it also corrects the prediction error
+    m_nozzleStopAngle.store(stopUnwrappedAngle);
+    m_nozzleStopTimeUs.store(TimeSinceEpochUs());
+    m_nozzleStopVelocity.store(m_magnetSensor.GetAngularVelocity());
+}
 
-    cout << "minAngle: " << minAngle << ", maxAngle: " << maxAngle << endl;
-    
-    if (maxAngle > minAngle)
+void NozzleControl::LearnNozzleCoast()
+{
+    int velocityAtStop = m_nozzleStopVelocity.exchange(0);
+    if (velocityAtStop == 0 ||
+        m_magnetSensor.GetLastMeasurementTimeUs() - m_nozzleStopTimeUs.load() < c_nozzleSettleTimeUs)
     {
-        isExpectedValue = [maxAngle, minAngle] (int curAngle) {
-            return curAngle < maxAngle && curAngle > minAngle ? HwResult::Success : HwResult::Repeat;
-        };
+        // Still coasting, the rotation being started makes the stop obsolete
+        return;
     }
-    else {
-        isExpectedValue = [maxAngle, minAngle] (int curAngle) {
-            return curAngle < maxAngle || curAngle > minAngle ? HwResult::Success : HwResult::Repeat;
-        };
-    };
 
-    return m_magnetSensor.NotifyWhenAngle(move(isExpectedValue),
-        [this] (HwResult) { m_motorNozzle.Stop(); });
+    int directionSign = velocityAtStop > 0 ? 1 : -1;
+    int64_t coast = (m_magnetSensor.GetUnwrappedAngle() - m_nozzleStopAngle.load()) * directionSign;
+    // Zero overshoot means unknown to the interpolator
+    m_coastInterpolator.SetOvershoot(velocityAtStop, static_cast<int>(max<int64_t>(coast, 1)));
+    m_lastNozzleStopSpeed = abs(velocityAtStop);
 }
 
 std::future<HwResult> NozzleControl::RotateDiffAsync(int diffAngle, int dutyPercent)
@@ -139,7 +216,7 @@ std::future<HwResult> NozzleControl::RotateDiffAsync(int diffAngle, int dutyPerc
     int curPosition = GetPositionFetchIfStale();
 
     MotorDirection direction = diffAngle > 0 ? MotorDirection::Right : MotorDirection::Left;
-    int targetAngle = (curPosition + diffAngle + MagnetSensor::c_angleRange) % MagnetSensor::c_angleRange;
+    int targetAngle = MagnetSensor::WrapAngle(curPosition + diffAngle);
 
     return RotateToDirectionAsync(direction, targetAngle, dutyPercent);
 }
@@ -147,16 +224,7 @@ std::future<HwResult> NozzleControl::RotateDiffAsync(int diffAngle, int dutyPerc
 std::future<HwResult> NozzleControl::RotateToAsync(int targetAngle, int dutyPercent)
 {
     int curAngle = m_magnetSensor.GetRawAngleFetchIfStale();
-
-    int diffAngle = targetAngle - curAngle;
-    if (diffAngle > MagnetSensor::c_angleRange / 2)
-    {
-        diffAngle -= MagnetSensor::c_angleRange;
-    }
-    if (diffAngle < -MagnetSensor::c_angleRange / 2)
-    {
-        diffAngle += MagnetSensor::c_angleRange;
-    }
+    int diffAngle = MagnetSensor::GetAngleDiff(curAngle, targetAngle);
 
     MotorDirection direction = diffAngle > 0 ? MotorDirection::Right : MotorDirection::Left;
     
@@ -191,7 +259,7 @@ std::future<HwResult> NozzleControl::SetPressureAsync(int targetPressure, int du
     int inertialOffset = inertialConst * dutyPercent / 100;
     inertialOffset = max(min(inertialOffset, distance / 2), epsilon);
 
-    std::function<HwResult(int)> isExpectedValue;
+    HwValuePredicate isExpectedValue;
 
     if (direction == MotorDirection::Open)
     {
@@ -255,7 +323,7 @@ std::future<HwResult> NozzleControl::OpenValveInternalAsync(MotorDirection direc
 {
     m_motorValve.Run(direction, c_defaultDutyPercent);
 
-    std::function<HwResult(int)> isExpectedValue = [this] (int curPressure) {
+    HwValuePredicate isExpectedValue = [this] (int curPressure) {
         auto curTime = chrono::steady_clock::now();
         int duration = static_cast<int>(chrono::duration_cast<chrono::milliseconds>(curTime - m_motorValve.RunStartedAt()).count());
         if (duration > c_valveOpeningTimeoutMs) {
@@ -264,7 +332,7 @@ std::future<HwResult> NozzleControl::OpenValveInternalAsync(MotorDirection direc
         return IsItWaterPressure(curPressure) ? HwResult::Success : HwResult::Repeat;
     };
 
-    std::function<void(HwResult)> completionAction = [this] (HwResult status) {
+    HwCompletionAction completionAction = [this] (HwResult status) {
         m_motorValve.Stop();
         if (status != HwResult::Success) {
             auto fut = CloseValveAsync();
@@ -309,7 +377,7 @@ std::future<HwResult> NozzleControl::CloseValveInternalAsync(MotorDirection dire
     static constexpr int trendAnalyzerSize = 16;
     m_motorValve.Run(direction, c_defaultDutyPercent);
 
-    std::function<HwResult(int)> isExpectedValue = [this, analyzer = SequenceTrendAnalyzer<trendAnalyzerSize>()] (int curPressure) mutable {
+    HwValuePredicate isExpectedValue = [this, analyzer = SequenceTrendAnalyzer<trendAnalyzerSize>()] (int curPressure) mutable {
         analyzer.Push(curPressure);
         if (analyzer.IsFull() && analyzer.CurTrend(trendAnalyzerSize / 2) >= 0 &&
             !IsItWaterPressure(curPressure)) {
@@ -332,10 +400,12 @@ void NozzleControl::StopMotorValveIfRunning(int curPressure, int changeRate)
     }
 }
 
-HwResult NozzleControl::ProcessPressureMeasurement(int curPressure)
+HwResult NozzleControl::ProcessPressureMeasurement(int /*measuredPressure*/)
 {
     ++m_iPressureMeasurementAfterMotorStart;
-    int changeRate = m_pressureSensor.GetLastChangeRate();
+    // Filtered estimates: raw measurement noise would trigger the stop conditions early
+    int curPressure = m_pressureSensor.GetFilteredPressure();
+    int changeRate = m_pressureSensor.GetChangeRate();
 
     if (m_iPressureMeasurementAfterMotorStart > c_minPressureMeasurementAfterMotorStart &&
         changeRate * m_motorValve.GetLastDirectionSign() <= 0)
@@ -434,19 +504,9 @@ HwResult NozzleControlCalibrated::CalibrateNozzle(int minDurationUs, int maxDura
             m_motorNozzle.RunDuration(direction, chrono::microseconds(durationUs), c_defaultDutyPercent);
             this_thread::sleep_for(calmDownDuration);
             int endAngle = GetPositionFetch();
-            int distance = endAngle - startAngle;
+            int distance = MagnetSensor::GetAngleDistance(startAngle, endAngle, direction == MotorDirection::Right);
             startAngle = endAngle;
 
-            if (direction == MotorDirection::Left)
-            {
-                distance = -distance;
-            }
-            
-            if (distance < 0)
-            {
-                distance += MagnetSensor::c_angleRange;
-            }
-
             angleDuration.emplace_back(distance, durationUs);
             logMessage += "[" + to_string(distance) + ", " + to_string(durationUs) + "], ";
             
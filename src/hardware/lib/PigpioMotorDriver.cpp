@@ -0,0 +1,68 @@
+#include "PigpioMotorDriver.h"
+
+#include <pigpio.h>
+
+#include <iostream>
+
+using namespace std;
+
+int PigpioMotorDriver::Init()
+{
+    int status = InitializeGpio();
+    if (status < 0)
+    {
+        cerr << "InitializeGpio failed" << endl;
+        return status;
+    }
+
+    gpioSetMode(m_pwmPin, PI_OUTPUT);
+    gpioWrite(m_pwmPin, 0);
+    gpioSetMode(m_drainPin, PI_OUTPUT);
+    gpioWrite(m_drainPin, 0);
+
+    return 0;
+}
+
+int PigpioMotorDriver::InitializeGpio()
+{
+    static bool gpioInitialized = false;
+    if (!gpioInitialized)
+    {
+        if (gpioCfgClock(5, 1, 0)) return -1;
+        if (gpioInitialise() < 0) return -2;
+        gpioInitialized = true;
+    }
+
+    return 0;
+}
+
+int PigpioMotorDriver::Run(MotorDirection direction, int dutyPercent)
+{
+    int drainValue = static_cast<int>(direction);
+    dutyPercent += (100 - dutyPercent * 2) * drainValue; // Invert duty in case drainValue == 1.
+    int duty = dutyPercent * 10000;
+
+    int status = gpioHardwarePWM(m_pwmPin, c_pwmFreq, duty);
+    if (status != 0)
+    {
+        cerr << __func__ << ", gpioHardwarePWM failed with: " << status << endl;
+        return -1;
+    }
+
+    gpioWrite(m_drainPin, drainValue);
+    return 0;
+}
+
+int PigpioMotorDriver::Stop()
+{
+    int status = gpioHardwarePWM(m_pwmPin, 0, 0);
+    if (status != 0)
+    {
+        cerr << __func__ << ", gpioHardwarePWM failed with: " << status << endl;
+        return -1;
+    }
+
+    gpioWrite(m_pwmPin, 0);
+    gpioWrite(m_drainPin, 0);
+    return 0;
+}
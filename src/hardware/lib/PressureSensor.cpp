@@ -2,202 +2,161 @@
 #include "I2cAccessor.h"
 #include "Utils.h"
 
-extern "C" {
-#include <i2c/smbus.h>
-}
-#include <linux/i2c-dev.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
-
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 using namespace std;
 
-template<typename T>
-static std::future<T> GetCompletedFuture(T value)
+PressureSensor::PressureSensor(I2cAccessor& i2cAccessor, HwStateLock* pState) :
+    // Stream serves control loops, telemetry reads share it
+    m_sampling(i2cAccessor, c_sensorAddress, I2cPriority::Control, [this] { return RunSampling(); }),
+    m_pState(pState),
+    m_filter(GetDefaultFilterOptions())
+{}
+
+RateEstimatorOptions PressureSensor::GetDefaultFilterOptions()
 {
-    return std::async(std::launch::deferred, [value = std::move(value)]() {
-        return value;
-    });
+    RateEstimatorOptions options;
+    options.type = RateEstimatorOptions::Type::Kalman;
+    // Noise is about one truncated unit
+    options.measurementNoise = static_cast<double>(1 << (2 * c_truncateShift));
+    // Valve changes pressure by about 1 psi/s^2, the filter follows within a few samples
+    options.processNoise = 3e11;
+    options.initialRateVariance = 1e13;
+    return options;
 }
 
-void PressureSensor::FillI2cTransaction(I2cTransaction& transaction)
+I2cTask PressureSensor::RunSampling()
 {
-    transaction.AddCommand([] (int i2cHandle, std::chrono::milliseconds& delayNextCommand) {
-        static constexpr char requestMeasurementCmd[] = { '\xAA', '\0', '\0' };
-        auto bytesWritten = write(i2cHandle, requestMeasurementCmd, sizeof(requestMeasurementCmd));
-        if (bytesWritten != sizeof(requestMeasurementCmd))
-        {
-            cerr << "ReadRawPressure: request measurement failed. bytesWritten: " << bytesWritten << endl;
-            return HwResult::CommFailure;
-        }
-        delayNextCommand = 3ms;
-        return HwResult::Next;
-    });
+    static constexpr uint8_t c_requestMeasurementCmd[] = { 0xAA, 0x00, 0x00 };
 
-    transaction.AddCommand([] (int i2cHandle, std::chrono::milliseconds& delayNextCommand) {
-        int status = i2c_smbus_read_byte(i2cHandle);
-        if (status < 0)
-        {
-            cerr << "ReadRawPressure: read status failed. status: " << status << endl;
-            return HwResult::CommFailure;
-        }
-        
-        if ((status & c_busyFlag) == 0 || (status == 0xFF))
-        {
-            return HwResult::Next;
-        }
-        else
+    I2cAsyncBus bus(c_sensorAddress);
+    // Status byte followed by 24 bit measurement
+    uint8_t readBuff[c_measurementLength] = {};
+
+    m_samplingSchedule.Start(chrono::steady_clock::now());
+    while (true)
+    {
+        IfFailCoReturn(co_await bus.Write(c_requestMeasurementCmd, sizeof(c_requestMeasurementCmd)));
+        TimePoint requestTime = co_await bus.GetTransferTime();
+        bool isAdaptive = m_isAdaptiveConversion.load();
+        co_await bus.Delay(isAdaptive ? chrono::microseconds(m_conversionTimeUs.load()) : c_datasheetConversionTime);
+
+        IfFailCoReturn(co_await bus.Read(readBuff, c_measurementLength));
+        int busyReadsCount = 0;
+        while ((readBuff[0] & c_busyFlag) != 0 && readBuff[0] != 0xFF)
         {
-            delayNextCommand = 1ms;
-            return HwResult::Repeat;
+            ++busyReadsCount;
+            m_busyReadsCount.fetch_add(1, memory_order_relaxed);
+            co_await bus.Delay(isAdaptive ? c_adaptiveBusyPollInterval : c_busyPollInterval);
+            IfFailCoReturn(co_await bus.Read(readBuff, c_measurementLength));
         }
-    });
-
-    transaction.AddCommand([this] (int i2cHandle, std::chrono::milliseconds& /*delayNextCommand*/) {
-        char readBuff[4];
-        auto bytesRead = read(i2cHandle, readBuff, sizeof(readBuff));
-        if (bytesRead != sizeof(readBuff))
+        // Result was latched by the last read
+        int64_t timeUs = ToTimeUs(co_await bus.GetTransferTime());
+        if (isAdaptive)
         {
-            cerr << "ReadRawPressure: read measurement failed. bytesRead: " << bytesRead << endl;
-            return HwResult::CommFailure;
+            m_conversionTimeUs.store(
+                LearnConversionTimeUs(m_conversionTimeUs.load(), busyReadsCount, timeUs - ToTimeUs(requestTime)));
         }
 
         int status = readBuff[0];
         if ((status & c_integrityFlag) || (status & c_mathSatFlag))
         {
             cerr << "ReadRawPressure: read measurement failed. status: " << std::hex << status << std::dec << endl;
-            return HwResult::CommFailure;
+            co_return HwResult::CommFailure;
         }
 
-        int reading = 0;
-        for (int i = 0; ++i < 4;)
+        int reading = (readBuff[1] << 16) | (readBuff[2] << 8) | readBuff[3];
+        ProcessMeasurement(reading - c_outputMin, timeUs);
+
+        if (!m_sampling.Publish(HwSample { GetLastPressure(), timeUs }))
         {
-            reading <<= 8;
-            reading |= readBuff[i];
+            co_return HwResult::Success;
         }
-
-        reading -= c_outputMin;
-        ProcessMeasurement(reading);
-
-        return HwResult::Completed;
-    });
+        co_await bus.NextPeriod(m_samplingSchedule);
+    }
 }
 
-void PressureSensor::ProcessMeasurement(int curValue)
+int PressureSensor::LearnConversionTimeUs(int conversionTimeUs, int busyReadsCount, int64_t elapsedUs)
 {
-    int curTimeMs = TimeSinceEpochMs();
-    int prevValue = m_lastRawValue.load();
-    uint32_t prevTimeMs = m_lastMeasurementTimeMs.load();
+    if (busyReadsCount > 0)
+    {
+        // Conversion took longer than expected. Elapsed time includes the wakeup latency of the reads,
+        // so it is only an upper bound: the conversion ended within a poll interval after the last busy read.
+        int64_t polledUs = conversionTimeUs + busyReadsCount * c_adaptiveBusyPollInterval.count();
+        conversionTimeUs = static_cast<int>(min(elapsedUs, polledUs));
+    }
+    else
+    {
+        // Ready at the first read, the conversion may be shorter: probe slowly to keep busy reads rare
+        conversionTimeUs -= max(conversionTimeUs / c_conversionProbeDivisor, c_minConversionProbeUs);
+    }
+    return clamp(conversionTimeUs, static_cast<int>(c_minConversionTime.count()),
+        static_cast<int>(c_maxConversionTime.count()));
+}
 
+void PressureSensor::ProcessMeasurement(int curValue, int64_t timeUs)
+{
+    m_samples.Push(HwSample { curValue, timeUs });
     m_lastRawValue.store(curValue);
     m_minRawValue.store(min(m_minRawValue.load(), curValue));
-    m_lastMeasurementTimeMs.store(curTimeMs);
+    m_lastMeasurementTimeUs.store(timeUs);
 
-    if (prevValue != 0)
+    // Microseconds resolve the rate of samples taken within the same millisecond
+    m_filter.Update(curValue, timeUs);
+    m_filteredRawValue.store(static_cast<int>(lround(m_filter.GetValue())));
+    m_rawChangeRate.store(static_cast<int>(lround(m_filter.GetRate())));
+
+    if (m_pState != nullptr)
     {
-        int rate = TruncateNoise(curValue - prevValue) * c_rateMultiplyer / (curTimeMs - prevTimeMs);
-        m_lastChangeRate.store(rate);
+        m_pState->Update([this, timeUs] (HwState& state) {
+            state.pressure = GetLastPressure();
+            state.filteredPressure = GetFilteredPressure();
+            state.pressureChangeRate = GetChangeRate();
+            state.pressureTimeUs = timeUs;
+        });
     }
 }
 
 std::future<HwResult> PressureSensor::ReadPressureAsync()
 {
-    if (m_pCurTransaction != nullptr)
-    {
-        cerr << "PressureSensor::ReadPressureAsync: transaction already in progress" << endl;
-        return GetCompletedFuture(HwResult::Failure);
-    }
-    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(c_sensorAddress);
-    FillI2cTransaction(transaction);
-
-    transaction.SetCompletionAction([this] (HwResult) {
-        m_pCurTransaction = nullptr;
-    });
-
-    future<HwResult> measurementFuture = transaction.GetFuture();
-    m_pCurTransaction = m_i2cAccessor.PushTransaction(move(transaction));
-
-    return measurementFuture;
+    return m_sampling.AddWatcher([] (int) { return HwResult::Success; }, nullptr);
 }
 
-std::future<HwResult> PressureSensor::NotifyWhenPressure(std::function<HwResult(int)>&& isExpectedValue,
-        std::function<void(HwResult)>&& completionAction)
+HwSampleFuture PressureSensor::ReadSampleAsync()
 {
-    if (m_pCurTransaction != nullptr)
-    {
-        cerr << "PressureSensor::ReadPressureAsync: transaction already in progress" << endl;
-        return GetCompletedFuture(HwResult::Failure);
-    }
-    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(c_sensorAddress);
-    
-    FillI2cTransaction(transaction);
-
-    transaction.MakeRecursive([this, checkPressure = move(isExpectedValue)] {
-        return checkPressure(GetLastPressure());
-    }, 2ms);
-
-    transaction.SetCompletionAction(
-        [this, completionAction = move(completionAction)] (HwResult status) {
-            m_pCurTransaction = nullptr;
-            completionAction(status);
-        }
-    );
-
-    future<HwResult> measurementFuture = transaction.GetFuture();
-    m_pCurTransaction = m_i2cAccessor.PushTransaction(move(transaction));
-
-    return measurementFuture;
+    return m_sampling.AddSampleWatcher([] (int) { return HwResult::Success; });
 }
 
-std::future<HwResult> PressureSensor::StartContinuousMeasurement(std::function<HwResult(int)>&& onValue)
+std::future<HwResult> PressureSensor::NotifyWhenPressure(HwValuePredicate&& isExpectedValue,
+        HwCompletionAction&& completionAction)
 {
-    if (m_pCurTransaction != nullptr)
-    {
-        cerr << "PressureSensor::ReadPressureAsync: transaction already in progress" << endl;
-        return GetCompletedFuture(HwResult::Failure);
-    }
-    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(c_sensorAddress);
-    
-    FillI2cTransaction(transaction);
-
-    transaction.MakeRecursive([this, onValue = move(onValue)] {
-        return onValue(GetLastPressure());
-    }, 2ms);
-
-    transaction.SetCompletionAction(
-        [this] (HwResult /*status*/) {
-            m_pCurTransaction = nullptr;
-        }
-    );
-
-    future<HwResult> measurementFuture = transaction.GetFuture();
-    m_pCurTransaction = m_i2cAccessor.PushTransaction(move(transaction));
+    return m_sampling.AddWatcher(move(isExpectedValue), move(completionAction));
+}
 
-    return measurementFuture;
+std::future<HwResult> PressureSensor::StartContinuousMeasurement(HwValuePredicate&& onValue)
+{
+    return m_sampling.AddWatcher(move(onValue), nullptr);
 }
 
 void PressureSensor::AbortMeasurement()
 {
-    if (m_pCurTransaction != nullptr)
-    {
-        m_pCurTransaction->Abort();
-        m_pCurTransaction = nullptr;
-    }
+    m_sampling.Abort();
 }
 
 bool PressureSensor::IsMeasurementStale() const
 {
-    static constexpr uint32_t staleMeasurementThresholdMs = 50;
-    return TimeSinceEpochMs() - GetLastMeasurementTimeMs() > staleMeasurementThresholdMs;
+    static constexpr int64_t staleMeasurementThresholdUs = 50'000;
+    return TimeSinceEpochUs() - GetLastMeasurementTimeUs() > staleMeasurementThresholdUs;
 }
 
 int PressureSensor::GetPressureFetchIfStale()
 {
     if (IsMeasurementStale())
     {
-        auto measurementFuture = ReadPressureAsync();
-        measurementFuture.wait();
+        HwSampleResult result = ReadSampleAsync().Get();
+        return result.status == HwResult::Success ? result.sample.value : -1;
     }
-    return IsMeasurementStale() ? -1 : GetLastPressure();
+    return GetLastPressure();
 }
@@ -0,0 +1,303 @@
+#include "SamplingService.h"
+#include "I2cAccessor.h"
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+bool SampleCompletion::TryAcquire()
+{
+    // References of the watcher and of the future
+    int refCount = 0;
+    if (!m_refCount.compare_exchange_strong(refCount, 2, memory_order_acquire))
+    {
+        return false;
+    }
+    m_state.store(State::Pending, memory_order_relaxed);
+    return true;
+}
+
+void SampleCompletion::Complete(const HwSampleResult& result)
+{
+    m_result = result;
+    if (m_state.exchange(State::Completed, memory_order_acq_rel) == State::Continued)
+    {
+        m_continuation(m_result);
+        m_continuation.Reset();
+    }
+    m_state.notify_all();
+}
+
+const HwSampleResult& SampleCompletion::Wait() const
+{
+    State state = m_state.load(memory_order_acquire);
+    while (state != State::Completed)
+    {
+        m_state.wait(state, memory_order_acquire);
+        state = m_state.load(memory_order_acquire);
+    }
+    return m_result;
+}
+
+void SampleCompletion::Then(HwSampleContinuation&& continuation)
+{
+    if (IsReady())
+    {
+        continuation(m_result);
+        return;
+    }
+
+    m_continuation = move(continuation);
+    State state = State::Pending;
+    if (!m_state.compare_exchange_strong(state, State::Continued, memory_order_acq_rel))
+    {
+        // Completed meanwhile, the sampling thread did not see the continuation
+        m_continuation(m_result);
+        m_continuation.Reset();
+    }
+}
+
+SampleWatchers::Watcher* SampleWatchers::Reserve()
+{
+    for (Watcher& watcher : m_watchers)
+    {
+        State state = State::Free;
+        if (watcher.state.compare_exchange_strong(state, State::Adding))
+        {
+            // Counted before it is active, so that the sampling does not stop meanwhile
+            ++m_watchersCount;
+            return &watcher;
+        }
+    }
+    cerr << "SampleWatchers::Add: too many watchers" << endl;
+    return nullptr;
+}
+
+void SampleWatchers::Activate(Watcher& watcher, HwValuePredicate&& isExpectedValue,
+    HwCompletionAction&& completionAction, HwPollInterval&& pollInterval, SampleCompletion* pCompletion)
+{
+    watcher.isExpectedValue = move(isExpectedValue);
+    watcher.completionAction = move(completionAction);
+    watcher.pollInterval = move(pollInterval);
+    watcher.pCompletion = pCompletion;
+    watcher.isCancelled = false;
+    watcher.state.store(State::Active, memory_order_release);
+}
+
+future<HwResult> SampleWatchers::Add(HwValuePredicate&& isExpectedValue, HwCompletionAction&& completionAction,
+    HwPollInterval&& pollInterval)
+{
+    Watcher* pWatcher = Reserve();
+    if (pWatcher == nullptr)
+    {
+        if (completionAction)
+        {
+            completionAction(HwResult::Busy);
+        }
+        promise<HwResult> busyPromise;
+        busyPromise.set_value(HwResult::Busy);
+        return busyPromise.get_future();
+    }
+
+    pWatcher->promise = promise<HwResult>();
+    future<HwResult> watcherFuture = pWatcher->promise.get_future();
+    Activate(*pWatcher, move(isExpectedValue), move(completionAction), move(pollInterval), nullptr);
+    return watcherFuture;
+}
+
+HwSampleFuture SampleWatchers::AddSampleWatcher(HwValuePredicate&& isExpectedValue)
+{
+    SampleCompletion* pCompletion = nullptr;
+    for (SampleCompletion& completion : m_completions)
+    {
+        if (completion.TryAcquire())
+        {
+            pCompletion = &completion;
+            break;
+        }
+    }
+    Watcher* pWatcher = pCompletion != nullptr ? Reserve() : nullptr;
+    if (pWatcher == nullptr)
+    {
+        if (pCompletion != nullptr)
+        {
+            // Neither the watcher nor the future refers to it
+            pCompletion->Release();
+            pCompletion->Release();
+        }
+        return HwSampleFuture(HwSampleResult { HwResult::Busy, {} });
+    }
+
+    Activate(*pWatcher, move(isExpectedValue), nullptr, nullptr, pCompletion);
+    return HwSampleFuture(pCompletion);
+}
+
+bool SampleWatchers::Notify(const HwSample& sample)
+{
+    m_lastSample = sample;
+    for (Watcher& watcher : m_watchers)
+    {
+        if (watcher.state.load(memory_order_acquire) != State::Active)
+        {
+            continue;
+        }
+        if (watcher.isCancelled)
+        {
+            Complete(watcher, HwResult::Abort);
+            continue;
+        }
+
+        HwResult result = watcher.isExpectedValue(sample.value);
+        if (result != HwResult::Repeat)
+        {
+            Complete(watcher, result);
+        }
+    }
+    return HasWatchers();
+}
+
+chrono::microseconds SampleWatchers::GetPollInterval(chrono::microseconds defaultInterval) const
+{
+    chrono::microseconds interval = chrono::microseconds::max();
+    for (const Watcher& watcher : m_watchers)
+    {
+        if (watcher.state.load(memory_order_acquire) == State::Active)
+        {
+            interval = min(interval, watcher.pollInterval ? watcher.pollInterval() : defaultInterval);
+        }
+    }
+    // Watcher being added gets the default
+    return interval == chrono::microseconds::max() ? defaultInterval : interval;
+}
+
+void SampleWatchers::CompleteAll(HwResult status)
+{
+    for (Watcher& watcher : m_watchers)
+    {
+        if (watcher.state.load(memory_order_acquire) == State::Active)
+        {
+            Complete(watcher, status);
+        }
+    }
+}
+
+void SampleWatchers::CancelAll()
+{
+    for (Watcher& watcher : m_watchers)
+    {
+        if (watcher.state.load(memory_order_acquire) != State::Free)
+        {
+            watcher.isCancelled = true;
+        }
+    }
+}
+
+void SampleWatchers::CompleteCancelled()
+{
+    for (Watcher& watcher : m_watchers)
+    {
+        if (watcher.state.load(memory_order_acquire) == State::Active && watcher.isCancelled)
+        {
+            Complete(watcher, HwResult::Abort);
+        }
+    }
+}
+
+void SampleWatchers::Complete(Watcher& watcher, HwResult status)
+{
+    // Slot is released first: completion action may add a new watcher
+    HwCompletionAction completionAction = move(watcher.completionAction);
+    promise<HwResult> watcherPromise = move(watcher.promise);
+    SampleCompletion* pCompletion = exchange(watcher.pCompletion, nullptr);
+    watcher.isExpectedValue.Reset();
+    watcher.pollInterval.Reset();
+    watcher.state.store(State::Free, memory_order_release);
+    --m_watchersCount;
+
+    if (completionAction)
+    {
+        completionAction(status);
+    }
+    if (pCompletion != nullptr)
+    {
+        pCompletion->Complete(HwSampleResult { status, m_lastSample });
+        pCompletion->Release();
+    }
+    else
+    {
+        watcherPromise.set_value(status);
+    }
+}
+
+SamplingService::~SamplingService()
+{
+    Abort();
+    if (!m_i2cAccessor.IsRunning())
+    {
+        // Pushed transaction is never run
+        return;
+    }
+    while (m_isSampling.load() || m_isCompleting.load())
+    {
+        this_thread::yield();
+    }
+}
+
+future<HwResult> SamplingService::AddWatcher(HwValuePredicate&& isExpectedValue, HwCompletionAction&& completionAction,
+    HwPollInterval&& pollInterval)
+{
+    future<HwResult> watcherFuture = m_watchers.Add(move(isExpectedValue), move(completionAction), move(pollInterval));
+    Start();
+    return watcherFuture;
+}
+
+HwSampleFuture SamplingService::AddSampleWatcher(HwValuePredicate&& isExpectedValue)
+{
+    HwSampleFuture sampleFuture = m_watchers.AddSampleWatcher(move(isExpectedValue));
+    Start();
+    return sampleFuture;
+}
+
+void SamplingService::Abort()
+{
+    m_watchers.CancelAll();
+    if (m_isSampling)
+    {
+        // Sampling restarts from the completion action if watchers were added meanwhile
+        m_i2cAccessor.AbortDevice(m_deviceAddress);
+    }
+}
+
+void SamplingService::Start()
+{
+    bool isSampling = false;
+    if (!m_watchers.HasWatchers() || !m_isSampling.compare_exchange_strong(isSampling, true))
+    {
+        return;
+    }
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(m_deviceAddress);
+    transaction.SetPriority(m_priority);
+    transaction.SetCoroutine(m_taskFactory());
+    transaction.SetCompletionAction([this] (HwResult status) {
+        // Set before sampling is cleared, so that the destructor keeps waiting
+        m_isCompleting = true;
+        if (status == HwResult::Abort)
+        {
+            m_watchers.CompleteCancelled();
+        }
+        else if (status != HwResult::Success)
+        {
+            // Sampling failed, watchers would never get a sample
+            m_watchers.CompleteAll(status);
+        }
+        m_isSampling = false;
+
+        // Watcher added after the last sample was published
+        Start();
+        m_isCompleting = false;
+    });
+    m_i2cAccessor.PushTransaction(move(transaction));
+}
@@ -0,0 +1,280 @@
+#include "SimulatedI2cBus.h"
+#include "Utils.h"
+
+#include <thread>
+
+using namespace std;
+
+int SimulatedPressureSensor::Read(uint8_t* buffer, int length)
+{
+    if (m_isConverting && chrono::steady_clock::now() >= m_conversionEndTime)
+    {
+        m_isConverting = false;
+        m_latchedOutput = m_outputSource ? m_outputSource() : m_rawOutput.load();
+        m_measurementsCount.fetch_add(1);
+    }
+
+    uint8_t data[4] = {
+        static_cast<uint8_t>(c_statusPowered | (m_isConverting ? c_statusBusy : 0)),
+        static_cast<uint8_t>(m_latchedOutput >> 16),
+        static_cast<uint8_t>(m_latchedOutput >> 8),
+        static_cast<uint8_t>(m_latchedOutput)
+    };
+
+    for (int i = 0; i < length; ++i)
+    {
+        buffer[i] = i < static_cast<int>(size(data)) ? data[i] : 0;
+    }
+    return length;
+}
+
+int SimulatedPressureSensor::Write(const uint8_t* buffer, int length)
+{
+    if (length == 3 && buffer[0] == 0xAA && buffer[1] == 0x00 && buffer[2] == 0x00)
+    {
+        m_isConverting = true;
+        m_conversionEndTime = chrono::steady_clock::now() + m_conversionTime.load();
+    }
+    return length;
+}
+
+SimulatedMagnetSensor::SimulatedMagnetSensor()
+{
+    m_registers[0x0B] = c_statusMagnetDetected;
+    // AGC
+    m_registers[0x1A] = 0x80;
+    // MAGNITUDE
+    m_registers[0x1B] = 0x08;
+}
+
+int SimulatedMagnetSensor::Read(uint8_t* buffer, int length)
+{
+    // Both angle bytes come from the same moment
+    int rawAngle = GetAngle();
+    for (int i = 0; i < length; ++i)
+    {
+        buffer[i] = ReadRegister(m_registerPointer, rawAngle);
+        if (m_registerPointer < c_registersCount - 1)
+        {
+            ++m_registerPointer;
+        }
+    }
+    return length;
+}
+
+int SimulatedMagnetSensor::Write(const uint8_t* buffer, int length)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    m_registerPointer = min<int>(buffer[0], c_registersCount - 1);
+    for (int i = 1; i < length; ++i)
+    {
+        // ZPOS, MPOS, MANG and CONF are writable
+        if (m_registerPointer >= 0x01 && m_registerPointer <= 0x08)
+        {
+            m_registers[m_registerPointer] = buffer[i];
+        }
+        if (m_registerPointer < c_registersCount - 1)
+        {
+            ++m_registerPointer;
+        }
+    }
+    return length;
+}
+
+void SimulatedMagnetSensor::SetAngle(int rawAngle)
+{
+    m_angleTimeUs = TimeSinceEpochUs();
+    m_rawAngle = rawAngle & 0xFFF;
+}
+
+int SimulatedMagnetSensor::GetAngle() const
+{
+    if (m_angleSource)
+    {
+        return m_angleSource() & 0xFFF;
+    }
+    int velocity = m_velocity.load();
+    if (velocity == 0)
+    {
+        return m_rawAngle.load();
+    }
+    int64_t elapsedUs = TimeSinceEpochUs() - m_angleTimeUs.load();
+    return static_cast<int>((m_rawAngle.load() + velocity * elapsedUs / 1'000'000) & 0xFFF);
+}
+
+void SimulatedMagnetSensor::SetVelocity(int unitsPerSecond)
+{
+    // Continue from the current angle
+    SetAngle(GetAngle());
+    m_velocity = unitsPerSecond;
+}
+
+uint8_t SimulatedMagnetSensor::ReadRegister(int reg, int rawAngle) const
+{
+    switch (reg)
+    {
+    // RAW ANGLE and ANGLE
+    case 0x0C:
+    case 0x0E:
+        return static_cast<uint8_t>(rawAngle >> 8);
+    case 0x0D:
+    case 0x0F:
+        return static_cast<uint8_t>(rawAngle);
+    default:
+        return m_registers[reg];
+    }
+}
+
+SimulatedI2cBus::SimulatedI2cBus()
+{
+    AttachDevice(SimulatedPressureSensor::c_address, &m_pressureSensor);
+    AttachDevice(SimulatedMagnetSensor::c_address, &m_magnetSensor);
+}
+
+int SimulatedI2cBus::Open()
+{
+    m_openCount.fetch_add(1, memory_order_relaxed);
+    m_isOpen = true;
+    return 0;
+}
+
+void SimulatedI2cBus::Close()
+{
+    lock_guard lk(m_mutex);
+    m_isOpen = false;
+    m_selectedDeviceAddress = -1;
+}
+
+int SimulatedI2cBus::SelectDevice(int deviceAddress)
+{
+    lock_guard lk(m_mutex);
+    m_operationsCount.fetch_add(1, memory_order_relaxed);
+    m_selectDeviceCount.fetch_add(1, memory_order_relaxed);
+
+    // Same as I2C_SLAVE, succeeds whether the device responds or not
+    if (!m_isOpen || deviceAddress < 0 || deviceAddress > c_maxDeviceAddress)
+    {
+        return -1;
+    }
+    m_selectedDeviceAddress = deviceAddress;
+    return 0;
+}
+
+int SimulatedI2cBus::Read(uint8_t* buffer, int length)
+{
+    lock_guard lk(m_mutex);
+    m_operationsCount.fetch_add(1, memory_order_relaxed);
+
+    SimulatedI2cDevice* pDevice = m_isOpen ? FindDevice(m_selectedDeviceAddress) : nullptr;
+    if (pDevice == nullptr || ConsumeInjectedFailure())
+    {
+        return -1;
+    }
+    WaitLatency(length);
+    return pDevice->Read(buffer, length);
+}
+
+int SimulatedI2cBus::Write(const uint8_t* buffer, int length)
+{
+    lock_guard lk(m_mutex);
+    m_operationsCount.fetch_add(1, memory_order_relaxed);
+
+    SimulatedI2cDevice* pDevice = m_isOpen ? FindDevice(m_selectedDeviceAddress) : nullptr;
+    if (pDevice == nullptr || ConsumeInjectedFailure())
+    {
+        return -1;
+    }
+    WaitLatency(length);
+    return pDevice->Write(buffer, length);
+}
+
+int SimulatedI2cBus::Transfer(I2cMessage* messages, int count)
+{
+    lock_guard lk(m_mutex);
+    m_operationsCount.fetch_add(1, memory_order_relaxed);
+
+    if (!m_isOpen || count > c_maxTransferMessages || ConsumeInjectedFailure())
+    {
+        return -1;
+    }
+
+    int bytesCount = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        bytesCount += messages[i].length;
+    }
+    WaitLatency(bytesCount);
+
+    // Like a NACK, messages before the missing device are still transferred
+    for (int i = 0; i < count; ++i)
+    {
+        I2cMessage& message = messages[i];
+        SimulatedI2cDevice* pDevice = FindDevice(message.deviceAddress);
+        if (pDevice == nullptr)
+        {
+            return -1;
+        }
+
+        int status = message.isRead ? pDevice->Read(message.data, message.length) :
+            pDevice->Write(message.data, message.length);
+        if (status < 0)
+        {
+            return -1;
+        }
+    }
+    return count;
+}
+
+void SimulatedI2cBus::SetLatency(chrono::microseconds perOperation, chrono::microseconds perByte)
+{
+    lock_guard lk(m_mutex);
+    m_operationLatency = perOperation;
+    m_byteLatency = perByte;
+}
+
+void SimulatedI2cBus::FailNextOperations(int count)
+{
+    lock_guard lk(m_mutex);
+    m_failOperationsCount = count;
+}
+
+bool SimulatedI2cBus::ConsumeInjectedFailure()
+{
+    if (m_failOperationsCount <= 0)
+    {
+        return false;
+    }
+    --m_failOperationsCount;
+    return true;
+}
+
+void SimulatedI2cBus::AttachDevice(int deviceAddress, SimulatedI2cDevice* pDevice)
+{
+    lock_guard lk(m_mutex);
+    if (deviceAddress >= 0 && deviceAddress <= c_maxDeviceAddress)
+    {
+        m_devices[deviceAddress] = pDevice;
+    }
+}
+
+SimulatedI2cDevice* SimulatedI2cBus::FindDevice(int deviceAddress) const
+{
+    if (deviceAddress < 0 || deviceAddress > c_maxDeviceAddress)
+    {
+        return nullptr;
+    }
+    return m_devices[deviceAddress];
+}
+
+void SimulatedI2cBus::WaitLatency(int bytesCount) const
+{
+    auto latency = m_operationLatency + m_byteLatency * bytesCount;
+    if (latency > 0us)
+    {
+        this_thread::sleep_for(latency);
+    }
+}
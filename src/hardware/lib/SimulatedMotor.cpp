@@ -0,0 +1,202 @@
+#include "SimulatedMotor.h"
+#include "PressureSensor.h"
+#include "SimulatedI2cBus.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+using namespace std;
+
+static double ToSeconds(chrono::steady_clock::duration duration)
+{
+    return chrono::duration<double>(duration).count();
+}
+
+SimulatedMotor::SimulatedMotor(const SimulatedMotorOptions& options) :
+    m_options(options),
+    m_time(chrono::steady_clock::now())
+{}
+
+SimulatedMotorOptions SimulatedMotor::GetValveOptions()
+{
+    SimulatedMotorOptions options;
+    options.maxSpeed = 1'000;
+    options.timeConstant = chrono::milliseconds(20);
+    options.startDutyPercent = 20;
+    options.directionChangeDelay = chrono::milliseconds(30);
+    return options;
+}
+
+int SimulatedMotor::Run(MotorDirection direction, int dutyPercent)
+{
+    int driveSign = direction == MotorDirection::Right ? 1 : -1;
+    SetDuty(driveSign * clamp(dutyPercent, 0, 100) / 100.0);
+    return 0;
+}
+
+int SimulatedMotor::Stop()
+{
+    SetDuty(0);
+    return 0;
+}
+
+void SimulatedMotor::SetDuty(double duty)
+{
+    lock_guard lk(m_mutex);
+    Advance();
+
+    int driveSign = duty > 0 ? 1 : duty < 0 ? -1 : 0;
+    m_pendingDuty = duty;
+    m_dutyTime = m_time;
+    if (driveSign != 0 && m_lastDriveSign != 0 && driveSign != m_lastDriveSign)
+    {
+        // Backlash is taken up before the reversed drive reaches the load
+        m_duty = 0;
+        m_dutyTime += m_options.directionChangeDelay;
+    }
+    else
+    {
+        m_duty = duty;
+    }
+    if (driveSign != 0)
+    {
+        m_lastDriveSign = driveSign;
+    }
+}
+
+double SimulatedMotor::GetPosition() const
+{
+    lock_guard lk(m_mutex);
+    Advance();
+    return m_position;
+}
+
+void SimulatedMotor::SetPosition(double position)
+{
+    lock_guard lk(m_mutex);
+    Advance();
+    m_position = position;
+}
+
+double SimulatedMotor::GetSpeed() const
+{
+    lock_guard lk(m_mutex);
+    Advance();
+    return m_speed;
+}
+
+void SimulatedMotor::Advance() const
+{
+    TimePoint now = chrono::steady_clock::now();
+    double timeConstant = ToSeconds(m_options.timeConstant);
+    // Friction holds the motor below the start duty and slows it down by the same amount at any speed
+    double friction = m_options.startDutyPercent / 100.0 * m_options.maxSpeed / timeConstant;
+
+    while (m_time < now)
+    {
+        if (m_duty != m_pendingDuty && m_time >= m_dutyTime)
+        {
+            m_duty = m_pendingDuty;
+        }
+        TimePoint stepEnd = min(m_time + c_integrationStep, now);
+        if (m_duty != m_pendingDuty && m_dutyTime > m_time)
+        {
+            stepEnd = min(stepEnd, m_dutyTime);
+        }
+        double dt = ToSeconds(stepEnd - m_time);
+        m_time = stepEnd;
+
+        // Back EMF: drive pulls the speed to its no-load speed
+        double driveAcceleration = (m_duty * m_options.maxSpeed - m_speed) / timeConstant;
+        double speed = m_speed;
+        if (speed == 0)
+        {
+            if (abs(driveAcceleration) <= friction)
+            {
+                continue;
+            }
+            speed += (driveAcceleration - copysign(friction, driveAcceleration)) * dt;
+        }
+        else
+        {
+            speed += (driveAcceleration - copysign(friction, speed)) * dt;
+            if (speed * m_speed < 0)
+            {
+                // Stopped within the step, friction holds it until the drive overcomes it
+                speed = 0;
+            }
+        }
+        m_position += (m_speed + speed) / 2 * dt;
+        m_speed = speed;
+    }
+}
+
+SimulatedValve::SimulatedValve(const SimulatedMotor& motor, const SimulatedValveOptions& options) :
+    m_motor(motor),
+    m_options(options),
+    m_time(chrono::steady_clock::now()),
+    m_supplyPsi(options.supplyPsi)
+{
+    m_pressurePsi = GetSteadyPressurePsi();
+}
+
+double SimulatedValve::GetSteadyPressurePsi() const
+{
+    double halfTurn = m_options.halfTurnPosition;
+    double phase = fmod(m_motor.GetPosition(), halfTurn);
+    if (phase < 0)
+    {
+        phase += halfTurn;
+    }
+    // Continuous rotation closes the valve again after the middle of the half turn
+    double distanceFromClosed = min(phase, halfTurn - phase) - m_options.sealedPosition;
+    if (distanceFromClosed <= 0)
+    {
+        return 0;
+    }
+    double opening = sin(numbers::pi / 2 * distanceFromClosed / (halfTurn / 2 - m_options.sealedPosition));
+
+    // Valve and nozzle in series share the supply pressure by the squares of their flow areas
+    double areaRatio = opening * m_options.maxAreaRatio;
+    return m_supplyPsi * areaRatio * areaRatio / (1 + areaRatio * areaRatio);
+}
+
+void SimulatedValve::Advance()
+{
+    TimePoint now = chrono::steady_clock::now();
+    double dt = ToSeconds(now - m_time);
+    m_time = now;
+    double steadyPressurePsi = GetSteadyPressurePsi();
+    m_pressurePsi += (steadyPressurePsi - m_pressurePsi) * (1 - exp(-dt / ToSeconds(m_options.timeConstant)));
+}
+
+double SimulatedValve::GetPressurePsi()
+{
+    lock_guard lk(m_mutex);
+    Advance();
+    return m_pressurePsi;
+}
+
+int SimulatedValve::GetPressureOutput()
+{
+    return PressureSensor::ConvertPsiToOutput(GetPressurePsi());
+}
+
+void SimulatedValve::SetSupplyPsi(double supplyPsi)
+{
+    lock_guard lk(m_mutex);
+    Advance();
+    m_supplyPsi = supplyPsi;
+}
+
+shared_ptr<SimulatedValve> ConnectSimulatedNozzle(SimulatedI2cBus& i2cBus, const SimulatedMotor& nozzleMotor,
+    const SimulatedMotor& valveMotor, const SimulatedValveOptions& valveOptions)
+{
+    i2cBus.GetMagnetSensor().SetAngleSource([&nozzleMotor] {
+        return static_cast<int>(lround(nozzleMotor.GetPosition()));
+    });
+    auto spValve = make_shared<SimulatedValve>(valveMotor, valveOptions);
+    i2cBus.GetPressureSensor().SetOutputSource([spValve] { return spValve->GetPressureOutput(); });
+    return spValve;
+}
@@ -9,8 +9,13 @@ inline int SwapBytesWord(int w)
     return ((w >> 8) & 0xFF) | ((w & 0xFF) << 8);
 }
 
-inline uint32_t TimeSinceEpochMs()
+/// @brief steady_clock time as 64-bit microseconds, does not wrap.
+inline int64_t ToTimeUs(std::chrono::steady_clock::time_point time)
 {
-    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::steady_clock::now().time_since_epoch()).count() & 0xffffffffLL);
+    return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
+inline int64_t TimeSinceEpochUs()
+{
+    return ToTimeUs(std::chrono::steady_clock::now());
 }
@@ -0,0 +1,1302 @@
+#include "I2cAccessor.h"
+#include "I2cTrace.h"
+#include "MagnetSensor.h"
+#include "MotorControl.h"
+#include "NozzleControl.h"
+#include "PressureSensor.h"
+#include "SimulatedI2cBus.h"
+#include "SimulatedMotor.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+// Count heap allocations while s_countAllocations is set.
+static atomic<bool> s_countAllocations = false;
+static atomic<int> s_allocationsCount = 0;
+
+// Not inlined: GCC would see free() called on memory from operator new and fail -Werror=mismatched-new-delete
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    if (s_countAllocations.load(memory_order_relaxed))
+    {
+        s_allocationsCount.fetch_add(1, memory_order_relaxed);
+    }
+    void* p = malloc(size);
+    if (p == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) { return operator new(size); }
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept { free(p); }
+
+class CompletionEvent
+{
+public:
+    void Set(HwResult result)
+    {
+        // Notify under the lock: waiter may destroy the event as soon as it wakes up
+        lock_guard lk(m_mutex);
+        m_status = result;
+        m_isSet = true;
+        m_cv.notify_one();
+    }
+
+    HwResult Wait()
+    {
+        unique_lock lk(m_mutex);
+        m_cv.wait(lk, [this] { return m_isSet; });
+        return m_status;
+    }
+
+private:
+    mutex m_mutex;
+    condition_variable m_cv;
+    bool m_isSet = false;
+    HwResult m_status = HwResult::Failure;
+};
+
+// steady_clock microseconds, as sample timestamps
+static int64_t TimeSinceEpochUs()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class I2cAccessorTest : public testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        auto spI2cBus = make_unique<SimulatedI2cBus>();
+        m_pI2cBus = spI2cBus.get();
+        ASSERT_EQ(m_i2cAccessor.Init(move(spI2cBus)), 0);
+    }
+
+    HwResult RunRecursiveTransaction(int deviceAddress, int iterations)
+    {
+        int iterationsCount = 0;
+        I2cTransaction transaction = m_i2cAccessor.CreateTransaction(deviceAddress);
+        transaction.AddCommand([] (I2cBus&, chrono::milliseconds&) { return HwResult::Completed; });
+        transaction.MakeRecursive([&iterationsCount, iterations] {
+            return ++iterationsCount < iterations ? HwResult::Repeat : HwResult::Success;
+        }, 0ms);
+        auto future = transaction.GetFuture();
+        m_i2cAccessor.PushTransaction(move(transaction));
+        return future.get();
+    }
+
+    // Occupies bus thread, so that transactions pushed meanwhile become due at the same time
+    void BlockBus(chrono::milliseconds duration)
+    {
+        CompletionEvent started;
+        I2cTransaction transaction = m_i2cAccessor.CreateTransaction(0x7F);
+        transaction.AddCommand([&started, duration] (I2cBus&, chrono::milliseconds&) {
+            started.Set(HwResult::Success);
+            this_thread::sleep_for(duration);
+            return HwResult::Completed;
+        });
+        m_i2cAccessor.PushTransaction(move(transaction));
+        started.Wait();
+    }
+
+    void PushRecordingTransaction(int deviceAddress, I2cPriority priority, chrono::microseconds deadline)
+    {
+        I2cTransaction transaction = m_i2cAccessor.CreateTransaction(deviceAddress);
+        transaction.SetPriority(priority, deadline);
+        transaction.AddCommand([this, deviceAddress] (I2cBus&, chrono::milliseconds&) {
+            m_runOrder[m_runCount++] = deviceAddress;
+            return HwResult::Completed;
+        });
+        m_futures[deviceAddress] = transaction.GetFuture();
+        m_i2cAccessor.PushTransaction(move(transaction));
+    }
+
+    void WaitRecordingTransactions()
+    {
+        for (auto& future : m_futures)
+        {
+            if (future.valid())
+            {
+                future.wait();
+            }
+        }
+    }
+
+    SimulatedI2cBus* m_pI2cBus = nullptr;
+    I2cAccessor m_i2cAccessor;
+
+    int m_runOrder[4] = {};
+    int m_runCount = 0;
+    future<HwResult> m_futures[4];
+};
+
+TEST_F(I2cAccessorTest, RecursiveTransactionDoesNotAllocate)
+{
+    static constexpr int c_iterations = 10'000;
+    int commandsCount = 0;
+    int iterationsCount = 0;
+    CompletionEvent completion;
+
+    s_allocationsCount = 0;
+    s_countAllocations = true;
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(0x18);
+    transaction.AddCommand([&commandsCount] (I2cBus&, chrono::milliseconds&) {
+        ++commandsCount;
+        return HwResult::Next;
+    });
+    transaction.AddCommand([&commandsCount] (I2cBus&, chrono::milliseconds&) {
+        ++commandsCount;
+        return HwResult::Completed;
+    });
+    transaction.MakeRecursive([&iterationsCount] {
+        return ++iterationsCount < c_iterations ? HwResult::Repeat : HwResult::Success;
+    }, 0ms);
+    transaction.SetCompletionAction([&completion] (HwResult status) { completion.Set(status); });
+
+    ASSERT_NE(m_i2cAccessor.PushTransaction(move(transaction)), nullptr);
+    HwResult status = completion.Wait();
+
+    s_countAllocations = false;
+
+    EXPECT_EQ(status, HwResult::Success);
+    EXPECT_EQ(iterationsCount, c_iterations);
+    EXPECT_EQ(commandsCount, c_iterations * 2);
+    EXPECT_EQ(s_allocationsCount.load(), 0);
+}
+
+TEST_F(I2cAccessorTest, RepeatedTransactionsDoNotAllocate)
+{
+    static constexpr int c_iterations = 10'000;
+    int commandsCount = 0;
+
+    s_allocationsCount = 0;
+    s_countAllocations = true;
+
+    for (int i = 0; i < c_iterations; ++i)
+    {
+        CompletionEvent completion;
+        I2cTransaction transaction = m_i2cAccessor.CreateTransaction(0x36);
+        transaction.AddCommand([&commandsCount] (I2cBus&, chrono::milliseconds&) {
+            ++commandsCount;
+            return HwResult::Completed;
+        });
+        transaction.SetCompletionAction([&completion] (HwResult status) { completion.Set(status); });
+
+        m_i2cAccessor.PushTransaction(move(transaction));
+        completion.Wait();
+    }
+
+    s_countAllocations = false;
+
+    EXPECT_EQ(commandsCount, c_iterations);
+    EXPECT_EQ(s_allocationsCount.load(), 0);
+}
+
+TEST_F(I2cAccessorTest, SelectDeviceOnlyWhenAddressChanges)
+{
+    EXPECT_EQ(RunRecursiveTransaction(0x18, 100), HwResult::Success);
+    EXPECT_EQ(m_pI2cBus->GetSelectDeviceCount(), 1u);
+    EXPECT_EQ(m_i2cAccessor.GetSavedSelectIoctlsCount(), 99u);
+
+    EXPECT_EQ(RunRecursiveTransaction(0x18, 10), HwResult::Success);
+    EXPECT_EQ(m_pI2cBus->GetSelectDeviceCount(), 1u);
+    EXPECT_EQ(m_i2cAccessor.GetSavedSelectIoctlsCount(), 109u);
+
+    EXPECT_EQ(RunRecursiveTransaction(0x36, 10), HwResult::Success);
+    EXPECT_EQ(m_pI2cBus->GetSelectDeviceCount(), 2u);
+    EXPECT_EQ(m_i2cAccessor.GetSavedSelectIoctlsCount(), 118u);
+
+    m_i2cAccessor.InvalidateSelectedDevice();
+    EXPECT_EQ(RunRecursiveTransaction(0x36, 1), HwResult::Success);
+    EXPECT_EQ(m_pI2cBus->GetSelectDeviceCount(), 3u);
+}
+
+TEST_F(I2cAccessorTest, PoolExhausted)
+{
+    for (int i = 0; i < I2cAccessor::c_maxTransactions; ++i)
+    {
+        // Different addresses, so transactions do not abort each other
+        I2cTransaction transaction = m_i2cAccessor.CreateTransaction(i);
+        transaction.AddCommand([] (I2cBus&, chrono::milliseconds& delayNextCommand) {
+            delayNextCommand = 1h;
+            return HwResult::Repeat;
+        });
+        EXPECT_NE(m_i2cAccessor.PushTransaction(move(transaction)), nullptr);
+    }
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(I2cAccessor::c_maxTransactions);
+    transaction.AddCommand([] (I2cBus&, chrono::milliseconds&) { return HwResult::Completed; });
+    auto future = transaction.GetFuture();
+
+    EXPECT_EQ(m_i2cAccessor.PushTransaction(move(transaction)), nullptr);
+    EXPECT_EQ(future.get(), HwResult::Busy);
+}
+
+class CountingDevice : public SimulatedI2cDevice
+{
+public:
+    int Read(uint8_t*, int length) override { return length; }
+    int Write(const uint8_t*, int length) override
+    {
+        ++m_writesCount;
+        return length;
+    }
+
+    int GetWritesCount() const { return m_writesCount.load(); }
+
+private:
+    atomic<int> m_writesCount = 0;
+};
+
+TEST_F(I2cAccessorTest, FailedCombinedTransferDoesNotRepeatWrites)
+{
+    static constexpr int c_triggeredAddress = 0x20;
+    // Not attached, NACKs after the messages before it were transferred
+    static constexpr int c_missingAddress = 0x21;
+    CountingDevice triggeredDevice;
+    m_pI2cBus->AttachDevice(c_triggeredAddress, &triggeredDevice);
+
+    I2cRetryPolicy noRetries;
+    noRetries.maxAttempts = 1;
+    auto pushBatch = [this, &noRetries] (I2cBatch&& batch, int deviceAddress, I2cPriority priority) {
+        I2cTransaction transaction = m_i2cAccessor.CreateTransaction(deviceAddress);
+        transaction.SetPriority(priority);
+        transaction.SetRetryPolicy(noRetries);
+        transaction.AddBatchCommand(move(batch), [] (const I2cBatch&, chrono::milliseconds&) { return HwResult::Completed; });
+        auto future = transaction.GetFuture();
+        m_i2cAccessor.PushTransaction(move(transaction));
+        return future;
+    };
+
+    // Due at the same time, the trigger would be the first in a combined transfer
+    BlockBus(20ms);
+    I2cBatch triggerBatch;
+    triggerBatch.AddWrite(c_triggeredAddress, { 0xAA, 0x00, 0x00 });
+    EXPECT_FALSE(triggerBatch.IsRepeatable());
+    auto triggerFuture = pushBatch(move(triggerBatch), c_triggeredAddress, I2cPriority::MotionCritical);
+    I2cBatch readBatch;
+    readBatch.AddWrite(c_missingAddress, { 0x0E });
+    readBatch.AddRead(c_missingAddress, 2);
+    EXPECT_TRUE(readBatch.IsRepeatable());
+    auto readFuture = pushBatch(move(readBatch), c_missingAddress, I2cPriority::Control);
+
+    EXPECT_EQ(triggerFuture.get(), HwResult::Success);
+    EXPECT_NE(readFuture.get(), HwResult::Success);
+    EXPECT_EQ(triggeredDevice.GetWritesCount(), 1);
+}
+
+TEST_F(I2cAccessorTest, PressureSensorReadsOutputAfterConversion)
+{
+    SimulatedPressureSensor& simulatedSensor = m_pI2cBus->GetPressureSensor();
+    simulatedSensor.SetConversionTime(5ms);
+    // Raw pressure is counted from the minimal output 0x19999A
+    simulatedSensor.SetOutput(0x19999A + 0x12345);
+
+    PressureSensor pressureSensor(m_i2cAccessor);
+    EXPECT_EQ(pressureSensor.ReadPressureAsync().get(), HwResult::Success);
+    EXPECT_EQ(pressureSensor.GetLastRawPressure(), 0x12345);
+    EXPECT_EQ(simulatedSensor.GetMeasurementsCount(), 1);
+}
+
+TEST_F(I2cAccessorTest, PressureSensorFiltersMeasurements)
+{
+    SimulatedPressureSensor& simulatedSensor = m_pI2cBus->GetPressureSensor();
+    simulatedSensor.SetConversionTime(1ms);
+    simulatedSensor.SetOutput(0x19999A + 0x20000);
+
+    PressureSensor pressureSensor(m_i2cAccessor);
+    int measurementsCount = 0;
+    auto future = pressureSensor.StartContinuousMeasurement([&measurementsCount] (int) {
+        return ++measurementsCount < 10 ? HwResult::Repeat : HwResult::Success;
+    });
+    EXPECT_EQ(future.get(), HwResult::Success);
+
+    EXPECT_NEAR(pressureSensor.GetFilteredRawPressure(), 0x20000, 1 << 10);
+    EXPECT_EQ(pressureSensor.GetFilteredPressure(), pressureSensor.GetLastPressure());
+    EXPECT_EQ(pressureSensor.GetChangeRate(), 0);
+}
+
+TEST_F(I2cAccessorTest, PressureSensorLearnsConversionTime)
+{
+    SimulatedPressureSensor& simulatedSensor = m_pI2cBus->GetPressureSensor();
+    simulatedSensor.SetConversionTime(1ms);
+
+    PressureSensor pressureSensor(m_i2cAccessor);
+    EXPECT_EQ(pressureSensor.GetConversionTime(), 3ms);
+
+    int measurementsCount = 0;
+    auto future = pressureSensor.StartContinuousMeasurement([&measurementsCount] (int) {
+        return ++measurementsCount < 100 ? HwResult::Repeat : HwResult::Success;
+    });
+    EXPECT_EQ(future.get(), HwResult::Success);
+
+    // Model only decreases from 3 ms, busy reads set it at most a poll interval (200 us) after the conversion.
+    // Late wakeups find the result ready and do not raise it.
+    EXPECT_LE(pressureSensor.GetConversionTime(), 1200us);
+    EXPECT_LT(pressureSensor.GetBusyReadsCount(), 50u);
+}
+
+TEST(PressureSensor, ConversionTimeModel)
+{
+    // Busy status is polled every 200 us
+    static constexpr int c_pollUs = 200;
+
+    // Ready at the first read: probes for a shorter conversion
+    EXPECT_EQ(PressureSensor::LearnConversionTimeUs(3200, 0, 3500), 3150);
+    EXPECT_EQ(PressureSensor::LearnConversionTimeUs(500, 0, 600), 490);
+    // Busy: elapsed time bounds the conversion
+    EXPECT_EQ(PressureSensor::LearnConversionTimeUs(1000, 2, 1300), 1300);
+    // Late wakeup inflates elapsed time, the last busy read bounds it
+    EXPECT_EQ(PressureSensor::LearnConversionTimeUs(1000, 1, 3400), 1000 + c_pollUs);
+    EXPECT_EQ(PressureSensor::LearnConversionTimeUs(1000, 3, 9000), 1000 + 3 * c_pollUs);
+    // Clamped to the supported range
+    EXPECT_EQ(PressureSensor::LearnConversionTimeUs(200, 0, 250), 200);
+    EXPECT_EQ(PressureSensor::LearnConversionTimeUs(20'000, 10, 30'000), 20'000);
+}
+
+TEST_F(I2cAccessorTest, SensorsPublishSamples)
+{
+    SimulatedPressureSensor& simulatedSensor = m_pI2cBus->GetPressureSensor();
+    simulatedSensor.SetConversionTime(1ms);
+    simulatedSensor.SetOutput(0x19999A + 0x1000);
+
+    PressureSensor pressureSensor(m_i2cAccessor);
+    auto cursor = pressureSensor.GetSamples().GetCursor();
+
+    int measurementsCount = 0;
+    auto future = pressureSensor.StartContinuousMeasurement([&measurementsCount] (int) {
+        return ++measurementsCount < 10 ? HwResult::Repeat : HwResult::Success;
+    });
+    EXPECT_EQ(future.get(), HwResult::Success);
+
+    // Consumer which did not watch the measurement catches up on all of them
+    HwSample samples[16];
+    ASSERT_EQ(pressureSensor.GetSamples().PopAll(cursor, samples, 16), 10);
+    EXPECT_EQ(cursor.lostCount, 0u);
+    for (int i = 0; i < 10; ++i)
+    {
+        EXPECT_EQ(samples[i].value, 0x1000);
+        EXPECT_GE(samples[i].timeUs, samples[0].timeUs);
+    }
+
+    m_pI2cBus->GetMagnetSensor().SetAngle(0x321);
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+    auto view = magnetSensor.GetSamples().GetLast(1);
+    ASSERT_EQ(view.GetSize(), 1);
+    EXPECT_EQ(view.Back().value, 0x321);
+    EXPECT_TRUE(view.IsValid());
+}
+
+TEST_F(I2cAccessorTest, SensorsPublishCombinedState)
+{
+    m_pI2cBus->GetPressureSensor().SetConversionTime(1ms);
+    m_pI2cBus->GetPressureSensor().SetOutput(0x19999A + 0x5000);
+    m_pI2cBus->GetMagnetSensor().SetAngle(0x123);
+
+    HwStateLock stateLock;
+    EXPECT_FALSE(stateLock.Load().IsValid());
+    PressureSensor pressureSensor(m_i2cAccessor, &stateLock);
+    MagnetSensor magnetSensor(m_i2cAccessor, &stateLock);
+    EXPECT_EQ(pressureSensor.ReadPressureAsync().get(), HwResult::Success);
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+
+    // Each sensor updated its own part
+    HwState state = stateLock.Load();
+    EXPECT_TRUE(state.IsValid());
+    EXPECT_EQ(stateLock.GetVersion(), 2u);
+    EXPECT_EQ(state.rawAngle, 0x123);
+    EXPECT_EQ(state.unwrappedAngle, 0x123);
+    EXPECT_EQ(state.angleTimeUs, magnetSensor.GetLastMeasurementTimeUs());
+    EXPECT_EQ(state.pressure, PressureSensor::TruncateNoise(0x5000));
+    EXPECT_EQ(state.filteredPressure, pressureSensor.GetFilteredPressure());
+    EXPECT_EQ(state.pressureTimeUs, pressureSensor.GetLastMeasurementTimeUs());
+}
+
+TEST_F(I2cAccessorTest, SampleFuturesCarrySamples)
+{
+    m_pI2cBus->GetMagnetSensor().SetAngle(0x456);
+    MagnetSensor magnetSensor(m_i2cAccessor);
+
+    HwSampleResult result = magnetSensor.ReadSampleAsync().Get();
+    EXPECT_EQ(result.status, HwResult::Success);
+    EXPECT_EQ(result.sample.value, 0x456);
+    EXPECT_EQ(result.sample.timeUs, magnetSensor.GetLastMeasurementTimeUs());
+
+    // Continuation set before and after completion
+    CompletionEvent pendingCompletion;
+    int pendingValue = 0;
+    HwSampleFuture pendingFuture = magnetSensor.ReadSampleAsync();
+    pendingFuture.Then([&pendingCompletion, &pendingValue] (const HwSampleResult& pendingResult) {
+        pendingValue = pendingResult.sample.value;
+        pendingCompletion.Set(pendingResult.status);
+    });
+    EXPECT_EQ(pendingCompletion.Wait(), HwResult::Success);
+    EXPECT_EQ(pendingValue, 0x456);
+    EXPECT_TRUE(pendingFuture.IsReady());
+
+    bool isContinued = false;
+    pendingFuture.Then([&isContinued] (const HwSampleResult&) { isContinued = true; });
+    EXPECT_TRUE(isContinued);
+
+    s_allocationsCount = 0;
+    s_countAllocations = true;
+    for (int i = 0; i < 100; ++i)
+    {
+        result = magnetSensor.ReadSampleAsync().Get();
+    }
+    s_countAllocations = false;
+    EXPECT_EQ(result.status, HwResult::Success);
+    EXPECT_EQ(s_allocationsCount.load(), 0);
+
+    // Unread futures keep their completions, the pool is exhausted before the watchers
+    vector<HwSampleFuture> futures;
+    futures.reserve(32);
+    for (int i = 0; i < 32; ++i)
+    {
+        futures.push_back(magnetSensor.ReadSampleAsync());
+        futures.back().Get();
+    }
+    EXPECT_EQ(futures.back().Get().status, HwResult::Busy);
+    futures.clear();
+    EXPECT_EQ(magnetSensor.ReadSampleAsync().Get().status, HwResult::Success);
+}
+
+TEST_F(I2cAccessorTest, WatchersShareMeasurements)
+{
+    SimulatedPressureSensor& simulatedSensor = m_pI2cBus->GetPressureSensor();
+    simulatedSensor.SetConversionTime(1ms);
+    simulatedSensor.SetOutput(0x19999A + 0x1000);
+
+    PressureSensor pressureSensor(m_i2cAccessor);
+    int longCount = 0;
+    auto longFuture = pressureSensor.NotifyWhenPressure(
+        [&longCount] (int) { return ++longCount < 10 ? HwResult::Repeat : HwResult::Success; }, nullptr);
+    int shortCount = 0;
+    auto shortFuture = pressureSensor.StartContinuousMeasurement(
+        [&shortCount] (int) { return ++shortCount < 5 ? HwResult::Repeat : HwResult::MaxValueReached; });
+    // Neither operation aborts the other one
+    EXPECT_EQ(pressureSensor.ReadPressureAsync().get(), HwResult::Success);
+
+    EXPECT_EQ(shortFuture.get(), HwResult::MaxValueReached);
+    EXPECT_EQ(longFuture.get(), HwResult::Success);
+    // Every watcher got every sample of a single stream
+    EXPECT_EQ(simulatedSensor.GetMeasurementsCount(), 10);
+    EXPECT_EQ(pressureSensor.GetSamples().GetPushedCount(), 10u);
+}
+
+TEST_F(I2cAccessorTest, AbortMeasurementCompletesWatchers)
+{
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    auto future1 = magnetSensor.NotifyWhenAngle([] (int) { return HwResult::Repeat; }, nullptr);
+    HwResult actionStatus = HwResult::Success;
+    auto future2 = magnetSensor.NotifyWhenAngle([] (int) { return HwResult::Repeat; },
+        [&actionStatus] (HwResult status) { actionStatus = status; });
+    this_thread::sleep_for(5ms);
+
+    magnetSensor.AbortMeasurement();
+    EXPECT_EQ(future1.get(), HwResult::Abort);
+    EXPECT_EQ(future2.get(), HwResult::Abort);
+    EXPECT_EQ(actionStatus, HwResult::Abort);
+
+    // Sampling restarts for new watchers
+    m_pI2cBus->GetMagnetSensor().SetAngle(0x42);
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+    EXPECT_EQ(magnetSensor.GetLastRawAngle(), 0x42);
+}
+
+TEST_F(I2cAccessorTest, MagnetSensorReadsAngle)
+{
+    m_pI2cBus->GetMagnetSensor().SetAngle(0xABC);
+
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+    EXPECT_EQ(magnetSensor.GetLastRawAngle(), 0xABC);
+}
+
+TEST_F(I2cAccessorTest, MagnetSensorUnwrapsAngle)
+{
+    EXPECT_EQ(MagnetSensor::WrapAngle(-1), 4095);
+    EXPECT_EQ(MagnetSensor::GetAngleDiff(4000, 100), 196);
+    EXPECT_EQ(MagnetSensor::GetAngleDiff(100, 4000), -196);
+    EXPECT_EQ(MagnetSensor::GetAngleDistance(100, 4000, true), 3900);
+    EXPECT_EQ(MagnetSensor::GetAngleDistance(100, 4000, false), 196);
+
+    SimulatedMagnetSensor& simulatedSensor = m_pI2cBus->GetMagnetSensor();
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    for (int angle : { 3800, 3900, 4000, 4, 104 })
+    {
+        simulatedSensor.SetAngle(angle);
+        EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+        this_thread::sleep_for(2ms);
+    }
+    EXPECT_EQ(magnetSensor.GetLastRawAngle(), 104);
+    EXPECT_EQ(magnetSensor.GetUnwrappedAngle(), 4096 + 104);
+    EXPECT_GT(magnetSensor.GetAngularVelocity(), 0);
+
+    simulatedSensor.SetAngle(4000);
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+    EXPECT_EQ(magnetSensor.GetUnwrappedAngle(), 4000);
+}
+
+TEST_F(I2cAccessorTest, MicrosecondTimestampsResolveRate)
+{
+    static constexpr int c_velocity = 20'000;
+    static constexpr int c_samplesCount = 60;
+    SimulatedMagnetSensor& simulatedSensor = m_pI2cBus->GetMagnetSensor();
+    simulatedSensor.SetVelocity(c_velocity);
+
+    // Separate reads are not aligned to the sampling period
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    HwSample samples[c_samplesCount];
+    for (HwSample& sample : samples)
+    {
+        HwSampleResult result = magnetSensor.ReadSampleAsync().Get();
+        ASSERT_EQ(result.status, HwResult::Success);
+        sample = result.sample;
+        this_thread::sleep_for(1300us);
+    }
+
+    // Samples are 1-2 ms apart: millisecond timestamps are off by up to a half of the interval
+    double errorUs = 0.0;
+    double errorMs = 0.0;
+    int pairsCount = 0;
+    for (int i = 1; i < c_samplesCount; ++i)
+    {
+        double angleDiff = MagnetSensor::GetAngleDiff(samples[i - 1].value, samples[i].value);
+        int64_t elapsedUs = samples[i].timeUs - samples[i - 1].timeUs;
+        int64_t elapsedMs = samples[i].timeUs / 1000 - samples[i - 1].timeUs / 1000;
+        if (elapsedUs <= 0 || elapsedMs <= 0)
+        {
+            continue;
+        }
+        errorUs += abs(angleDiff * 1e6 / static_cast<double>(elapsedUs) - c_velocity);
+        errorMs += abs(angleDiff * 1e3 / static_cast<double>(elapsedMs) - c_velocity);
+        ++pairsCount;
+    }
+    ASSERT_GT(pairsCount, 0);
+    EXPECT_LT(errorUs, errorMs / 2);
+    EXPECT_LT(errorUs / pairsCount, c_velocity * 0.1);
+    EXPECT_NEAR(magnetSensor.GetAngularVelocity(), c_velocity, c_velocity * 0.1);
+}
+
+TEST_F(I2cAccessorTest, ApproachPollingAdaptsToTimeToStop)
+{
+    static constexpr int c_velocity = 8000;
+    static constexpr int c_distance = 2000;
+    SimulatedMagnetSensor& simulatedSensor = m_pI2cBus->GetMagnetSensor();
+    simulatedSensor.SetAngle(100);
+
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    ASSERT_EQ(magnetSensor.ReadSampleAsync().Get().status, HwResult::Success);
+    int64_t targetAngle = magnetSensor.GetUnwrappedAngle() + c_distance;
+    uint64_t samplesStart = magnetSensor.GetSamples().GetPushedCount();
+    auto startTime = chrono::steady_clock::now();
+
+    simulatedSensor.SetVelocity(c_velocity);
+    int64_t stopTimeUs = 0;
+    int64_t previousSampleTimeUs = 0;
+    auto future = magnetSensor.NotifyWhenApproaching(targetAngle, 1, 0,
+        [&simulatedSensor, &magnetSensor, &stopTimeUs, &previousSampleTimeUs] (HwResult) {
+            simulatedSensor.SetVelocity(0);
+            stopTimeUs = TimeSinceEpochUs();
+            // Sample before the one past the stop point, the stream is not sampling meanwhile
+            previousSampleTimeUs = magnetSensor.GetSamples().GetLast(2)[0].timeUs;
+        });
+    EXPECT_EQ(future.get(), HwResult::Success);
+    auto elapsed = chrono::steady_clock::now() - startTime;
+
+    // Sparse while far, no later than the fixed period right before the stop point
+    uint64_t samplesCount = magnetSensor.GetSamples().GetPushedCount() - samplesStart;
+    EXPECT_LT(samplesCount, static_cast<uint64_t>(elapsed / 2ms) / 2);
+    // Crossed after the previous sample, late wakeups only delay the stop
+    int overshoot = MagnetSensor::GetAngleDiff(MagnetSensor::WrapAngle(static_cast<int>(targetAngle)),
+        simulatedSensor.GetAngle());
+    EXPECT_GE(overshoot, 0);
+    EXPECT_LE(overshoot, c_velocity * (stopTimeUs - previousSampleTimeUs) / 1'000'000 + 2);
+}
+
+TEST_F(I2cAccessorTest, ScheduledStopAtPredictedCrossing)
+{
+    static constexpr int c_velocity = 8000;
+    static constexpr int c_distance = 2000;
+    SimulatedMagnetSensor& simulatedSensor = m_pI2cBus->GetMagnetSensor();
+    simulatedSensor.SetAngle(100);
+
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    ASSERT_EQ(magnetSensor.ReadSampleAsync().Get().status, HwResult::Success);
+    int64_t targetAngle = magnetSensor.GetUnwrappedAngle() + c_distance;
+
+    simulatedSensor.SetVelocity(c_velocity);
+    atomic<int> stopsCount = 0;
+    // Recorded by the stop action on the bus thread, the stream does not sample meanwhile
+    struct
+    {
+        int64_t targetAngle = 0;
+        int64_t timeUs = 0;
+        // Crossing predicted from the last sample, its time if the sample is past the stop point already
+        int64_t predictedTimeUs = 0;
+        int64_t lastSampleTimeUs = 0;
+        int64_t previousSampleTimeUs = 0;
+    } stop;
+    stop.targetAngle = targetAngle;
+    auto future = magnetSensor.ScheduleStopWhenApproaching(targetAngle, 1, 0,
+        [&simulatedSensor, &stopsCount, &magnetSensor, &stop] (HwResult status) {
+            simulatedSensor.SetVelocity(0);
+            stop.timeUs = TimeSinceEpochUs();
+            stop.predictedTimeUs = magnetSensor.PredictArrivalTimeUs(stop.targetAngle, 1);
+            auto lastSamples = magnetSensor.GetSamples().GetLast(2);
+            stop.lastSampleTimeUs = lastSamples[1].timeUs;
+            stop.previousSampleTimeUs = lastSamples[0].timeUs;
+            EXPECT_EQ(status, HwResult::Success);
+            ++stopsCount;
+        });
+    EXPECT_EQ(future.get(), HwResult::Success);
+    EXPECT_EQ(stopsCount.load(), 1);
+
+    int error = MagnetSensor::GetAngleDiff(MagnetSensor::WrapAngle(static_cast<int>(targetAngle)),
+        simulatedSensor.GetAngle());
+    if (stop.predictedTimeUs > stop.lastSampleTimeUs)
+    {
+        // Timer stopped between samples: error is the lateness of its wakeup, give or take a sample
+        int64_t expectedError = c_velocity * (stop.timeUs - stop.predictedTimeUs) / 1'000'000;
+        EXPECT_NEAR(error, static_cast<double>(expectedError), c_velocity * 2 / 1000);
+    }
+    else
+    {
+        // Bus thread woke up too late for the timer, the sample past the stop point stopped
+        EXPECT_GE(error, 0);
+        EXPECT_LE(error, c_velocity * (stop.timeUs - stop.previousSampleTimeUs) / 1'000'000 + 2);
+    }
+}
+
+TEST_F(I2cAccessorTest, MagnetSensorConfigAndStatus)
+{
+    m_pI2cBus->GetMagnetSensor().SetAngle(0x456);
+    MagnetSensor magnetSensor(m_i2cAccessor);
+
+    // Configuration is served by the running measurement stream instead of aborting it
+    auto notifyFuture = magnetSensor.NotifyWhenAngle([] (int) { return HwResult::Repeat; }, nullptr);
+
+    ConfigReg powerMode = { 0 };
+    powerMode.fields.pm = 2;
+    ConfigReg pmMask = { 0 };
+    pmMask.fields.pm = 0x3;
+    EXPECT_EQ(magnetSensor.UpdateConfigAsync(powerMode, pmMask.raw).get(), HwResult::Success);
+    EXPECT_EQ(magnetSensor.SetFilterAsync(3, 5).get(), HwResult::Success);
+
+    EXPECT_EQ(magnetSensor.ReadConfigAsync().get(), HwResult::Success);
+    MagnetConfig config = magnetSensor.GetConfig();
+    EXPECT_EQ(config.conf.fields.pm, 2u);
+    EXPECT_EQ(config.conf.fields.sf, 3u);
+    EXPECT_EQ(config.conf.fields.fth, 5u);
+
+    EXPECT_EQ(magnetSensor.ReadStatusAsync().get(), HwResult::Success);
+    EXPECT_TRUE(magnetSensor.IsMagnetHealthy());
+    EXPECT_EQ(magnetSensor.GetLastAgc(), 0x80);
+    EXPECT_EQ(magnetSensor.GetLastRawAngle(), 0x456);
+
+    EXPECT_EQ(notifyFuture.wait_for(0ms), future_status::timeout);
+    magnetSensor.AbortMeasurement();
+    EXPECT_EQ(notifyFuture.get(), HwResult::Abort);
+}
+
+TEST_F(I2cAccessorTest, NotifyWhenAngleReached)
+{
+    SimulatedMagnetSensor& simulatedSensor = m_pI2cBus->GetMagnetSensor();
+    simulatedSensor.SetAngle(100);
+
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    CompletionEvent completion;
+    auto future = magnetSensor.NotifyWhenAngle(
+        [] (int angle) { return angle >= 200 ? HwResult::Success : HwResult::Repeat; },
+        [&completion] (HwResult status) { completion.Set(status); });
+
+    this_thread::sleep_for(10ms);
+    EXPECT_EQ(future.wait_for(0ms), future_status::timeout);
+
+    simulatedSensor.SetAngle(250);
+    EXPECT_EQ(completion.Wait(), HwResult::Success);
+    EXPECT_EQ(future.get(), HwResult::Success);
+    EXPECT_EQ(magnetSensor.GetLastRawAngle(), 250);
+}
+
+TEST_F(I2cAccessorTest, MissingDeviceFailsTransaction)
+{
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(0x50);
+    transaction.AddCommand([] (I2cBus& i2cBus, chrono::milliseconds&) {
+        uint8_t data = 0;
+        return i2cBus.Read(&data, 1) < 0 ? HwResult::CommFailure : HwResult::Completed;
+    });
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+    EXPECT_EQ(future.get(), HwResult::CommFailure);
+}
+
+TEST_F(I2cAccessorTest, TransientFailureIsRetried)
+{
+    m_pI2cBus->GetMagnetSensor().SetAngle(0x123);
+    m_i2cAccessor.ResetRetryStats();
+    m_pI2cBus->FailNextOperations(1);
+
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+    EXPECT_EQ(magnetSensor.GetLastRawAngle(), 0x123);
+
+    I2cRetryStats stats = m_i2cAccessor.GetRetryStats();
+    EXPECT_EQ(stats.retriesCount, 1u);
+    EXPECT_EQ(stats.recoveredErrorsCount, 1u);
+    EXPECT_EQ(stats.busResetsCount, 0u);
+    EXPECT_EQ(stats.exhaustedCount, 0u);
+}
+
+TEST_F(I2cAccessorTest, RepeatedFailuresResetBus)
+{
+    m_i2cAccessor.ResetRetryStats();
+    m_pI2cBus->FailNextOperations(2);
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.AddCommand([] (I2cBus& i2cBus, chrono::milliseconds&) {
+        uint8_t data = 0;
+        return i2cBus.Read(&data, 1) < 0 ? HwResult::CommFailure : HwResult::Completed;
+    });
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+    EXPECT_EQ(future.get(), HwResult::Success);
+
+    I2cRetryStats stats = m_i2cAccessor.GetRetryStats();
+    EXPECT_EQ(stats.retriesCount, 2u);
+    EXPECT_EQ(stats.recoveredErrorsCount, 1u);
+    EXPECT_EQ(stats.busResetsCount, 1u);
+    EXPECT_EQ(m_pI2cBus->GetOpenCount(), 2u);
+}
+
+TEST_F(I2cAccessorTest, DueTransactionsRunByPriority)
+{
+    m_i2cAccessor.ResetLatencyStats();
+
+    BlockBus(20ms);
+    PushRecordingTransaction(1, I2cPriority::Telemetry, 1us);
+    PushRecordingTransaction(2, I2cPriority::Control, 1ms);
+    PushRecordingTransaction(3, I2cPriority::MotionCritical, 10ms);
+    WaitRecordingTransactions();
+
+    ASSERT_EQ(m_runCount, 3);
+    EXPECT_EQ(m_runOrder[0], 3);
+    EXPECT_EQ(m_runOrder[1], 2);
+    EXPECT_EQ(m_runOrder[2], 1);
+
+    I2cLatencyStats motionStats = m_i2cAccessor.GetLatencyStats(I2cPriority::MotionCritical);
+    I2cLatencyStats telemetryStats = m_i2cAccessor.GetLatencyStats(I2cPriority::Telemetry);
+    EXPECT_EQ(motionStats.commandsCount, 1u);
+    EXPECT_EQ(telemetryStats.commandsCount, 1u);
+    EXPECT_EQ(telemetryStats.missedDeadlinesCount, 1u);
+    EXPECT_GE(motionStats.maxLatency, 10ms);
+    EXPECT_GE(telemetryStats.maxLatency, motionStats.maxLatency);
+}
+
+TEST_F(I2cAccessorTest, SamePriorityRunsEarliestDeadlineFirst)
+{
+    BlockBus(20ms);
+    PushRecordingTransaction(1, I2cPriority::Control, 5ms);
+    PushRecordingTransaction(2, I2cPriority::Control, 1ms);
+    PushRecordingTransaction(3, I2cPriority::Control, 3ms);
+    WaitRecordingTransactions();
+
+    ASSERT_EQ(m_runCount, 3);
+    EXPECT_EQ(m_runOrder[0], 2);
+    EXPECT_EQ(m_runOrder[1], 3);
+    EXPECT_EQ(m_runOrder[2], 1);
+}
+
+// Writes ZPOS register of the magnet sensor and reads it back after a delay
+static I2cTask WriteAndReadBackZpos(uint8_t zpos, int& readZpos)
+{
+    I2cAsyncBus bus(SimulatedMagnetSensor::c_address);
+    uint8_t writeCmd[] = { 0x01, 0x00, zpos };
+    IfFailCoReturn(co_await bus.Write(writeCmd, 3));
+
+    co_await bus.Delay(2ms);
+
+    uint8_t data[2] = {};
+    IfFailCoReturn(co_await bus.ReadRegisters(0x01, data, 2));
+    readZpos = (data[0] << 8) | data[1];
+    co_return HwResult::Success;
+}
+
+static I2cTask CountIterations(int iterations, int& iterationsCount)
+{
+    I2cAsyncBus bus(SimulatedMagnetSensor::c_address);
+    uint8_t data[2] = {};
+    while (iterationsCount < iterations)
+    {
+        IfFailCoReturn(co_await bus.ReadRegisters(0x0E, data, 2));
+        ++iterationsCount;
+    }
+    co_return HwResult::Completed;
+}
+
+TEST_F(I2cAccessorTest, CoroutineTransaction)
+{
+    int freeFramesCount = I2cFramePool::Instance().GetFreeFramesCount();
+    int readZpos = 0;
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(WriteAndReadBackZpos(0x5A, readZpos));
+    EXPECT_EQ(I2cFramePool::Instance().GetFreeFramesCount(), freeFramesCount - 1);
+
+    auto startTime = chrono::steady_clock::now();
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+
+    EXPECT_EQ(future.get(), HwResult::Success);
+    EXPECT_GE(chrono::steady_clock::now() - startTime, 2ms);
+    EXPECT_EQ(readZpos, 0x5A);
+    EXPECT_EQ(I2cFramePool::Instance().GetFreeFramesCount(), freeFramesCount);
+}
+
+TEST_F(I2cAccessorTest, RetriesExhausted)
+{
+    m_i2cAccessor.ResetRetryStats();
+    m_pI2cBus->FailNextOperations(100);
+
+    I2cRetryPolicy retryPolicy;
+    retryPolicy.maxAttempts = 2;
+    retryPolicy.backoff = 100us;
+    retryPolicy.resetBusAfterFailures = 0;
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetRetryPolicy(retryPolicy);
+    int readZpos = 0;
+    transaction.SetCoroutine(WriteAndReadBackZpos(0x5A, readZpos));
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+    EXPECT_EQ(future.get(), HwResult::CommFailure);
+
+    I2cRetryStats stats = m_i2cAccessor.GetRetryStats();
+    EXPECT_EQ(stats.retriesCount, 1u);
+    EXPECT_EQ(stats.exhaustedCount, 1u);
+    EXPECT_EQ(stats.busResetsCount, 0u);
+    EXPECT_EQ(readZpos, 0);
+    m_pI2cBus->FailNextOperations(0);
+}
+
+TEST_F(I2cAccessorTest, CoroutineTransactionDoesNotAllocate)
+{
+    static constexpr int c_iterations = 1'000;
+    int iterationsCount = 0;
+    CompletionEvent completion;
+
+    s_allocationsCount = 0;
+    s_countAllocations = true;
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(CountIterations(c_iterations, iterationsCount));
+    transaction.SetCompletionAction([&completion] (HwResult status) { completion.Set(status); });
+    m_i2cAccessor.PushTransaction(move(transaction));
+    HwResult status = completion.Wait();
+
+    s_countAllocations = false;
+
+    EXPECT_EQ(status, HwResult::Completed);
+    EXPECT_EQ(iterationsCount, c_iterations);
+    EXPECT_EQ(s_allocationsCount.load(), 0);
+}
+
+TEST_F(I2cAccessorTest, CoroutineFramePoolExhausted)
+{
+    int readZpos = 0;
+    vector<I2cTask> tasks;
+    tasks.reserve(I2cFramePool::c_framesCount);
+    while (I2cFramePool::Instance().GetFreeFramesCount() > 0)
+    {
+        tasks.push_back(WriteAndReadBackZpos(0, readZpos));
+        ASSERT_TRUE(tasks.back().IsValid());
+    }
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    I2cTask task = WriteAndReadBackZpos(0, readZpos);
+    EXPECT_FALSE(task.IsValid());
+    transaction.SetCoroutine(move(task));
+
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+    EXPECT_EQ(future.get(), HwResult::Failure);
+
+    tasks.clear();
+    EXPECT_EQ(I2cFramePool::Instance().GetFreeFramesCount(), I2cFramePool::c_framesCount);
+}
+
+static I2cTask DelayRepeatedly(int count, chrono::microseconds delay)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        co_await I2cAsyncBus::Delay(delay);
+    }
+    co_return HwResult::Success;
+}
+
+TEST_F(I2cAccessorTest, WakeupJitterReported)
+{
+    m_i2cAccessor.ResetWakeupJitter();
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(DelayRepeatedly(10, 2ms));
+    auto startTime = chrono::steady_clock::now();
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+    EXPECT_EQ(future.get(), HwResult::Success);
+    EXPECT_GE(chrono::steady_clock::now() - startTime, 20ms);
+
+    I2cJitterReport report = m_i2cAccessor.GetWakeupJitter();
+    EXPECT_GE(report.wakeupsCount, 10u);
+    EXPECT_LE(report.p50, report.p99);
+    EXPECT_LE(report.p99, report.max);
+}
+
+TEST_F(I2cAccessorTest, PeriodicTransactionKeepsPhase)
+{
+    static constexpr int c_iterations = 20;
+    static constexpr auto c_period = 3ms;
+    I2cPeriodicSchedule schedule(c_period);
+    TimePoint runTimes[c_iterations];
+    TimePoint finishTimes[c_iterations];
+    int iterationsCount = 0;
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(0x18);
+    transaction.AddCommand([&runTimes, &finishTimes, &iterationsCount] (I2cBus&, chrono::milliseconds&) {
+        runTimes[iterationsCount] = chrono::steady_clock::now();
+        // Delay after every iteration would make the period 4 ms
+        this_thread::sleep_for(1ms);
+        finishTimes[iterationsCount] = chrono::steady_clock::now();
+        return HwResult::Completed;
+    });
+    transaction.MakePeriodic([&iterationsCount] {
+        return ++iterationsCount < c_iterations ? HwResult::Repeat : HwResult::Success;
+    }, schedule);
+    auto future = transaction.GetFuture();
+    // Phase of the schedule starts at the push
+    TimePoint minStartTime = chrono::steady_clock::now();
+    m_i2cAccessor.PushTransaction(move(transaction));
+    TimePoint maxStartTime = chrono::steady_clock::now();
+    EXPECT_EQ(future.get(), HwResult::Success);
+
+    // Late wakeups under load are overruns, the phase is kept by skipping whole periods only.
+    // The last run is due at iteration c_iterations - 1 + skipped.
+    auto skipped = static_cast<int64_t>(schedule.GetSkippedCount());
+    EXPECT_TRUE(schedule.GetOverrunsCount() > 0 || skipped == 0);
+    // Never run before it is due
+    EXPECT_GE(runTimes[c_iterations - 1] - minStartTime, (c_iterations - 1 + skipped) * c_period);
+    // Due less than a period after the previous run finished, even after an overrun
+    EXPECT_LT(finishTimes[c_iterations - 2] - maxStartTime, (c_iterations + skipped) * c_period);
+}
+
+TEST_F(I2cAccessorTest, PeriodicScheduleSkipsOverrunPeriods)
+{
+    I2cPeriodicSchedule schedule(3ms);
+    TimePoint startTime = chrono::steady_clock::now();
+    schedule.Start(startTime);
+    EXPECT_EQ(schedule.GetNextTime(startTime + 1ms), startTime + 3ms);
+    // Finished after iterations 2 and 3 were due: 2 runs right away, 3 is skipped
+    EXPECT_EQ(schedule.GetNextTime(startTime + 10ms), startTime + 9ms);
+    EXPECT_EQ(schedule.GetOverrunsCount(), 1u);
+    EXPECT_EQ(schedule.GetSkippedCount(), 1u);
+    EXPECT_EQ(schedule.GetNextTime(startTime + 10ms), startTime + 12ms);
+
+    // Magnet sensor samples are never taken before they are due, late ones skip periods instead of shifting the phase
+    MagnetSensor magnetSensor(m_i2cAccessor);
+    auto cursor = magnetSensor.GetSamples().GetCursor();
+    int64_t minStartTimeUs = TimeSinceEpochUs();
+    int measurementsCount = 0;
+    auto measurementFuture = magnetSensor.NotifyWhenAngle([&measurementsCount] (int) {
+        return ++measurementsCount < 50 ? HwResult::Repeat : HwResult::Success;
+    }, nullptr);
+    EXPECT_EQ(measurementFuture.get(), HwResult::Success);
+
+    HwSample samples[50];
+    ASSERT_EQ(magnetSensor.GetSamples().PopAll(cursor, samples, 50), 50);
+    int64_t periodUs = magnetSensor.GetSamplingSchedule().GetPeriod().count();
+    for (int i = 0; i < 50; ++i)
+    {
+        EXPECT_GE(samples[i].timeUs, minStartTimeUs + i * periodUs);
+    }
+}
+
+TEST(I2cTrace, ReplayReproducesSensorReadings)
+{
+    string traceFileName = testing::TempDir() + "i2c_trace.bin";
+
+    // Record readings of both sensors with slow bus
+    auto recordStartTime = chrono::steady_clock::now();
+    {
+        auto spI2cBus = make_unique<SimulatedI2cBus>();
+        spI2cBus->SetLatency(2ms, 0us);
+        spI2cBus->GetPressureSensor().SetOutput(0x19999A + 0x4321);
+        spI2cBus->GetMagnetSensor().SetAngle(0x765);
+
+        I2cAccessor i2cAccessor;
+        i2cAccessor.SetTraceFile(traceFileName.c_str());
+        ASSERT_EQ(i2cAccessor.Init(move(spI2cBus)), 0);
+
+        PressureSensor pressureSensor(i2cAccessor);
+        MagnetSensor magnetSensor(i2cAccessor);
+        auto pressureFuture = pressureSensor.ReadPressureAsync();
+        auto angleFuture = magnetSensor.ReadAngleAsync();
+        ASSERT_EQ(pressureFuture.get(), HwResult::Success);
+        ASSERT_EQ(angleFuture.get(), HwResult::Success);
+    }
+    auto recordDuration = chrono::steady_clock::now() - recordStartTime;
+
+    auto replayStartTime = chrono::steady_clock::now();
+    auto spReplayBus = make_unique<ReplayI2cBus>(traceFileName.c_str());
+    ReplayI2cBus* pReplayBus = spReplayBus.get();
+    I2cAccessor i2cAccessor;
+    ASSERT_EQ(i2cAccessor.Init(move(spReplayBus)), 0);
+
+    PressureSensor pressureSensor(i2cAccessor);
+    MagnetSensor magnetSensor(i2cAccessor);
+    // Different order: every device is replayed from its own messages
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::Success);
+    EXPECT_EQ(pressureSensor.ReadPressureAsync().get(), HwResult::Success);
+    auto replayDuration = chrono::steady_clock::now() - replayStartTime;
+
+    EXPECT_EQ(magnetSensor.GetLastRawAngle(), 0x765);
+    EXPECT_EQ(pressureSensor.GetLastRawPressure(), 0x4321);
+    EXPECT_EQ(pReplayBus->GetMismatchesCount(), 0u);
+    EXPECT_TRUE(pReplayBus->IsCompleted());
+    EXPECT_LT(replayDuration, recordDuration);
+
+    // Trace is exhausted
+    EXPECT_EQ(magnetSensor.ReadAngleAsync().get(), HwResult::CommFailure);
+    EXPECT_GT(pReplayBus->GetMismatchesCount(), 0u);
+}
+
+TEST(I2cAccessor, ThreadOptionsAreOptional)
+{
+    // Real-time priority and memory locking need privileges, failures are only reported
+    I2cThreadOptions threadOptions;
+    threadOptions.realtimePriority = 10;
+    threadOptions.cpu = 0;
+
+    I2cAccessor i2cAccessor;
+    ASSERT_EQ(i2cAccessor.Init(make_unique<SimulatedI2cBus>(), threadOptions), 0);
+
+    I2cTransaction transaction = i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(DelayRepeatedly(2, 1ms));
+    auto future = transaction.GetFuture();
+    i2cAccessor.PushTransaction(move(transaction));
+    EXPECT_EQ(future.get(), HwResult::Success);
+}
+
+TEST_F(I2cAccessorTest, AbortDeviceRemovesWaitingTransaction)
+{
+    int freeFramesCount = I2cFramePool::Instance().GetFreeFramesCount();
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(DelayRepeatedly(1, 1h));
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+
+    // Let the coroutine start and wait for its delay
+    this_thread::sleep_for(10ms);
+    m_i2cAccessor.ResetWakeupJitter();
+
+    m_i2cAccessor.AbortDevice(SimulatedMagnetSensor::c_address);
+    ASSERT_EQ(future.wait_for(100ms), future_status::ready);
+    EXPECT_EQ(future.get(), HwResult::Abort);
+    EXPECT_EQ(I2cFramePool::Instance().GetFreeFramesCount(), freeFramesCount);
+
+    // Timer is disarmed, bus thread does not wake up for the aborted transaction
+    this_thread::sleep_for(20ms);
+    EXPECT_EQ(m_i2cAccessor.GetWakeupJitter().wakeupsCount, 0u);
+}
+
+TEST_F(I2cAccessorTest, NewTransactionSupersedesWaitingOne)
+{
+    I2cTransaction waitingTransaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    waitingTransaction.SetCoroutine(DelayRepeatedly(1, 1h));
+    auto waitingFuture = waitingTransaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(waitingTransaction));
+    this_thread::sleep_for(10ms);
+
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(DelayRepeatedly(1, 1ms));
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+
+    ASSERT_EQ(waitingFuture.wait_for(100ms), future_status::ready);
+    EXPECT_EQ(waitingFuture.get(), HwResult::Abort);
+    EXPECT_EQ(future.get(), HwResult::Success);
+}
+
+TEST_F(I2cAccessorTest, AbortDeviceCompletesRunningTransaction)
+{
+    CompletionEvent started;
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(0x50);
+    transaction.AddCommand([&started] (I2cBus&, chrono::milliseconds&) {
+        started.Set(HwResult::Success);
+        this_thread::sleep_for(10ms);
+        return HwResult::Next;
+    });
+    transaction.AddCommand([] (I2cBus&, chrono::milliseconds&) { return HwResult::Completed; });
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+
+    started.Wait();
+    m_i2cAccessor.AbortDevice(0x50);
+    EXPECT_EQ(future.get(), HwResult::Abort);
+}
+
+TEST_F(I2cAccessorTest, TimerOfOwnerIsReplacedAndCancelled)
+{
+    int ownerId = m_i2cAccessor.AcquireTimerOwner();
+    ASSERT_GE(ownerId, 0);
+    int otherOwnerId = m_i2cAccessor.AcquireTimerOwner();
+    EXPECT_NE(otherOwnerId, ownerId);
+    m_i2cAccessor.ReleaseTimerOwner(otherOwnerId);
+
+    CompletionEvent replaced;
+    CompletionEvent due;
+    TimePoint dueTime;
+    TimePoint startTime = chrono::steady_clock::now();
+    m_i2cAccessor.PushTimer(ownerId, startTime + 1h, [&replaced] (HwResult status) { replaced.Set(status); });
+    m_i2cAccessor.PushTimer(ownerId, startTime + 5ms, [&due, &dueTime] (HwResult status) {
+        dueTime = chrono::steady_clock::now();
+        due.Set(status);
+    });
+    EXPECT_EQ(replaced.Wait(), HwResult::Abort);
+    EXPECT_EQ(due.Wait(), HwResult::Success);
+    EXPECT_GE(dueTime, startTime + 5ms);
+
+    // Transactions of the devices are not cancelled with the timer
+    I2cTransaction transaction = m_i2cAccessor.CreateTransaction(SimulatedMagnetSensor::c_address);
+    transaction.SetCoroutine(DelayRepeatedly(1, 20ms));
+    auto future = transaction.GetFuture();
+    m_i2cAccessor.PushTransaction(move(transaction));
+    CompletionEvent cancelled;
+    m_i2cAccessor.PushTimer(ownerId, chrono::steady_clock::now() + 1h,
+        [&cancelled] (HwResult status) { cancelled.Set(status); });
+    m_i2cAccessor.CancelTimer(ownerId);
+    EXPECT_EQ(cancelled.Wait(), HwResult::Abort);
+    EXPECT_EQ(future.get(), HwResult::Success);
+    m_i2cAccessor.ReleaseTimerOwner(ownerId);
+}
+
+TEST(SimulatedMotor, SpeedFollowsDutyAboveFriction)
+{
+    SimulatedMotorOptions options;
+    options.directionChangeDelay = 200ms;
+    SimulatedMotor motor(options);
+
+    // Friction holds the motor below the start duty
+    motor.Run(MotorDirection::Right, options.startDutyPercent / 2);
+    this_thread::sleep_for(50ms);
+    EXPECT_EQ(motor.GetSpeed(), 0);
+
+    // Several time constants later the speed settles on the duty-to-speed line
+    motor.Run(MotorDirection::Right, 50);
+    this_thread::sleep_for(300ms);
+    double expectedSpeed = options.maxSpeed * (50 - options.startDutyPercent) / 100;
+    EXPECT_NEAR(motor.GetSpeed(), expectedSpeed, expectedSpeed * 0.05);
+
+    // Inertia: the motor coasts after the stop
+    double stopPosition = motor.GetPosition();
+    motor.Stop();
+    this_thread::sleep_for(300ms);
+    EXPECT_EQ(motor.GetSpeed(), 0);
+    EXPECT_GT(motor.GetPosition(), stopPosition);
+
+    // Reversed drive is delayed by the backlash
+    double reversePosition = motor.GetPosition();
+    motor.Run(MotorDirection::Left, 100);
+    this_thread::sleep_for(50ms);
+    EXPECT_EQ(motor.GetPosition(), reversePosition);
+    this_thread::sleep_for(250ms);
+    EXPECT_LT(motor.GetPosition(), reversePosition);
+}
+
+TEST(SimulatedMotor, SensorsFollowMotors)
+{
+    auto spI2cBus = make_unique<SimulatedI2cBus>();
+    SimulatedI2cBus& i2cBus = *spI2cBus;
+    auto spNozzleMotor = make_unique<SimulatedMotor>(SimulatedMotor::GetNozzleOptions());
+    auto spValveMotor = make_unique<SimulatedMotor>(SimulatedMotor::GetValveOptions());
+    SimulatedMotor& nozzleMotor = *spNozzleMotor;
+    SimulatedMotor& valveMotor = *spValveMotor;
+    MotorControl motorNozzle(-1, -1);
+    MotorControl motorValve(-1, -1);
+    ASSERT_EQ(motorNozzle.Init(move(spNozzleMotor)), 0);
+    ASSERT_EQ(motorValve.Init(move(spValveMotor)), 0);
+
+    ConnectSimulatedNozzle(i2cBus, nozzleMotor, valveMotor);
+    I2cAccessor i2cAccessor;
+    ASSERT_EQ(i2cAccessor.Init(move(spI2cBus)), 0);
+    MagnetSensor magnetSensor(i2cAccessor);
+    PressureSensor pressureSensor(i2cAccessor);
+
+    ASSERT_EQ(magnetSensor.ReadSampleAsync().Get().status, HwResult::Success);
+    int64_t startAngle = magnetSensor.GetUnwrappedAngle();
+    ASSERT_EQ(pressureSensor.ReadSampleAsync().Get().status, HwResult::Success);
+    int closedPressure = pressureSensor.GetLastPressure();
+
+    // Sampled at least once per half turn while the nozzle turns
+    auto rotationFuture = magnetSensor.NotifyWhenAngle([] (int) { return HwResult::Repeat; }, nullptr);
+    motorNozzle.Run(MotorDirection::Right, 100);
+    motorValve.Run(MotorDirection::Open, 100);
+    this_thread::sleep_for(500ms);
+    motorNozzle.Stop();
+    motorValve.Stop();
+    this_thread::sleep_for(300ms);
+
+    ASSERT_EQ(magnetSensor.ReadSampleAsync().Get().status, HwResult::Success);
+    magnetSensor.AbortMeasurement();
+    EXPECT_EQ(rotationFuture.get(), HwResult::Abort);
+    EXPECT_NEAR(static_cast<double>(magnetSensor.GetUnwrappedAngle() - startAngle), nozzleMotor.GetPosition(), 1.0);
+    EXPECT_GT(nozzleMotor.GetPosition(), MagnetSensor::c_angleRange);
+
+    // Quarter turn opens the valve
+    ASSERT_EQ(pressureSensor.ReadSampleAsync().Get().status, HwResult::Success);
+    EXPECT_GT(pressureSensor.GetLastPressure(), closedPressure + 100);
+}
+
+TEST(NozzleControl, MonitoringStopsAndRestarts)
+{
+    NozzleControl nozzle;
+    nozzle.SetCloseValveOnExit(false);
+    ASSERT_EQ(nozzle.InitSimulated(), 0);
+
+    nozzle.StartMonitoring();
+    this_thread::sleep_for(100ms);
+    EXPECT_TRUE(nozzle.GetState().IsValid());
+
+    // Watchers complete with their next sample, then the streams stop sampling
+    nozzle.StopMonitoring();
+    this_thread::sleep_for(100ms);
+    HwState stoppedState = nozzle.GetState();
+    this_thread::sleep_for(100ms);
+    EXPECT_EQ(nozzle.GetState().angleTimeUs, stoppedState.angleTimeUs);
+    EXPECT_EQ(nozzle.GetState().pressureTimeUs, stoppedState.pressureTimeUs);
+
+    nozzle.StartMonitoring();
+    this_thread::sleep_for(100ms);
+    EXPECT_GT(nozzle.GetState().angleTimeUs, stoppedState.angleTimeUs);
+    EXPECT_GT(nozzle.GetState().pressureTimeUs, stoppedState.pressureTimeUs);
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+
+    return RUN_ALL_TESTS();
+}
@@ -19,7 +19,10 @@ class Sprinkler
 public:
     Sprinkler() = default;
 
-    int Init();
+    /// @param i2cTraceFileName: if not null, I2C operations of the nozzle are recorded to the file.
+    int Init(const char* i2cTraceFileName = nullptr);
+    /// @brief Runs the nozzle on simulated hardware, see NozzleControl::InitSimulated.
+    int InitSimulated();
 
     void SetLogger(Logger* pLogger);
     NozzleControlCalibrated& GetNozzleControl() { return *m_spNozzle; }
@@ -30,9 +33,11 @@ public:
 
     // Zone recording
     void StartZoneRecording(ZoneType type);
-    void AddZonePoint();
+    /// @return Failure if the sensors cannot be read, the point is not added.
+    HwResult AddZonePoint();
     const Zone* RecordedZone() const { return m_spNewZone.get(); }
-    std::unique_ptr<Zone>&& TakeRecordedZone() { return std::move(m_spNewZone); }
+    /// @brief Ends the recording.
+    std::unique_ptr<Zone>&& TakeRecordedZone();
 
 private:
     HwResult ApplyArea(const std::vector<HwCoord>& points, float density);
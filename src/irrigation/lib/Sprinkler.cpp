@@ -9,10 +9,22 @@ using namespace std;
 namespace Irrigation {
 
 static constexpr int c_defaultDutyPercent = 100;
+// Angle and pressure of a zone point are sampled at most this long before it is added
+static constexpr int64_t c_maxZonePointAgeUs = 50'000;
 
-int Sprinkler::Init() {
+static int64_t GetSteadyTimeUs()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int Sprinkler::Init(const char* i2cTraceFileName) {
     m_spNozzle.reset(new NozzleControlCalibrated());
-    return m_spNozzle->Init();
+    return m_spNozzle->Init(i2cTraceFileName);
+}
+
+int Sprinkler::InitSimulated() {
+    m_spNozzle.reset(new NozzleControlCalibrated());
+    return m_spNozzle->InitSimulated();
 }
 
 void Sprinkler::SetLogger(Logger* pLogger)
@@ -186,17 +198,38 @@ HwResult Sprinkler::ApplyPoints(const vector<HwCoord>& points, float density)
 void Sprinkler::StartZoneRecording(ZoneType type)
 {
     m_spNewZone.reset(new Zone(type));
+    m_spNozzle->StartMonitoring();
 }
 
-void Sprinkler::AddZonePoint()
+HwResult Sprinkler::AddZonePoint()
 {
     if (m_spNewZone == nullptr)
     {
-        return;
+        return HwResult::Failure;
+    }
+    // Angle and pressure of the same moment, sampled by the monitoring
+    HwState state = m_spNozzle->GetState();
+    if (!state.IsFresh(GetSteadyTimeUs(), c_maxZonePointAgeUs))
+    {
+        // Monitoring failed or was stopped, read the sensors now
+        m_spNozzle->StartMonitoring();
+        m_spNozzle->GetPressureFetchIfStale();
+        m_spNozzle->GetPositionFetchIfStale();
+        state = m_spNozzle->GetState();
+        if (!state.IsFresh(GetSteadyTimeUs(), c_maxZonePointAgeUs))
+        {
+            LogError("Zone point not added, sensors are not measured");
+            return HwResult::Failure;
+        }
     }
-    int r = m_spNozzle->GetPressureFetchIfStale();
-    int fi = m_spNozzle->GetPositionFetchIfStale();
-    m_spNewZone->AddPoint(r, fi);
+    m_spNewZone->AddPoint(state.pressure, state.rawAngle);
+    return HwResult::Success;
+}
+
+unique_ptr<Zone>&& Sprinkler::TakeRecordedZone()
+{
+    m_spNozzle->StopMonitoring();
+    return move(m_spNewZone);
 }
 
 }
@@ -20,7 +20,7 @@ constexpr const char* c_defaultLogFileName = "oto-pi.log";
 class OtoPiApp
 {
 public:
-    int Init(const char* configFileName)
+    int Init(const char* configFileName, const char* i2cTraceFileName, bool isSimulated)
     {
         if (m_configManager.LoadFromFile(configFileName) != 0 ||
             !m_configManager.IsValidConfig())
@@ -40,7 +40,7 @@ public:
         m_logger.SetLogLevel(LogLevel::Info);
         m_pLogger = &m_logger;
         
-        IfFailRet(m_sprinkler.Init());
+        IfFailRet(isSimulated ? m_sprinkler.InitSimulated() : m_sprinkler.Init(i2cTraceFileName));
         m_sprinkler.SetLogger(m_pLogger);
 
         m_mqttClient.SetLogger(m_pLogger);
@@ -153,13 +153,22 @@ private:
 int main(int argc, char *argv[])
 {
     char *configFileName = nullptr;
+    char *i2cTraceFileName = nullptr;
+    bool isSimulated = false;
 
     // Process command line arguments
-    for (int c = 0; c != -1; c = getopt(argc, argv, "c:")) {
+    for (int c = 0; c != -1; c = getopt(argc, argv, "c:t:s")) {
         switch (c) {
         case 'c':
             configFileName = optarg;
             break;
+        case 't':
+            i2cTraceFileName = optarg;
+            break;
+        case 's':
+            // Simulated motors and sensors, no Pi needed
+            isSimulated = true;
+            break;
         }
     }
 
@@ -170,7 +179,7 @@ int main(int argc, char *argv[])
     }
 
     OtoPiApp app;
-    IfFailRet(app.Init(configFileName));
+    IfFailRet(app.Init(configFileName, i2cTraceFileName, isSimulated));
 
     {
         // Idle
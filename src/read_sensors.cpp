@@ -55,6 +55,23 @@ int main()
         cout << "Angle: " << angle << endl;
     }
 
+    if (magnetSensor.ReadConfigAsync().get() == HwResult::Success)
+    {
+        MagnetConfig config = magnetSensor.GetConfig();
+        cout << "ZPOS: " << config.zpos << ", MPOS: " << config.mpos << ", MANG: " << config.mang << endl;
+        cout << "WD: " << config.conf.fields.wd << ", FTH: " << config.conf.fields.fth
+            << ", SF: " << config.conf.fields.sf << ", PWMF: " << config.conf.fields.pwmf
+            << ", OUTS: " << config.conf.fields.outs << ", HYST: " << config.conf.fields.hyst
+            << ", PM: " << config.conf.fields.pm << endl;
+    }
+
+    if (magnetSensor.ReadStatusAsync().get() == HwResult::Success)
+    {
+        StatusReg status = magnetSensor.GetLastStatus();
+        cout << "Magnet detected: " << status.fields.magnet_detected << ", high: " << status.fields.magnet_high
+            << ", low: " << status.fields.magnet_low << ", AGC: " << magnetSensor.GetLastAgc() << endl;
+    }
+
     pressureFuture.wait();
 
     if (pressureFuture.get() != HwResult::Success)
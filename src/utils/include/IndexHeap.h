@@ -0,0 +1,96 @@
+#pragma once
+
+#include <utility>
+
+/// @brief Binary min-heap of indices [0, capacity) into external storage.
+/// Position of every index is tracked, so any index can be removed in O(log n).
+/// Ordering is given by the Less functor passed to the modifying calls,
+/// keys must not change while the index is in the heap.
+template<int capacity>
+class IndexHeap
+{
+public:
+    IndexHeap()
+    {
+        for (int& position : m_positions)
+        {
+            position = -1;
+        }
+    }
+
+    bool IsEmpty() const { return m_size == 0; }
+    int GetSize() const { return m_size; }
+    int Top() const { return m_items[0]; }
+    bool Contains(int index) const { return m_positions[index] >= 0; }
+
+    template<typename Less>
+    void Push(int index, const Less& less)
+    {
+        m_items[m_size] = index;
+        m_positions[index] = m_size;
+        SiftUp(m_size++, less);
+    }
+
+    template<typename Less>
+    int Pop(const Less& less)
+    {
+        int index = m_items[0];
+        Remove(index, less);
+        return index;
+    }
+
+    template<typename Less>
+    void Remove(int index, const Less& less)
+    {
+        int pos = m_positions[index];
+        int lastIndex = m_items[--m_size];
+        Swap(pos, m_size);
+        m_positions[index] = -1;
+        if (pos < m_size)
+        {
+            // Last index moved into the hole may go either way
+            SiftUp(pos, less);
+            SiftDown(m_positions[lastIndex], less);
+        }
+    }
+
+private:
+    void Swap(int pos1, int pos2)
+    {
+        std::swap(m_items[pos1], m_items[pos2]);
+        m_positions[m_items[pos1]] = pos1;
+        m_positions[m_items[pos2]] = pos2;
+    }
+
+    template<typename Less>
+    void SiftUp(int pos, const Less& less)
+    {
+        while (pos > 0)
+        {
+            int parent = (pos - 1) / 2;
+            if (!less(m_items[pos], m_items[parent])) break;
+            Swap(pos, parent);
+            pos = parent;
+        }
+    }
+
+    template<typename Less>
+    void SiftDown(int pos, const Less& less)
+    {
+        while (true)
+        {
+            int smallest = pos;
+            int left = pos * 2 + 1;
+            int right = left + 1;
+            if (left < m_size && less(m_items[left], m_items[smallest])) smallest = left;
+            if (right < m_size && less(m_items[right], m_items[smallest])) smallest = right;
+            if (smallest == pos) break;
+            Swap(pos, smallest);
+            pos = smallest;
+        }
+    }
+
+    int m_items[capacity] = {};
+    int m_positions[capacity];
+    int m_size = 0;
+};
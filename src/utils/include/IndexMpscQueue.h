@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+/// @brief Lock-free multi-producer single-consumer FIFO of indices [0, capacity) into external storage.
+/// Intrusive: an index must not be pushed again before the consumer has popped it.
+/// Producers push with a single CAS, the consumer takes all queued indices at once,
+/// so there is no ABA problem.
+template<int capacity>
+class IndexMpscQueue
+{
+public:
+    void Push(int index)
+    {
+        int head = m_head.load(std::memory_order_relaxed);
+        do
+        {
+            m_next[index] = head;
+        }
+        while (!m_head.compare_exchange_weak(head, index, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool IsEmpty() const { return m_head.load(std::memory_order_relaxed) < 0; }
+
+    /// @brief Consumer only. Takes all queued indices in push order.
+    /// @return Number of indices written, at most capacity.
+    int PopAll(int (&indices)[capacity])
+    {
+        int count = 0;
+        for (int index = m_head.exchange(-1, std::memory_order_acquire); index >= 0; index = m_next[index])
+        {
+            indices[count++] = index;
+        }
+        std::reverse(indices, indices + count);
+        return count;
+    }
+
+private:
+    std::atomic<int> m_head = -1;
+    int m_next[capacity] = {};
+};
+
+/// @brief Lock-free LIFO of free indices [0, capacity), any thread may push and pop.
+/// Head carries a modification tag against ABA.
+template<int capacity>
+class IndexFreeList
+{
+public:
+    IndexFreeList()
+    {
+        for (auto& next : m_next)
+        {
+            next.store(-1, std::memory_order_relaxed);
+        }
+    }
+
+    /// @return Free index, -1 if there is none.
+    int Pop()
+    {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        while (true)
+        {
+            int index = GetIndex(head);
+            if (index < 0)
+            {
+                return -1;
+            }
+            // Stale value is possible when the index was popped meanwhile, then the CAS fails on the tag
+            int next = m_next[index].load(std::memory_order_relaxed);
+            if (m_head.compare_exchange_weak(head, MakeHead(head, next), std::memory_order_acquire,
+                std::memory_order_acquire))
+            {
+                return index;
+            }
+        }
+    }
+
+    void Push(int index)
+    {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        do
+        {
+            m_next[index].store(GetIndex(head), std::memory_order_relaxed);
+        }
+        while (!m_head.compare_exchange_weak(head, MakeHead(head, index), std::memory_order_release,
+            std::memory_order_relaxed));
+    }
+
+private:
+    static int GetIndex(uint64_t head) { return static_cast<int32_t>(static_cast<uint32_t>(head)); }
+    static uint64_t MakeHead(uint64_t prevHead, int index)
+    {
+        return ((prevHead >> 32) + 1) << 32 | static_cast<uint32_t>(index);
+    }
+
+    std::atomic<uint64_t> m_head = static_cast<uint32_t>(-1);
+    std::atomic<int> m_next[capacity];
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename Signature, size_t capacity>
+class InlineFunction;
+
+/// @brief Move-only replacement of std::function which never allocates.
+/// Callable is stored in the fixed size inline buffer, callables which do not fit
+/// are rejected at compile time.
+template<typename R, typename... Args, size_t capacity>
+class InlineFunction<R(Args...), capacity>
+{
+    template<typename F>
+    static constexpr bool c_isCallable = !std::is_same_v<std::decay_t<F>, InlineFunction> &&
+        std::is_invocable_r_v<R, std::decay_t<F>&, Args...>;
+
+public:
+    InlineFunction() = default;
+    InlineFunction(std::nullptr_t) {}
+
+    template<typename F, typename = std::enable_if_t<c_isCallable<F>>>
+    InlineFunction(F&& f)
+    {
+        using Functor = std::decay_t<F>;
+        static_assert(sizeof(Functor) <= capacity, "Callable does not fit into InlineFunction storage");
+        static_assert(alignof(Functor) <= alignof(std::max_align_t), "Callable is over-aligned");
+        static_assert(std::is_nothrow_move_constructible_v<Functor>, "Callable must be nothrow movable");
+
+        new (m_storage) Functor(std::forward<F>(f));
+        m_invoke = [] (void* storage, Args... args) -> R {
+            return (*static_cast<Functor*>(storage))(std::forward<Args>(args)...);
+        };
+        m_manage = [] (void* dst, void* src) {
+            Functor* srcFunctor = static_cast<Functor*>(src);
+            if (dst != nullptr)
+            {
+                new (dst) Functor(std::move(*srcFunctor));
+            }
+            srcFunctor->~Functor();
+        };
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    InlineFunction(InlineFunction&& other) noexcept
+    {
+        MoveFrom(other);
+    }
+
+    InlineFunction& operator=(InlineFunction&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    ~InlineFunction() { Reset(); }
+
+    void Reset()
+    {
+        if (m_manage != nullptr)
+        {
+            m_manage(nullptr, m_storage);
+            m_invoke = nullptr;
+            m_manage = nullptr;
+        }
+    }
+
+    explicit operator bool() const { return m_invoke != nullptr; }
+
+    // Const like std::function::operator(), stored callable may still be mutable.
+    R operator()(Args... args) const
+    {
+        return m_invoke(m_storage, std::forward<Args>(args)...);
+    }
+
+    static constexpr size_t Capacity() { return capacity; }
+
+private:
+    void MoveFrom(InlineFunction& other)
+    {
+        if (other.m_manage != nullptr)
+        {
+            other.m_manage(m_storage, other.m_storage);
+            m_invoke = other.m_invoke;
+            m_manage = other.m_manage;
+            other.m_invoke = nullptr;
+            other.m_manage = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) mutable unsigned char m_storage[capacity];
+    R (*m_invoke)(void*, Args...) = nullptr;
+    // Moves callable from src to dst (if dst is not null) and destroys src.
+    void (*m_manage)(void* dst, void* src) = nullptr;
+};
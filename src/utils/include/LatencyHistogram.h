@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+/// @brief Histogram of durations with fixed width buckets, used for percentile reports.
+/// Durations beyond the last bucket are counted in it. Never allocates.
+template<int bucketsCount, int64_t bucketWidthUs>
+class LatencyHistogram
+{
+public:
+    void Add(std::chrono::microseconds duration)
+    {
+        int64_t durationUs = std::max<int64_t>(duration.count(), 0);
+        int64_t bucket = std::min<int64_t>(durationUs / bucketWidthUs, bucketsCount - 1);
+        ++m_buckets[bucket];
+        ++m_count;
+        m_totalUs += durationUs;
+        m_maxUs = std::max(m_maxUs, durationUs);
+    }
+
+    void Reset() { *this = LatencyHistogram(); }
+
+    uint64_t GetCount() const { return m_count; }
+    std::chrono::microseconds GetMax() const { return std::chrono::microseconds(m_maxUs); }
+    std::chrono::microseconds GetMean() const
+    {
+        return std::chrono::microseconds(m_count > 0 ? m_totalUs / static_cast<int64_t>(m_count) : 0);
+    }
+
+    /// @return Upper bound of the bucket holding the percentile, but not more than the maximum.
+    /// Maximum for the overflow bucket.
+    std::chrono::microseconds GetPercentile(double percentile) const
+    {
+        uint64_t rank = static_cast<uint64_t>(static_cast<double>(m_count) * percentile / 100.);
+        uint64_t count = 0;
+        for (int bucket = 0; bucket < bucketsCount; ++bucket)
+        {
+            count += m_buckets[bucket];
+            if (count > rank)
+            {
+                int64_t upperBoundUs = bucket < bucketsCount - 1 ? (bucket + 1) * bucketWidthUs : m_maxUs;
+                return std::chrono::microseconds(std::min(upperBoundUs, m_maxUs));
+            }
+        }
+        return GetMax();
+    }
+
+private:
+    uint64_t m_buckets[bucketsCount] = {};
+    uint64_t m_count = 0;
+    int64_t m_totalUs = 0;
+    int64_t m_maxUs = 0;
+};
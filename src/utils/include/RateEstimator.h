@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+/// @brief Configuration of RateEstimator. Values are in units of the measurement, rates in units per second.
+struct RateEstimatorOptions
+{
+    enum class Type : int
+    {
+        AlphaBeta,
+        Kalman
+    };
+
+    Type type = Type::Kalman;
+
+    // Alpha-beta gains of the value and rate corrections
+    float alpha = 0.3f;
+    float beta = 0.05f;
+
+    // Kalman: spectral density of the white noise acceleration, units^2 / s^3
+    double processNoise = 1.0;
+    // Kalman: variance of a measurement, units^2
+    double measurementNoise = 1.0;
+    // Kalman: variance of the rate before the second measurement, units^2 / s^2
+    double initialRateVariance = 1e12;
+
+    // Estimate restarts from the measurement after a longer gap
+    int64_t maxGapUs = 100'000;
+};
+
+/// @brief Estimates value and rate of change of a noisy measurement with constant velocity model.
+/// Alpha-beta filter has fixed gains, Kalman filter adapts them to the interval between measurements.
+/// Not thread safe.
+class RateEstimator
+{
+public:
+    explicit RateEstimator(const RateEstimatorOptions& options = {}) : m_options(options) {}
+
+    void SetOptions(const RateEstimatorOptions& options)
+    {
+        m_options = options;
+        Reset();
+    }
+    const RateEstimatorOptions& GetOptions() const { return m_options; }
+
+    void Reset() { m_isInitialized = false; }
+    bool IsInitialized() const { return m_isInitialized; }
+
+    /// @param timeUs: monotonic time of the measurement. Measurement not newer than the previous one
+    /// only corrects the value.
+    void Update(double measurement, int64_t timeUs)
+    {
+        int64_t elapsedUs = timeUs - m_timeUs;
+        if (!m_isInitialized || elapsedUs > m_options.maxGapUs)
+        {
+            Initialize(measurement, timeUs);
+            return;
+        }
+
+        double dt = elapsedUs > 0 ? static_cast<double>(elapsedUs) * 1e-6 : 0.0;
+        if (m_options.type == RateEstimatorOptions::Type::AlphaBeta)
+        {
+            double residual = measurement - (m_value + m_rate * dt);
+            m_value += m_rate * dt + m_options.alpha * residual;
+            if (dt > 0.0)
+            {
+                m_rate += m_options.beta * residual / dt;
+            }
+        }
+        else
+        {
+            UpdateKalman(measurement, dt);
+        }
+        m_timeUs = std::max(m_timeUs, timeUs);
+    }
+
+    double GetValue() const { return m_value; }
+    /// @brief Units per second.
+    double GetRate() const { return m_rate; }
+    int64_t GetTimeUs() const { return m_timeUs; }
+
+    /// @brief Value extrapolated to timeUs.
+    double Predict(int64_t timeUs) const
+    {
+        return m_value + m_rate * static_cast<double>(timeUs - m_timeUs) * 1e-6;
+    }
+
+private:
+    void Initialize(double measurement, int64_t timeUs)
+    {
+        m_value = measurement;
+        m_rate = 0.0;
+        m_timeUs = timeUs;
+        m_p00 = m_options.measurementNoise;
+        m_p01 = 0.0;
+        m_p11 = m_options.initialRateVariance;
+        m_isInitialized = true;
+    }
+
+    void UpdateKalman(double measurement, double dt)
+    {
+        // Predict, covariance of the value and the rate grows with the interval
+        double q = m_options.processNoise;
+        m_value += m_rate * dt;
+        m_p00 += dt * (2.0 * m_p01 + dt * m_p11) + q * dt * dt * dt / 3.0;
+        m_p01 += dt * m_p11 + q * dt * dt / 2.0;
+        m_p11 += q * dt;
+
+        // Correct
+        double s = m_p00 + m_options.measurementNoise;
+        double k0 = m_p00 / s;
+        double k1 = m_p01 / s;
+        double residual = measurement - m_value;
+        m_value += k0 * residual;
+        m_rate += k1 * residual;
+
+        m_p11 -= k1 * m_p01;
+        m_p00 *= 1.0 - k0;
+        m_p01 *= 1.0 - k0;
+    }
+
+    RateEstimatorOptions m_options;
+    bool m_isInitialized = false;
+    double m_value = 0.0;
+    double m_rate = 0.0;
+    int64_t m_timeUs = 0;
+    // Kalman covariance of the value and the rate
+    double m_p00 = 0.0;
+    double m_p01 = 0.0;
+    double m_p11 = 0.0;
+};
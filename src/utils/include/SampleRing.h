@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/// @brief Lock-free single-producer multi-consumer ring of the latest samples.
+/// Producer never waits for readers, it overwrites the oldest sample. Every slot is a seqlock,
+/// so readers detect overwritten samples and skip them instead of reading torn data.
+/// Samples are stored as relaxed atomic words, T must be trivially copyable.
+template<typename T, int capacity>
+class SampleRing
+{
+    static_assert(std::is_trivially_copyable_v<T>, "Samples are copied as raw words");
+    static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+
+    static constexpr int c_wordsCount = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    static constexpr uint64_t c_writingPosition = UINT64_MAX;
+
+public:
+    /// @brief Read position of a consumer. Starts at the oldest sample still in the ring,
+    /// or use GetCursor to read only samples pushed from now on.
+    struct Cursor
+    {
+        uint64_t position = 0;
+        // Samples overwritten before the consumer read them
+        uint64_t lostCount = 0;
+    };
+
+    /// @brief Last samples of the ring, read in place. Check IsValid after reading the samples:
+    /// the producer may have overwritten them meanwhile.
+    class View
+    {
+    public:
+        int GetSize() const { return m_size; }
+        bool IsEmpty() const { return m_size == 0; }
+
+        /// @param i: 0 is the oldest sample of the view, GetSize() - 1 the newest.
+        T operator[](int i) const { return m_pRing->Load(m_firstPosition + i); }
+        T Back() const { return (*this)[m_size - 1]; }
+
+        bool IsValid() const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Slot of the first sample is rewritten while the head is one position behind
+            return m_pRing->m_head.load(std::memory_order_relaxed) - m_firstPosition < capacity;
+        }
+
+    private:
+        friend class SampleRing;
+        View(const SampleRing* pRing, uint64_t firstPosition, int size) :
+            m_pRing(pRing), m_firstPosition(firstPosition), m_size(size)
+        {}
+
+        const SampleRing* m_pRing;
+        uint64_t m_firstPosition;
+        int m_size;
+    };
+
+    static constexpr int Capacity() { return capacity; }
+
+    /// @brief Producer only.
+    void Push(const T& sample)
+    {
+        uint64_t position = m_head.load(std::memory_order_relaxed);
+        Slot& slot = m_slots[position % capacity];
+
+        slot.position.store(c_writingPosition, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint64_t words[c_wordsCount] = {};
+        std::memcpy(words, &sample, sizeof(T));
+        for (int i = 0; i < c_wordsCount; ++i)
+        {
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+
+        slot.position.store(position, std::memory_order_release);
+        m_head.store(position + 1, std::memory_order_release);
+    }
+
+    /// @brief Number of samples pushed since construction.
+    uint64_t GetPushedCount() const { return m_head.load(std::memory_order_acquire); }
+
+    /// @brief Cursor reading only samples pushed after the call.
+    Cursor GetCursor() const { return Cursor { GetPushedCount(), 0 }; }
+
+    /// @brief Reads the next sample of the cursor, skipping overwritten ones.
+    /// @return false if the cursor caught up with the producer.
+    bool Pop(Cursor& cursor, T& sample) const
+    {
+        while (true)
+        {
+            uint64_t head = GetPushedCount();
+            if (cursor.position >= head)
+            {
+                return false;
+            }
+            if (head - cursor.position > capacity)
+            {
+                cursor.lostCount += head - capacity - cursor.position;
+                cursor.position = head - capacity;
+            }
+
+            if (TryLoad(cursor.position, sample))
+            {
+                ++cursor.position;
+                return true;
+            }
+            // Overwritten while reading, the head has moved on
+            ++cursor.lostCount;
+            ++cursor.position;
+        }
+    }
+
+    /// @brief Reads all samples available for the cursor.
+    /// @return Number of samples written to samples, at most maxCount.
+    int PopAll(Cursor& cursor, T* samples, int maxCount) const
+    {
+        int count = 0;
+        while (count < maxCount && Pop(cursor, samples[count]))
+        {
+            ++count;
+        }
+        return count;
+    }
+
+    /// @brief View of the last count samples, fewer if fewer were pushed.
+    View GetLast(int count) const
+    {
+        uint64_t head = GetPushedCount();
+        // Keep one slot out of the view, the producer may be writing it
+        uint64_t size = std::min<uint64_t>({ static_cast<uint64_t>(std::max(count, 0)), head,
+            static_cast<uint64_t>(capacity - 1) });
+        return View(this, head - size, static_cast<int>(size));
+    }
+
+    /// @return false if nothing was pushed yet.
+    bool GetLatest(T& sample) const
+    {
+        while (true)
+        {
+            uint64_t head = GetPushedCount();
+            if (head == 0)
+            {
+                return false;
+            }
+            if (TryLoad(head - 1, sample))
+            {
+                return true;
+            }
+        }
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> position = c_writingPosition;
+        std::atomic<uint64_t> words[c_wordsCount] = {};
+    };
+
+    T Load(uint64_t position) const
+    {
+        const Slot& slot = m_slots[position % capacity];
+        uint64_t words[c_wordsCount];
+        for (int i = 0; i < c_wordsCount; ++i)
+        {
+            words[i] = slot.words[i].load(std::memory_order_relaxed);
+        }
+        T sample;
+        std::memcpy(&sample, words, sizeof(T));
+        return sample;
+    }
+
+    bool TryLoad(uint64_t position, T& sample) const
+    {
+        const Slot& slot = m_slots[position % capacity];
+        if (slot.position.load(std::memory_order_acquire) != position)
+        {
+            return false;
+        }
+        sample = Load(position);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.position.load(std::memory_order_relaxed) == position;
+    }
+
+    Slot m_slots[capacity];
+    std::atomic<uint64_t> m_head = 0;
+};
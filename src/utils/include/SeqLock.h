@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+/// @brief Value shared by writers on any thread with readers which never block them.
+/// Sequence is odd while a writer modifies the value, readers retry if it changed while they were reading.
+/// Value is stored as relaxed atomic words, T must be trivially copyable.
+template<typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable_v<T>, "Value is copied as raw words");
+
+    static constexpr int c_wordsCount = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    // Retries before a reader yields to a writer preempted in the middle of the update
+    static constexpr int c_spinsBeforeYield = 16;
+
+public:
+    SeqLock() { StoreWords(T {}); }
+
+    /// @brief Modifies part of the value in place, readers see the whole update or none of it.
+    /// Concurrent writers are serialized.
+    template<typename Modify>
+    void Update(Modify&& modify)
+    {
+        uint64_t sequence = Lock();
+        T value = LoadWords();
+        modify(value);
+        StoreWords(value);
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    void Store(const T& value)
+    {
+        uint64_t sequence = Lock();
+        StoreWords(value);
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    /// @return false if a writer modified the value meanwhile.
+    bool TryLoad(T& value) const
+    {
+        uint64_t sequence = m_sequence.load(std::memory_order_acquire);
+        if (sequence & 1)
+        {
+            return false;
+        }
+        value = LoadWords();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return m_sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+    T Load() const
+    {
+        T value;
+        for (int spins = 1; !TryLoad(value); ++spins)
+        {
+            if (spins % c_spinsBeforeYield == 0)
+            {
+                std::this_thread::yield();
+            }
+        }
+        return value;
+    }
+
+    /// @brief Number of completed updates.
+    uint64_t GetVersion() const { return m_sequence.load(std::memory_order_acquire) / 2; }
+
+private:
+    uint64_t Lock()
+    {
+        uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+        while ((sequence & 1) || !m_sequence.compare_exchange_weak(sequence, sequence + 1,
+            std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            if (sequence & 1)
+            {
+                std::this_thread::yield();
+                sequence = m_sequence.load(std::memory_order_relaxed);
+            }
+        }
+        // Readers seeing any of the words below see the odd sequence
+        std::atomic_thread_fence(std::memory_order_release);
+        return sequence;
+    }
+
+    T LoadWords() const
+    {
+        uint64_t words[c_wordsCount];
+        for (int i = 0; i < c_wordsCount; ++i)
+        {
+            words[i] = m_words[i].load(std::memory_order_relaxed);
+        }
+        T value;
+        std::memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+    void StoreWords(const T& value)
+    {
+        uint64_t words[c_wordsCount] = {};
+        std::memcpy(words, &value, sizeof(T));
+        for (int i = 0; i < c_wordsCount; ++i)
+        {
+            m_words[i].store(words[i], std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<uint64_t> m_sequence = 0;
+    std::atomic<uint64_t> m_words[c_wordsCount];
+};
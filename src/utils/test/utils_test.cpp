@@ -1,7 +1,19 @@
+#include "IndexHeap.h"
+#include "IndexMpscQueue.h"
+#include "InlineFunction.h"
+#include "LatencyHistogram.h"
 #include "MathUtils.h"
+#include "RateEstimator.h"
+#include "SampleRing.h"
+#include "SeqLock.h"
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
 using namespace std;
 
 // Test OvershootInterpolator with different template parameters
@@ -289,6 +301,431 @@ TEST(SequenceTrendAnalyzer, Clear)
     EXPECT_EQ(analyzer.Size(), 0);
 }
 
+TEST(InlineFunction, InvokeAndMove)
+{
+    int base = 10;
+    InlineFunction<int(int), 32> add = [base] (int x) { return base + x; };
+    EXPECT_TRUE(add);
+    EXPECT_EQ(add(5), 15);
+
+    InlineFunction<int(int), 32> moved = std::move(add);
+    EXPECT_FALSE(add);
+    EXPECT_TRUE(moved);
+    EXPECT_EQ(moved(7), 17);
+}
+
+TEST(InlineFunction, MutableState)
+{
+    InlineFunction<int(), 16> counter = [count = 0] () mutable { return ++count; };
+    EXPECT_EQ(counter(), 1);
+    EXPECT_EQ(counter(), 2);
+
+    InlineFunction<int(), 16> moved;
+    moved = std::move(counter);
+    EXPECT_EQ(moved(), 3);
+}
+
+TEST(InlineFunction, DestroysCallable)
+{
+    auto spValue = make_shared<int>(42);
+    {
+        InlineFunction<int(), 32> f = [spValue] { return *spValue; };
+        EXPECT_EQ(spValue.use_count(), 2);
+
+        InlineFunction<int(), 32> moved = std::move(f);
+        EXPECT_EQ(spValue.use_count(), 2);
+        EXPECT_EQ(moved(), 42);
+
+        moved.Reset();
+        EXPECT_FALSE(moved);
+        EXPECT_EQ(spValue.use_count(), 1);
+
+        moved = [spValue] { return *spValue + 1; };
+        EXPECT_EQ(spValue.use_count(), 2);
+    }
+    EXPECT_EQ(spValue.use_count(), 1);
+}
+
+TEST(InlineFunction, MoveOnlyCapture)
+{
+    auto spValue = make_unique<int>(5);
+    InlineFunction<int(int), 32> f = [spValue = std::move(spValue)] (int x) { return *spValue * x; };
+    EXPECT_EQ(f(3), 15);
+}
+
+TEST(IndexHeap, PopsInKeyOrder)
+{
+    int keys[] = { 7, 3, 9, 1, 5, 8, 2, 6, 4, 0 };
+    auto less = [&keys] (int idx1, int idx2) { return keys[idx1] < keys[idx2]; };
+
+    IndexHeap<10> heap;
+    for (int i = 0; i < 10; ++i)
+    {
+        heap.Push(i, less);
+    }
+
+    int prevKey = -1;
+    while (!heap.IsEmpty())
+    {
+        int idx = heap.Pop(less);
+        EXPECT_FALSE(heap.Contains(idx));
+        EXPECT_GT(keys[idx], prevKey);
+        prevKey = keys[idx];
+    }
+}
+
+TEST(IndexHeap, RemoveArbitraryIndex)
+{
+    int keys[] = { 7, 3, 9, 1, 5, 8, 2, 6, 4, 0 };
+    auto less = [&keys] (int idx1, int idx2) { return keys[idx1] < keys[idx2]; };
+
+    IndexHeap<10> heap;
+    for (int i = 0; i < 10; ++i)
+    {
+        heap.Push(i, less);
+    }
+
+    for (int idx : { 4, 9, 0, 2 })
+    {
+        heap.Remove(idx, less);
+        EXPECT_FALSE(heap.Contains(idx));
+    }
+    EXPECT_EQ(heap.GetSize(), 6);
+
+    vector<int> poppedKeys;
+    while (!heap.IsEmpty())
+    {
+        poppedKeys.push_back(keys[heap.Pop(less)]);
+    }
+    EXPECT_EQ(poppedKeys, vector<int>({ 1, 2, 3, 4, 6, 8 }));
+}
+
+TEST(LatencyHistogram, Percentiles)
+{
+    LatencyHistogram<100, 10> histogram;
+    for (int i = 0; i < 1000; ++i)
+    {
+        histogram.Add(chrono::microseconds(i));
+    }
+
+    EXPECT_EQ(histogram.GetCount(), 1000u);
+    EXPECT_EQ(histogram.GetMean().count(), 499);
+    EXPECT_EQ(histogram.GetMax().count(), 999);
+    EXPECT_EQ(histogram.GetPercentile(50).count(), 510);
+    EXPECT_EQ(histogram.GetPercentile(99).count(), 999);
+}
+
+TEST(LatencyHistogram, OverflowAndNegative)
+{
+    LatencyHistogram<10, 10> histogram;
+    histogram.Add(chrono::microseconds(-5));
+    histogram.Add(chrono::microseconds(5000));
+
+    EXPECT_EQ(histogram.GetPercentile(0).count(), 10);
+    EXPECT_EQ(histogram.GetPercentile(99).count(), 5000);
+
+    histogram.Reset();
+    EXPECT_EQ(histogram.GetCount(), 0u);
+    EXPECT_EQ(histogram.GetPercentile(99).count(), 0);
+}
+
+TEST(IndexMpscQueue, PopsAllInPushOrder)
+{
+    IndexMpscQueue<8> queue;
+    EXPECT_TRUE(queue.IsEmpty());
+    for (int index : { 5, 2, 7 })
+    {
+        queue.Push(index);
+    }
+
+    int indices[8];
+    ASSERT_EQ(queue.PopAll(indices), 3);
+    EXPECT_EQ(indices[0], 5);
+    EXPECT_EQ(indices[1], 2);
+    EXPECT_EQ(indices[2], 7);
+    EXPECT_TRUE(queue.IsEmpty());
+    EXPECT_EQ(queue.PopAll(indices), 0);
+}
+
+TEST(IndexMpscQueue, ConcurrentProducersWithFreeList)
+{
+    static constexpr int c_capacity = 16;
+    static constexpr int c_producersCount = 4;
+    static constexpr int c_pushesPerProducer = 10'000;
+
+    IndexFreeList<c_capacity> freeList;
+    IndexMpscQueue<c_capacity> queue;
+    for (int i = 0; i < c_capacity; ++i)
+    {
+        freeList.Push(i);
+    }
+
+    // Producer writes its id into the index storage, consumer checks it is not overwritten while queued
+    int owners[c_capacity] = {};
+    vector<thread> producers;
+    for (int producer = 1; producer <= c_producersCount; ++producer)
+    {
+        producers.emplace_back([&, producer] {
+            for (int i = 0; i < c_pushesPerProducer; ++i)
+            {
+                int index = freeList.Pop();
+                while (index < 0)
+                {
+                    this_thread::yield();
+                    index = freeList.Pop();
+                }
+                owners[index] = producer;
+                queue.Push(index);
+            }
+        });
+    }
+
+    int consumedCount = 0;
+    bool isOwnerValid = true;
+    while (consumedCount < c_producersCount * c_pushesPerProducer)
+    {
+        int indices[c_capacity];
+        int count = queue.PopAll(indices);
+        if (count == 0)
+        {
+            this_thread::yield();
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            isOwnerValid = isOwnerValid && owners[indices[i]] >= 1 && owners[indices[i]] <= c_producersCount;
+            owners[indices[i]] = 0;
+            freeList.Push(indices[i]);
+        }
+        consumedCount += count;
+    }
+    for (thread& producer : producers)
+    {
+        producer.join();
+    }
+
+    EXPECT_TRUE(isOwnerValid);
+
+    // Every index is back in the free list exactly once
+    vector<int> freeIndices;
+    for (int index = freeList.Pop(); index >= 0; index = freeList.Pop())
+    {
+        freeIndices.push_back(index);
+    }
+    sort(freeIndices.begin(), freeIndices.end());
+    ASSERT_EQ(freeIndices.size(), static_cast<size_t>(c_capacity));
+    for (int i = 0; i < c_capacity; ++i)
+    {
+        EXPECT_EQ(freeIndices[i], i);
+    }
+}
+
+struct TestSample
+{
+    uint32_t sequence;
+    uint32_t check;
+    uint64_t timeUs;
+};
+
+TEST(SampleRing, CursorCatchesUpAndCountsLost)
+{
+    SampleRing<TestSample, 8> ring;
+    SampleRing<TestSample, 8>::Cursor cursor;
+    TestSample sample = {};
+    EXPECT_FALSE(ring.Pop(cursor, sample));
+    EXPECT_FALSE(ring.GetLatest(sample));
+
+    for (uint32_t i = 0; i < 5; ++i)
+    {
+        ring.Push({ i, ~i, i * 1000u });
+    }
+    auto newCursor = ring.GetCursor();
+
+    TestSample samples[8];
+    ASSERT_EQ(ring.PopAll(cursor, samples, 8), 5);
+    EXPECT_EQ(samples[0].sequence, 0u);
+    EXPECT_EQ(samples[4].sequence, 4u);
+    EXPECT_EQ(cursor.lostCount, 0u);
+
+    // Producer laps the slow cursor
+    for (uint32_t i = 5; i < 20; ++i)
+    {
+        ring.Push({ i, ~i, i * 1000u });
+    }
+    ASSERT_EQ(ring.PopAll(newCursor, samples, 8), 8);
+    EXPECT_EQ(samples[0].sequence, 12u);
+    EXPECT_EQ(samples[7].sequence, 19u);
+    EXPECT_EQ(newCursor.lostCount, 7u);
+    EXPECT_FALSE(ring.Pop(newCursor, sample));
+
+    ASSERT_TRUE(ring.GetLatest(sample));
+    EXPECT_EQ(sample.sequence, 19u);
+    EXPECT_EQ(ring.GetPushedCount(), 20u);
+}
+
+TEST(SampleRing, ViewOfLastSamples)
+{
+    SampleRing<TestSample, 8> ring;
+    EXPECT_TRUE(ring.GetLast(4).IsEmpty());
+
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        ring.Push({ i, ~i, 0 });
+    }
+    auto view = ring.GetLast(4);
+    ASSERT_EQ(view.GetSize(), 3);
+    EXPECT_EQ(view[0].sequence, 0u);
+    EXPECT_EQ(view.Back().sequence, 2u);
+    EXPECT_TRUE(view.IsValid());
+
+    for (uint32_t i = 3; i < 20; ++i)
+    {
+        ring.Push({ i, ~i, 0 });
+    }
+    // Slot being written is never part of a view
+    EXPECT_EQ(ring.GetLast(100).GetSize(), 7);
+    EXPECT_FALSE(view.IsValid());
+}
+
+TEST(SampleRing, ConcurrentReadersSeeConsistentSamples)
+{
+    static constexpr uint32_t c_samplesCount = 200'000;
+    SampleRing<TestSample, 16> ring;
+
+    auto reader = [&ring] {
+        SampleRing<TestSample, 16>::Cursor cursor;
+        uint64_t readCount = 0;
+        uint32_t prevSequence = 0;
+        bool isConsistent = true;
+        TestSample sample;
+        while (cursor.position < c_samplesCount)
+        {
+            if (!ring.Pop(cursor, sample))
+            {
+                this_thread::yield();
+                continue;
+            }
+            isConsistent = isConsistent && sample.check == ~sample.sequence &&
+                (readCount == 0 || sample.sequence > prevSequence);
+            prevSequence = sample.sequence;
+            ++readCount;
+        }
+        EXPECT_TRUE(isConsistent);
+        EXPECT_EQ(readCount + cursor.lostCount, c_samplesCount);
+    };
+
+    thread reader1(reader);
+    thread reader2(reader);
+    for (uint32_t i = 0; i < c_samplesCount; ++i)
+    {
+        ring.Push({ i, ~i, i });
+    }
+    reader1.join();
+    reader2.join();
+}
+
+static double RampValue(int64_t timeUs) { return static_cast<double>(timeUs) * 1e-3; }
+
+// Ramp of 1000 units per second sampled every 400 us with +-50 units of deterministic noise
+static void FeedRamp(RateEstimator& estimator, int count)
+{
+    static constexpr int c_noise[] = { 50, -30, -50, 20, 40, -10, -40, 30 };
+    for (int i = 0; i < count; ++i)
+    {
+        int64_t timeUs = 1'000'000 + i * 400;
+        estimator.Update(RampValue(timeUs) + c_noise[i % 8], timeUs);
+    }
+}
+
+TEST(RateEstimator, KalmanTracksRampWithinMillisecond)
+{
+    RateEstimatorOptions options;
+    options.processNoise = 10.0;
+    options.measurementNoise = 50.0 * 50.0;
+    RateEstimator estimator(options);
+    FeedRamp(estimator, 2000);
+
+    // Integer milliseconds would see the same time for consecutive samples
+    EXPECT_NEAR(estimator.GetRate(), 1000.0, 50.0);
+    EXPECT_NEAR(estimator.GetValue(), RampValue(estimator.GetTimeUs()), 20.0);
+    EXPECT_NEAR(estimator.Predict(estimator.GetTimeUs() + 10'000), RampValue(estimator.GetTimeUs()) + 10.0, 20.0);
+}
+
+TEST(RateEstimator, AlphaBetaTracksRamp)
+{
+    RateEstimatorOptions options;
+    options.type = RateEstimatorOptions::Type::AlphaBeta;
+    options.alpha = 0.1f;
+    options.beta = 0.005f;
+    RateEstimator estimator(options);
+    FeedRamp(estimator, 2000);
+
+    EXPECT_NEAR(estimator.GetRate(), 1000.0, 100.0);
+    EXPECT_NEAR(estimator.GetValue(), RampValue(estimator.GetTimeUs()), 20.0);
+}
+
+TEST(RateEstimator, RestartsAfterGap)
+{
+    RateEstimator estimator;
+    estimator.Update(10.0, 0);
+    estimator.Update(20.0, 1'000);
+    EXPECT_GT(estimator.GetRate(), 0.0);
+
+    estimator.Update(5.0, 1'000 + estimator.GetOptions().maxGapUs + 1);
+    EXPECT_EQ(estimator.GetValue(), 5.0);
+    EXPECT_EQ(estimator.GetRate(), 0.0);
+}
+
+struct TestState
+{
+    uint64_t first = 0;
+    uint64_t firstCheck = ~0ull;
+    uint32_t second = 0;
+    uint32_t secondCheck = ~0u;
+};
+
+TEST(SeqLock, ReadersSeeWholeUpdatesOfConcurrentWriters)
+{
+    static constexpr uint32_t c_updatesCount = 50'000;
+    SeqLock<TestState> state;
+
+    // Each writer updates its own part of the state
+    thread firstWriter([&state] {
+        for (uint64_t i = 1; i <= c_updatesCount; ++i)
+        {
+            state.Update([i] (TestState& s) { s.first = i; s.firstCheck = ~i; });
+        }
+    });
+    thread secondWriter([&state] {
+        for (uint32_t i = 1; i <= c_updatesCount; ++i)
+        {
+            state.Update([i] (TestState& s) { s.second = i; s.secondCheck = ~i; });
+        }
+    });
+
+    bool isConsistent = true;
+    TestState prev;
+    TestState cur;
+    while (cur.first < c_updatesCount || cur.second < c_updatesCount)
+    {
+        cur = state.Load();
+        isConsistent = isConsistent && cur.firstCheck == ~cur.first && cur.secondCheck == ~cur.second &&
+            cur.first >= prev.first && cur.second >= prev.second;
+        prev = cur;
+        this_thread::yield();
+    }
+    firstWriter.join();
+    secondWriter.join();
+
+    EXPECT_TRUE(isConsistent);
+    EXPECT_EQ(state.GetVersion(), 2ull * c_updatesCount);
+
+    state.Store(TestState {});
+    TestState reset;
+    ASSERT_TRUE(state.TryLoad(reset));
+    EXPECT_EQ(reset.first, 0u);
+    EXPECT_EQ(reset.secondCheck, ~0u);
+}
+
 int main(int argc, char **argv)
 {
     testing::InitGoogleTest(&argc, argv);